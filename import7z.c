@@ -7,43 +7,110 @@
 #include "lzma/7zCrc.h"
 #include "lzma/7zAlloc.h"
 #include "lzma/7zFile.h"
+#include "lzma/LzmaDec.h"
+#include "lzma/Lzma2Dec.h"
+#include "lzma/CpuArch.h"
+#ifndef MS_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#define HAVE_INDEX_MMAP
+#endif
+#ifdef USE_POSIX_FILE
+#include <pthread.h>
+#define HAVE_READ_AHEAD
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#if PY_VERSION_HEX >= 0x030B0000
+/* moved to the internal pycore_fileutils.h, but still exported */
+PyAPI_FUNC(int) _Py_stat(PyObject *path, struct stat *status);
+#endif
 
 
 #define IS_SOURCE   0x0
 #define IS_BYTECODE 0x1
 #define IS_PACKAGE  0x2
+#define IS_PYCACHE  0x4
 #define INPUT_BUFSIZE ((size_t)1 << 18)
+#define READ_WINDOW_SIZE ((size_t)1 << 20)
+#define READ_AHEAD_BUFSIZE ((size_t)1 << 20)
+#define SFX_SCAN_LIMIT ((UInt64)1 << 22)
+#define STREAM_MIN_SIZE ((UInt64)1 << 20)   /* smaller resources are read whole */
+#define STREAM_SKIP_BUFSIZE ((size_t)1 << 16)
+#define FILEOBJ_BLOCK_SIZE ((size_t)1 << 16)
+#define FILEOBJ_NUM_BLOCKS 64
+#define FILEOBJ_READ_AHEAD 4    /* blocks read by one readinto() */
+#define SOURCE_CACHE_LIMIT ((Py_ssize_t)1 << 22)
+#define CACHE_DIR_ENV "IMPORT7Z_CACHE_DIR"
+#define INDEX_MAGIC "7zIndex\x03"
+#define INDEX_SUFFIX ".7zidx"
+#define CODE_CACHE_SUFFIX ".pyc"
+#define SNAPSHOT_MAGIC "7zSnap\x02\x00"
+#define SNAPSHOT_SUFFIX ".7zsnap"
+#define INDEX_NUM_SECTIONS 17
+#define INDEX_ALIGN 8
+#define FILTER_MIN_BITS 64
+#define FILTER_BITS_PER_NAME 16
+#define METHOD_COPY 0  /* k_Copy of 7zDec.c */
+#define METHOD_LZMA2 0x21
+#define METHOD_LZMA 0x30101
 #if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 7
 #define PYC_HEADER_SIZE 16
 #else
 #define PYC_HEADER_SIZE 12
 #endif
-#ifndef MAX_PATH
-#define MAX_PATH 260
-#endif
 
 struct st_7z_searchorder {
-    char suffix[14];
+    char suffix[64];
     int type;
 };
 
 #ifdef ALTSEP
 _Py_IDENTIFIER(replace);
 #endif
+_Py_IDENTIFIER(seek);
+_Py_IDENTIFIER(readinto);
+_Py_IDENTIFIER(PathFinder);
+_Py_IDENTIFIER(find_spec);
+_Py_IDENTIFIER(loader);
 
 /* searchorder_7z defines how we search for a module in the 7z
    archive: we first search for a package __init__, then for
-   non-package .pyc, and .py entries. The .pyc entries
-   are swapped by initimport7z() if we run in optimized mode. Also,
-   '/' is replaced by SEP there. */
+   non-package .pyc, and .py entries. The __pycache__ entries are
+   filled in by PyInit_import7z() with the cache tag and optimization
+   level of the running interpreter (PEP 3147, PEP 488), and are left
+   empty if there is no cache tag. Also, '/' is replaced by SEP there. */
 static struct st_7z_searchorder searchorder_7z[] = {
+    {"", IS_PACKAGE | IS_BYTECODE | IS_PYCACHE},
     {"/__init__.pyc", IS_PACKAGE | IS_BYTECODE},
     {"/__init__.py", IS_PACKAGE | IS_SOURCE},
+    {"", IS_BYTECODE | IS_PYCACHE},
     {".pyc", IS_BYTECODE},
     {".py", IS_SOURCE},
     {"", 0}
 };
 
+#define PYCACHE "__pycache__"
+
+#define SEARCHORDER_LEN \
+    ((Py_ssize_t)(sizeof(searchorder_7z) / sizeof(searchorder_7z[0]) - 1))
+
+/* module_entry accessors, see build_module_table() */
+#define MODULE_ENTRY_TYPE(entry) \
+    ((int)PyLong_AsLong(PyTuple_GET_ITEM(entry, 0)))
+#define MODULE_ENTRY_TOC(entry) PyTuple_GET_ITEM(entry, 1)
+#define MODULE_ENTRY_SOURCE(entry) PyTuple_GET_ITEM(entry, 2)
+#define MODULE_ENTRY_ISDIR(entry) (PyTuple_GET_ITEM(entry, 3) == Py_True)
+/* the path of a module: its source if it has one, as for sourceful
+   modules in CPython, so that it matches the code compiled from the
+   source when the bytecode can't be used */
+#define MODULE_ENTRY_PATH(entry) \
+    PyTuple_GET_ITEM(MODULE_ENTRY_SOURCE(entry) != Py_None ? \
+                     MODULE_ENTRY_SOURCE(entry) : MODULE_ENTRY_TOC(entry), 0)
+
 /* importer7z object definition and support */
 
 typedef struct _importer7z Importer7z;
@@ -55,22 +122,187 @@ struct _importer7z {
     PyObject *prefix;   /* file prefix: "a/sub/directory/",
                            encoded to the filesystem encoding */
     PyObject *files;    /* dict with file info {path: toc_entry} */
+    PyObject *modules;  /* dict with the modules below prefix
+                           {name: module_entry} */
+    unsigned char *filter;      /* bloom filter over the names in modules */
+    size_t filter_mask;         /* number of filter bits - 1 */
+    Py_ssize_t lookup_hits;     /* lookups found in modules */
+    Py_ssize_t lookup_misses;   /* lookups not found in modules */
+    Py_ssize_t filter_rejects;  /* misses rejected by the filter alone */
+    PyObject *source_cache;     /* LRU of decoded sources, oldest first
+                                   {toc index: source_item}, or NULL */
+    Py_ssize_t source_cache_size;   /* bytes held by source_cache */
+    Py_ssize_t source_cache_limit;  /* max bytes held by source_cache */
+    PyObject *snapshot; /* dict with the snapshot code of the archive
+                           {fullname: (__file__, code)}, or NULL */
+};
+
+/* resource reader for a package in a 7z archive */
+
+typedef struct {
+    PyObject_HEAD
+    Importer7z *importer;   /* importer the package was found by */
+    PyObject *prefix;       /* path of the package directory inside the
+                               archive, with a trailing SEP */
+} ResourceReader7z;
+
+/* meta path finder over several 7z archives */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *paths;        /* list of the archive paths, in search order */
+    PyObject *table;        /* dict with the modules found in paths
+                               {fullname: location}, where location is the
+                               path of the directory holding the module */
+    PyObject *importers;    /* dict with the importers created for the
+                               locations {location: importer7z} */
+} Finder7z;
+
+/* archive database shared by all importers of an archive */
+
+typedef struct _archive7z Archive7z;
+
+struct _archive7z {
+    CSzArEx db;         /* archive database, as read by SzArEx_OpenLazy() */
+    void *index;        /* index sidecar the arrays of db point into,
+                           or NULL if they're owned by db */
+    size_t index_size;
+    PyObject *index_data;   /* bytes holding the sidecar where it
+                               can't be mapped, or NULL */
+#ifdef USE_POSIX_FILE
+    CSzFile file;       /* the archive, shared by all readers */
+#endif
+    UInt64 file_size;       /* of the archive file when it was opened */
+    Int64 file_mtime_ns;
+    PyObject *fileobj;  /* file object the archive is read from, or NULL
+                           if it's read from the archive file */
+    UInt64 fileobj_size;
+    PyThread_type_lock fileobj_lock;    /* guards the block cache */
+    Byte *blocks;       /* FILEOBJ_NUM_BLOCKS cached blocks of fileobj,
+                           followed by FILEOBJ_READ_AHEAD staging blocks */
+    UInt64 block_ids[FILEOBJ_NUM_BLOCKS];   /* number + 1 of the block
+                                               in each slot, or 0 */
+    Py_buffer view;     /* buffer holding the whole archive, if view.buf
+                           isn't NULL */
+    PyObject *window;   /* bytes holding the pack streams of the last
+                           folders read, or NULL */
+    UInt64 window_start;    /* archive offset of window */
+    Py_ssize_t folder_reads;    /* folders and stored files read */
+    Py_ssize_t window_hits;     /* of them, found in window */
+    Py_ssize_t read_calls;      /* reads from the archive file for them */
+    Py_ssize_t read_bytes;      /* bytes read for them */
 };
 
 static PyObject *Import7zError;
 /* read_directory() cache */
 static PyObject *directory_cache = NULL;
+/* build_module_table() cache */
+static PyObject *module_cache = NULL;
+/* get_children() cache {archive: {directory prefix: sorted names}} */
+static PyObject *children_cache = NULL;
+/* open_archive() cache {archive: Archive7z capsule} */
+static PyObject *archive_cache = NULL;
+/* archives not read from a file {path: Archive7z capsule} */
+static PyObject *virtual_archives = NULL;
+/* load_snapshot() cache {archive: code dict or None} */
+static PyObject *snapshot_cache = NULL;
+/* directory for the index sidecars, or NULL if caching is disabled */
+static PyObject *cache_dir = NULL;
 
 /* forward decls */
 static PyObject *read_directory(PyObject *archive);
+static PyObject *build_module_table(PyObject *files);
+static PyObject *get_children(PyObject *archive, PyObject *files,
+                              PyObject *prefix);
+static int build_filter(Importer7z *self);
 static PyObject *get_data(PyObject *archive, PyObject *toc_entry);
+static PyObject *get_file_info(PyObject *archive, PyObject *toc_entry);
+static PyObject *open_file_stream(PyObject *archive, PyObject *toc_entry);
+static Archive7z *get_archive(PyObject *archive);
+static PyObject *get_archive_capsule(PyObject *archive);
+static WRes open_archive_file(Archive7z *arc, PyObject *archive,
+                              CSzFile *file);
+static PyObject *open_fileobj_archive(PyObject *archive, PyObject *fileobj);
+static PyObject *open_buffer_archive(PyObject *archive, PyObject *buffer);
+static SRes seek_to_start_header(const ILookInStream *stream, UInt64 *p_pos);
+static int stat_archive(PyObject *archive, UInt64 *p_size, Int64 *p_mtime_ns);
+static int forget_archive(PyObject *path);
+static PyObject *register_archive(PyObject *type, PyObject *path,
+                                  PyObject *capsule);
 static PyObject *get_module_code(Importer7z *self, PyObject *fullname,
                                  int *p_ispackage, PyObject **p_modpath);
+static PyObject *get_entry_code(Importer7z *self, PyObject *fullname,
+                                PyObject *entry, int *p_ispackage,
+                                PyObject **p_modpath);
+static PyObject *load_snapshot(PyObject *archive);
+static PyObject *get_snapshot_code(Importer7z *self, PyObject *fullname,
+                                   PyObject **p_modpath);
 
 
+static PyTypeObject ResourceReader7z_Type;
+static PyTypeObject ResourceFile7z_Type;
+
 #define Importer7z_Check(op) PyObject_TypeCheck(op, &Importer7z_Type)
 
 
+/* Return 1 if the archive file 'filename' is unchanged since its
+   cached Archive7z was opened, 0 if it changed or there is none, in
+   which case what was cached for it is dropped, and -1 on error. */
+static int
+check_cached_archive(PyObject *filename)
+{
+    PyObject *capsule;
+    UInt64 size;
+    Int64 mtime_ns;
+
+    if (PyDict_GetItem(virtual_archives, filename) != NULL)
+        return 1;
+    capsule = PyDict_GetItem(archive_cache, filename);
+    if (capsule != NULL && stat_archive(filename, &size, &mtime_ns) == 0) {
+        Archive7z *arc = PyCapsule_GetPointer(capsule, NULL);
+
+        if (size == arc->file_size && mtime_ns == arc->file_mtime_ns)
+            return 1;
+    }
+    return forget_archive(filename) < 0 ? -1 : 0;
+}
+
+/* Return the longest leading part of 'path' that is an archive in
+   directory_cache and unchanged on disk, as a new reference, and store
+   its length in *p_len. Return NULL without an exception if there is
+   none. */
+static PyObject *
+find_cached_archive(PyObject *path, Py_ssize_t *p_len)
+{
+    Py_ssize_t len = PyUnicode_GET_LENGTH(path);
+    PyObject *filename;
+    int rv;
+
+    if (PyDict_GET_SIZE(directory_cache) == 0)
+        return NULL;
+    filename = path;
+    Py_INCREF(filename);
+    for (;;) {
+        if (PyDict_GetItem(directory_cache, filename) != NULL) {
+            rv = check_cached_archive(filename);
+            if (rv != 1) {
+                Py_DECREF(filename);
+                return NULL;
+            }
+            *p_len = len;
+            return filename;
+        }
+        Py_DECREF(filename);
+        /* back up one path element */
+        len = PyUnicode_FindChar(path, SEP, 0, len, -1);
+        if (len < 0)
+            return NULL;
+        filename = PyUnicode_Substring(path, 0, len);
+        if (filename == NULL)
+            return NULL;
+    }
+}
+
 /* importer7z.__init__
    Split the "subdirectory" from the 7z archive path, lookup a matching
    entry in sys.path_importer_cache, fetch the file directory from there
@@ -78,9 +310,10 @@ static PyObject *get_module_code(Importer7z *self, PyObject *fullname,
 static int
 importer7z_init(Importer7z *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *path, *files, *tmp;
+    PyObject *path, *files, *table, *snapshot, *modules, *tmp;
     PyObject *filename = NULL;
     Py_ssize_t len, flen;
+    int err;
 
     if (!_PyArg_NoKeywords("importer7z()", kwds))
         return -1;
@@ -106,31 +339,40 @@ importer7z_init(Importer7z *self, PyObject *args, PyObject *kwds)
     path = tmp;
 #endif
 
-    filename = path;
-    Py_INCREF(filename);
-    flen = len;
-    for (;;) {
-        struct stat statbuf;
-        int rv;
-
-        rv = _Py_stat(filename, &statbuf);
-        if (rv == -2)
+    /* Subpackages of an archive that is already open are found without
+       touching the filesystem. */
+    filename = find_cached_archive(path, &flen);
+    if (filename == NULL) {
+        if (PyErr_Occurred())
             goto error;
-        if (rv == 0) {
-            /* it exists */
-            if (!S_ISREG(statbuf.st_mode))
-                /* it's a not file */
-                Py_CLEAR(filename);
-            break;
+        filename = path;
+        Py_INCREF(filename);
+        flen = len;
+        for (;;) {
+            struct stat statbuf;
+            int rv;
+
+            if (PyDict_GetItem(virtual_archives, filename) != NULL)
+                break;
+            rv = _Py_stat(filename, &statbuf);
+            if (rv == -2)
+                goto error;
+            if (rv == 0) {
+                /* it exists */
+                if (!S_ISREG(statbuf.st_mode))
+                    /* it's a not file */
+                    Py_CLEAR(filename);
+                break;
+            }
+            Py_CLEAR(filename);
+            /* back up one path element */
+            flen = PyUnicode_FindChar(path, SEP, 0, flen, -1);
+            if (flen == -1)
+                break;
+            filename = PyUnicode_Substring(path, 0, flen);
+            if (filename == NULL)
+                goto error;
         }
-        Py_CLEAR(filename);
-        /* back up one path element */
-        flen = PyUnicode_FindChar(path, SEP, 0, flen, -1);
-        if (flen == -1)
-            break;
-        filename = PyUnicode_Substring(path, 0, flen);
-        if (filename == NULL)
-            goto error;
     }
     if (filename == NULL) {
         PyErr_SetString(Import7zError, "not a 7z file");
@@ -141,17 +383,49 @@ importer7z_init(Importer7z *self, PyObject *args, PyObject *kwds)
         goto error;
 
     files = PyDict_GetItem(directory_cache, filename);
+    table = PyDict_GetItem(module_cache, filename);
+    snapshot = PyDict_GetItem(snapshot_cache, filename);
     if (files == NULL) {
         files = read_directory(filename);
         if (files == NULL)
             goto error;
         if (PyDict_SetItem(directory_cache, filename, files) != 0)
             goto error;
+        /* a stale table must not outlive the files it was built from */
+        table = NULL;
+        snapshot = NULL;
+        if (PyDict_GetItem(children_cache, filename) != NULL &&
+            PyDict_DelItem(children_cache, filename) != 0)
+            goto error;
     }
     else
         Py_INCREF(files);
     self->files = files;
 
+    if (table == NULL) {
+        table = build_module_table(files);
+        if (table == NULL)
+            goto error;
+        err = PyDict_SetItem(module_cache, filename, table);
+        Py_DECREF(table);
+        if (err != 0)
+            goto error;
+    }
+
+    if (snapshot == NULL) {
+        snapshot = load_snapshot(filename);
+        if (snapshot == NULL)
+            goto error;
+        err = PyDict_SetItem(snapshot_cache, filename, snapshot);
+        Py_DECREF(snapshot);
+        if (err != 0)
+            goto error;
+    }
+    if (snapshot != Py_None) {
+        Py_INCREF(snapshot);
+        self->snapshot = snapshot;
+    }
+
     /* Transfer reference */
     self->archive = filename;
     filename = NULL;
@@ -173,6 +447,22 @@ importer7z_init(Importer7z *self, PyObject *args, PyObject *kwds)
     }
     else
         self->prefix = PyUnicode_New(0, 0);
+    if (self->prefix == NULL)
+        goto error;
+
+    /* Fetch the modules living directly below the prefix. */
+    modules = PyDict_GetItem(table, self->prefix);
+    if (modules == NULL) {
+        modules = PyDict_New();
+        if (modules == NULL)
+            goto error;
+    }
+    else
+        Py_INCREF(modules);
+    self->modules = modules;
+    if (build_filter(self) < 0)
+        goto error;
+    self->source_cache_limit = SOURCE_CACHE_LIMIT;
     Py_DECREF(path);
     return 0;
 
@@ -188,6 +478,9 @@ importer7z_traverse(PyObject *obj, visitproc visit, void *arg)
 {
     Importer7z *self = (Importer7z *)obj;
     Py_VISIT(self->files);
+    Py_VISIT(self->modules);
+    Py_VISIT(self->source_cache);
+    Py_VISIT(self->snapshot);
     return 0;
 }
 
@@ -198,6 +491,10 @@ importer7z_dealloc(Importer7z *self)
     Py_XDECREF(self->archive);
     Py_XDECREF(self->prefix);
     Py_XDECREF(self->files);
+    Py_XDECREF(self->modules);
+    PyMem_Free(self->filter);
+    Py_XDECREF(self->source_cache);
+    Py_XDECREF(self->snapshot);
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -214,6 +511,78 @@ importer7z_repr(Importer7z *self)
                                     self->archive);
 }
 
+/* Return the FNV-1a hash of name[start:end], computed on code points
+   so that it doesn't depend on the string kind. */
+static uint64_t
+name_hash(PyObject *name, Py_ssize_t start, Py_ssize_t end)
+{
+    int kind = PyUnicode_KIND(name);
+    void *data = PyUnicode_DATA(name);
+    uint64_t h = 14695981039346656037ULL;
+    Py_ssize_t i;
+
+    for (i = start; i < end; i++) {
+        h ^= PyUnicode_READ(kind, data, i);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#define FILTER_BIT(self, h, shift) \
+    (((h) >> (shift)) & (self)->filter_mask)
+#define FILTER_TEST(self, bit) \
+    ((self)->filter[(bit) >> 3] & (1 << ((bit) & 7)))
+#define FILTER_SET(self, bit) \
+    ((self)->filter[(bit) >> 3] |= (1 << ((bit) & 7)))
+
+/* Build the negative lookup filter: a bloom filter with two probes
+   over the names in self->modules, sized by the number of names. */
+static int
+build_filter(Importer7z *self)
+{
+    PyObject *name, *entry;
+    Py_ssize_t pos = 0;
+    size_t nbits = FILTER_MIN_BITS;
+
+    while (nbits < (size_t)PyDict_GET_SIZE(self->modules) *
+           FILTER_BITS_PER_NAME)
+        nbits <<= 1;
+    self->filter = PyMem_Calloc(nbits / 8, 1);
+    if (self->filter == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->filter_mask = nbits - 1;
+
+    while (PyDict_Next(self->modules, &pos, &name, &entry)) {
+        uint64_t h;
+        if (PyUnicode_READY(name) == -1)
+            return -1;
+        h = name_hash(name, 0, PyUnicode_GET_LENGTH(name));
+        FILTER_SET(self, FILTER_BIT(self, h, 0));
+        FILTER_SET(self, FILTER_BIT(self, h, 32));
+    }
+    return 0;
+}
+
+/* Return 0 if the last component of fullname is certainly not in
+   self->modules, 1 if it may be. This doesn't allocate, so that
+   imports that aren't in the archive pass through cheaply. */
+static int
+filter_may_contain(Importer7z *self, PyObject *fullname)
+{
+    Py_ssize_t len, dot;
+    uint64_t h;
+
+    len = PyUnicode_GET_LENGTH(fullname);
+    dot = PyUnicode_FindChar(fullname, '.', 0, len, -1);
+    if (dot == -2)
+        return -1;
+    h = name_hash(fullname, dot + 1, len);
+    return FILTER_TEST(self, FILTER_BIT(self, h, 0)) &&
+           FILTER_TEST(self, FILTER_BIT(self, h, 32));
+}
+
 /* return fullname.split(".")[-1] */
 static PyObject *
 get_subname(PyObject *fullname)
@@ -230,45 +599,6 @@ get_subname(PyObject *fullname)
         return PyUnicode_Substring(fullname, dot+1, len);
 }
 
-/* Given a (sub)modulename, write the potential file path in the
-   archive (without extension) to the path buffer. Return the
-   length of the resulting string.
-
-   return self.prefix + name.replace('.', os.sep) */
-static PyObject*
-make_filename(PyObject *prefix, PyObject *name)
-{
-    PyObject *pathobj;
-    Py_UCS4 *p, *buf;
-    Py_ssize_t len;
-
-    len = PyUnicode_GET_LENGTH(prefix) + PyUnicode_GET_LENGTH(name) + 1;
-    p = buf = PyMem_New(Py_UCS4, len);
-    if (buf == NULL) {
-        PyErr_NoMemory();
-        return NULL;
-    }
-
-    if (!PyUnicode_AsUCS4(prefix, p, len, 0)) {
-        PyMem_Free(buf);
-        return NULL;
-    }
-    p += PyUnicode_GET_LENGTH(prefix);
-    len -= PyUnicode_GET_LENGTH(prefix);
-    if (!PyUnicode_AsUCS4(name, p, len, 1)) {
-        PyMem_Free(buf);
-        return NULL;
-    }
-    for (; *p; p++) {
-        if (*p == '.')
-            *p = SEP;
-    }
-    pathobj = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND,
-                                        buf, p-buf);
-    PyMem_Free(buf);
-    return pathobj;
-}
-
 enum zi_module_info {
     MI_ERROR,
     MI_NOT_FOUND,
@@ -276,64 +606,73 @@ enum zi_module_info {
     MI_PACKAGE
 };
 
-/* Does this path represent a directory?
-   on error, return < 0
-   if not a dir, return 0
-   if a dir, return 1
-*/
-static int
-check_is_directory(Importer7z *self, PyObject* prefix, PyObject *path)
+/* Return the path of the directory named by 'fullname' in the archive,
+   without a trailing separator, as used for __path__ and namespace
+   portions. */
+static PyObject *
+make_package_path(Importer7z *self, PyObject *fullname)
 {
-    PyObject *dirpath;
-    int res;
+    PyObject *subname, *path;
 
-    /* See if this is a "directory". If so, it's eligible to be part
-       of a namespace package. We test by seeing if the name, with an
-       appended path separator, exists. */
-    dirpath = PyUnicode_FromFormat("%U%U%c", prefix, path, SEP);
-    if (dirpath == NULL)
-        return -1;
-    /* If dirpath is present in self->files, we have a directory. */
-    res = PyDict_Contains(self->files, dirpath);
-    Py_DECREF(dirpath);
-    return res;
+    subname = get_subname(fullname);
+    if (subname == NULL)
+        return NULL;
+    path = PyUnicode_FromFormat("%U%c%U%U", self->archive, SEP,
+                                self->prefix, subname);
+    Py_DECREF(subname);
+    return path;
 }
 
-/* Return some information about a module. */
-static enum zi_module_info
-get_module_info(Importer7z *self, PyObject *fullname)
+/* Return the module_entry for 'fullname' as a borrowed reference, or
+   NULL if the archive has no such module or directory. On error, NULL
+   is returned with an exception set. */
+static PyObject *
+find_module_entry(Importer7z *self, PyObject *fullname)
 {
-    PyObject *subname;
-    PyObject *path, *fullpath, *item;
-    struct st_7z_searchorder *zso;
+    PyObject *subname, *entry;
+    int rv;
+
+    if (PyUnicode_READY(fullname) == -1)
+        return NULL;
+    rv = filter_may_contain(self, fullname);
+    if (rv < 0)
+        return NULL;
+    if (rv == 0) {
+        self->filter_rejects++;
+        self->lookup_misses++;
+        return NULL;
+    }
 
+    /* We're only interested in the last path component of fullname;
+       earlier components are recorded in self->prefix. */
     subname = get_subname(fullname);
     if (subname == NULL)
-        return MI_ERROR;
-
-    path = make_filename(self->prefix, subname);
+        return NULL;
+    entry = PyDict_GetItemWithError(self->modules, subname);
     Py_DECREF(subname);
-    if (path == NULL)
-        return MI_ERROR;
-
-    for (zso = searchorder_7z; *zso->suffix; zso++) {
-        fullpath = PyUnicode_FromFormat("%U%s", path, zso->suffix);
-        if (fullpath == NULL) {
-            Py_DECREF(path);
-            return MI_ERROR;
-        }
-        item = PyDict_GetItem(self->files, fullpath);
-        Py_DECREF(fullpath);
-        if (item != NULL) {
-            Py_DECREF(path);
-            if (zso->type & IS_PACKAGE)
-                return MI_PACKAGE;
-            else
-                return MI_MODULE;
-        }
-    }
-    Py_DECREF(path);
-    return MI_NOT_FOUND;
+    if (entry != NULL)
+        self->lookup_hits++;
+    else if (!PyErr_Occurred())
+        self->lookup_misses++;
+    return entry;
+}
+
+/* Return some information about a module. */
+static enum zi_module_info
+get_module_info(Importer7z *self, PyObject *fullname)
+{
+    PyObject *entry;
+
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL)
+        return PyErr_Occurred() ? MI_ERROR : MI_NOT_FOUND;
+    if (MODULE_ENTRY_TOC(entry) == Py_None)
+        /* only a directory */
+        return MI_NOT_FOUND;
+    if (MODULE_ENTRY_TYPE(entry) & IS_PACKAGE)
+        return MI_PACKAGE;
+    else
+        return MI_MODULE;
 }
 
 typedef enum {
@@ -349,47 +688,26 @@ typedef enum {
 static find_loader_result
 find_loader(Importer7z *self, PyObject *fullname, PyObject **namespace_portion)
 {
-    enum zi_module_info mi;
+    PyObject *entry;
 
     *namespace_portion = NULL;
 
-    mi = get_module_info(self, fullname);
-    if (mi == MI_ERROR)
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL)
+        return PyErr_Occurred() ? FL_ERROR : FL_NOT_FOUND;
+    if (MODULE_ENTRY_TOC(entry) != Py_None)
+        /* This is a module or package. */
+        return FL_MODULE_FOUND;
+    if (!MODULE_ENTRY_ISDIR(entry))
+        return FL_NOT_FOUND;
+
+    /* Not a module or regular package, but a directory, and therefore
+       possibly a portion of a namespace package. Return the string
+       representing its path, without a trailing separator. */
+    *namespace_portion = make_package_path(self, fullname);
+    if (*namespace_portion == NULL)
         return FL_ERROR;
-    if (mi == MI_NOT_FOUND) {
-        /* Not a module or regular package. See if this is a directory, and
-           therefore possibly a portion of a namespace package. */
-        find_loader_result result = FL_NOT_FOUND;
-        PyObject *subname;
-        int is_dir;
-
-        /* We're only interested in the last path component of fullname;
-           earlier components are recorded in self->prefix. */
-        subname = get_subname(fullname);
-        if (subname == NULL) {
-            return FL_ERROR;
-        }
-
-        is_dir = check_is_directory(self, self->prefix, subname);
-        if (is_dir < 0)
-            result = FL_ERROR;
-        else if (is_dir) {
-            /* This is possibly a portion of a namespace
-               package. Return the string representing its path,
-               without a trailing separator. */
-            *namespace_portion = PyUnicode_FromFormat("%U%c%U%U",
-                                                      self->archive, SEP,
-                                                      self->prefix, subname);
-            if (*namespace_portion == NULL)
-                result = FL_ERROR;
-            else
-                result = FL_NS_FOUND;
-        }
-        Py_DECREF(subname);
-        return result;
-    }
-    /* This is a module or package. */
-    return FL_MODULE_FOUND;
+    return FL_NS_FOUND;
 }
 
 
@@ -498,17 +816,10 @@ importer7z_load_module(PyObject *obj, PyObject *args)
     if (ispackage) {
         /* add __path__ to the module *before* the code gets
            executed */
-        PyObject *pkgpath, *fullpath, *subname;
+        PyObject *pkgpath, *fullpath;
         int err;
 
-        subname = get_subname(fullname);
-        if (subname == NULL)
-            goto error;
-
-        fullpath = PyUnicode_FromFormat("%U%c%U%U",
-                                self->archive, SEP,
-                                self->prefix, subname);
-        Py_DECREF(subname);
+        fullpath = make_package_path(self, fullname);
         if (fullpath == NULL)
             goto error;
 
@@ -536,120 +847,304 @@ error:
     return NULL;
 }
 
-/* Return a string matching __file__ for the named module */
+/* Return importlib.machinery.ModuleSpec as a borrowed reference. */
 static PyObject *
-importer7z_get_filename(PyObject *obj, PyObject *args)
+get_module_spec_type(void)
 {
-    Importer7z *self = (Importer7z *)obj;
-    PyObject *fullname, *code, *modpath;
-    int ispackage;
-
-    if (!PyArg_ParseTuple(args, "U:importer7z.get_filename",
-                          &fullname))
-        return NULL;
-
-    /* Deciding the filename requires working out where the code
-       would come from if the module was actually loaded */
-    code = get_module_code(self, fullname, &ispackage, &modpath);
-    if (code == NULL)
-        return NULL;
-    Py_DECREF(code); /* Only need the path info */
+    static PyObject *module_spec_type = NULL;
 
-    return modpath;
+    if (module_spec_type == NULL) {
+        PyObject *machinery = PyImport_ImportModule("importlib.machinery");
+        if (machinery == NULL)
+            return NULL;
+        module_spec_type = PyObject_GetAttrString(machinery, "ModuleSpec");
+        Py_DECREF(machinery);
+    }
+    return module_spec_type;
 }
 
-/* Return a bool signifying whether the module is a package or not. */
+/* Return a ModuleSpec for the module named by 'fullname', None if it
+   isn't in the archive. The resolved module_entry is passed along as
+   loader_state, so exec_module() doesn't need to look it up again. */
 static PyObject *
-importer7z_is_package(PyObject *obj, PyObject *args)
+importer7z_find_spec(PyObject *obj, PyObject *args)
 {
     Importer7z *self = (Importer7z *)obj;
-    PyObject *fullname;
-    enum zi_module_info mi;
+    PyObject *fullname, *target = NULL;
+    PyObject *entry, *spec_type, *specargs, *kwds, *spec = NULL;
+    PyObject *pkgpath = NULL, *locations;
+    int ispackage;
 
-    if (!PyArg_ParseTuple(args, "U:importer7z.is_package",
-                          &fullname))
+    if (!PyArg_ParseTuple(args, "U|O:importer7z.find_spec",
+                          &fullname, &target))
         return NULL;
 
-    mi = get_module_info(self, fullname);
-    if (mi == MI_ERROR)
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if (MODULE_ENTRY_TOC(entry) == Py_None && !MODULE_ENTRY_ISDIR(entry))
+        Py_RETURN_NONE;
+
+    spec_type = get_module_spec_type();
+    if (spec_type == NULL)
         return NULL;
-    if (mi == MI_NOT_FOUND) {
-        PyErr_Format(Import7zError, "can't find module %R", fullname);
+
+    if (MODULE_ENTRY_TOC(entry) == Py_None) {
+        /* a portion of a namespace package */
+        ispackage = 1;
+        specargs = Py_BuildValue("(OO)", fullname, Py_None);
+        kwds = Py_BuildValue("{s:O}", "is_package", Py_True);
+        if (specargs != NULL && kwds != NULL)
+            spec = PyObject_Call(spec_type, specargs, kwds);
+    }
+    else {
+        ispackage = MODULE_ENTRY_TYPE(entry) & IS_PACKAGE;
+        kwds = Py_BuildValue("{s:O,s:O}",
+                             "origin", MODULE_ENTRY_PATH(entry),
+                             "is_package", ispackage ? Py_True : Py_False);
+        specargs = Py_BuildValue("(OO)", fullname, obj);
+        if (specargs != NULL && kwds != NULL)
+            spec = PyObject_Call(spec_type, specargs, kwds);
+        if (spec != NULL &&
+            (PyObject_SetAttrString(spec, "loader_state", entry) != 0 ||
+             PyObject_SetAttrString(spec, "has_location", Py_True) != 0))
+            Py_CLEAR(spec);
+    }
+    Py_XDECREF(specargs);
+    Py_XDECREF(kwds);
+    if (spec == NULL)
         return NULL;
+
+    if (ispackage) {
+        pkgpath = make_package_path(self, fullname);
+        if (pkgpath == NULL)
+            goto error;
+        locations = PyObject_GetAttrString(spec,
+                                           "submodule_search_locations");
+        if (locations == NULL)
+            goto error;
+        if (PyList_Append(locations, pkgpath) != 0) {
+            Py_DECREF(locations);
+            goto error;
+        }
+        Py_DECREF(locations);
+        Py_DECREF(pkgpath);
     }
-    return PyBool_FromLong(mi == MI_PACKAGE);
+    return spec;
+error:
+    Py_XDECREF(pkgpath);
+    Py_DECREF(spec);
+    return NULL;
 }
 
+/* Use the default module creation semantics. */
+static PyObject *
+importer7z_create_module(PyObject *obj, PyObject *spec)
+{
+    Py_RETURN_NONE;
+}
 
+/* Execute the module's code in its namespace, using the module_entry
+   left in spec.loader_state by find_spec() when there is one. */
 static PyObject *
-importer7z_get_data(PyObject *obj, PyObject *args)
+importer7z_exec_module(PyObject *obj, PyObject *module)
 {
     Importer7z *self = (Importer7z *)obj;
-    PyObject *path, *key;
-    PyObject *toc_entry;
-    Py_ssize_t path_start, path_len, len;
-
-    if (!PyArg_ParseTuple(args, "U:importer7z.get_data", &path))
-        return NULL;
+    PyObject *fullname, *spec, *entry = NULL, *code, *modpath, *res;
 
-#ifdef ALTSEP
-    path = _PyObject_CallMethodId((PyObject *)&PyUnicode_Type, &PyId_replace,
-                                  "OCC", path, ALTSEP, SEP);
-    if (!path)
+    fullname = PyModule_GetNameObject(module);
+    if (fullname == NULL)
         return NULL;
-#else
-    Py_INCREF(path);
-#endif
-    if (PyUnicode_READY(path) == -1)
-        goto error;
 
-    path_len = PyUnicode_GET_LENGTH(path);
+    spec = PyObject_GetAttrString(module, "__spec__");
+    if (spec == NULL)
+        PyErr_Clear();
+    else {
+        entry = PyObject_GetAttrString(spec, "loader_state");
+        Py_DECREF(spec);
+        if (entry == NULL)
+            PyErr_Clear();
+        else if (!PyTuple_Check(entry) || PyTuple_GET_SIZE(entry) != 4 ||
+                 MODULE_ENTRY_TOC(entry) == Py_None)
+            Py_CLEAR(entry);
+    }
+    if (entry == NULL) {
+        entry = find_module_entry(self, fullname);
+        if (entry == NULL || MODULE_ENTRY_TOC(entry) == Py_None) {
+            if (!PyErr_Occurred())
+                PyErr_Format(Import7zError, "can't find module %R",
+                             fullname);
+            Py_DECREF(fullname);
+            return NULL;
+        }
+        Py_INCREF(entry);
+    }
 
-    len = PyUnicode_GET_LENGTH(self->archive);
-    path_start = 0;
-    if (PyUnicode_Tailmatch(path, self->archive, 0, len, -1)
-        && PyUnicode_READ_CHAR(path, len) == SEP) {
-        path_start = len + 1;
+    code = get_entry_code(self, fullname, entry, NULL, &modpath);
+    Py_DECREF(entry);
+    if (code == NULL) {
+        Py_DECREF(fullname);
+        return NULL;
     }
 
-    key = PyUnicode_Substring(path, path_start, path_len);
-    if (key == NULL)
-        goto error;
-    toc_entry = PyDict_GetItem(self->files, key);
-    if (toc_entry == NULL) {
-        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, key);
-        Py_DECREF(key);
-        goto error;
+    res = PyEval_EvalCode(code, PyModule_GetDict(module),
+                          PyModule_GetDict(module));
+    Py_DECREF(code);
+    if (res != NULL) {
+        Py_DECREF(res);
+        if (Py_VerboseFlag)
+            PySys_FormatStderr("import %U # loaded from 7z %U\n",
+                               fullname, modpath);
     }
-    Py_DECREF(key);
-    Py_DECREF(path);
-    return get_data(self->archive, toc_entry);
-  error:
-    Py_DECREF(path);
-    return NULL;
+    Py_DECREF(fullname);
+    Py_DECREF(modpath);
+    if (res == NULL)
+        return NULL;
+    Py_RETURN_NONE;
 }
 
+/* Return a string matching __file__ for the named module */
 static PyObject *
-importer7z_get_code(PyObject *obj, PyObject *args)
+importer7z_get_filename(PyObject *obj, PyObject *args)
 {
     Importer7z *self = (Importer7z *)obj;
-    PyObject *fullname;
+    PyObject *fullname, *entry, *modpath;
 
-    if (!PyArg_ParseTuple(args, "U:importer7z.get_code", &fullname))
+    if (!PyArg_ParseTuple(args, "U:importer7z.get_filename",
+                          &fullname))
         return NULL;
 
-    return get_module_code(self, fullname, NULL, NULL);
-}
-
+    /* The module table already knows where the code would come from
+       if the module was loaded, so there's no need to decode it. */
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL || MODULE_ENTRY_TOC(entry) == Py_None) {
+        if (!PyErr_Occurred())
+            PyErr_Format(Import7zError, "can't find module %R", fullname);
+        return NULL;
+    }
+    modpath = MODULE_ENTRY_PATH(entry);
+    Py_INCREF(modpath);
+    return modpath;
+}
+
+/* Return a resource reader for the package named by 'fullname', None
+   if it's not a package. */
 static PyObject *
-importer7z_get_source(PyObject *obj, PyObject *args)
+importer7z_get_resource_reader(PyObject *obj, PyObject *args)
+{
+    Importer7z *self = (Importer7z *)obj;
+    PyObject *fullname, *entry, *subname;
+    ResourceReader7z *reader;
+
+    if (!PyArg_ParseTuple(args, "U:importer7z.get_resource_reader",
+                          &fullname))
+        return NULL;
+
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL || MODULE_ENTRY_TOC(entry) == Py_None ||
+        !(MODULE_ENTRY_TYPE(entry) & IS_PACKAGE)) {
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    reader = PyObject_New(ResourceReader7z, &ResourceReader7z_Type);
+    if (reader == NULL)
+        return NULL;
+    Py_INCREF(self);
+    reader->importer = self;
+    reader->prefix = NULL;
+    subname = get_subname(fullname);
+    if (subname != NULL) {
+        reader->prefix = PyUnicode_FromFormat("%U%U%c", self->prefix,
+                                              subname, SEP);
+        Py_DECREF(subname);
+    }
+    if (reader->prefix == NULL) {
+        Py_DECREF(reader);
+        return NULL;
+    }
+    return (PyObject *)reader;
+}
+
+/* Return a sorted list of (prefix + name, ispkg) for the modules and
+   packages directly below self->prefix, as pkgutil.iter_modules() uses.
+   self->modules already holds just those, so the rest of the archive
+   isn't looked at. */
+static PyObject *
+importer7z_iter_modules(PyObject *obj, PyObject *args)
+{
+    Importer7z *self = (Importer7z *)obj;
+    PyObject *prefix = NULL, *names, *name, *entry, *res = NULL;
+    Py_ssize_t pos = 0, i;
+
+    if (!PyArg_ParseTuple(args, "|U:importer7z.iter_modules", &prefix))
+        return NULL;
+
+    names = PyList_New(0);
+    if (names == NULL)
+        return NULL;
+    while (PyDict_Next(self->modules, &pos, &name, &entry)) {
+        if (MODULE_ENTRY_TOC(entry) == Py_None ||
+            PyUnicode_CompareWithASCIIString(name, "__init__") == 0)
+            continue;
+        if (PyUnicode_FindChar(name, '.', 0, PyUnicode_GET_LENGTH(name),
+                               1) != -1) {
+            if (PyErr_Occurred())
+                goto error;
+            continue;
+        }
+        if (PyList_Append(names, name) != 0)
+            goto error;
+    }
+    if (PyList_Sort(names) != 0)
+        goto error;
+
+    res = PyList_New(PyList_GET_SIZE(names));
+    if (res == NULL)
+        goto error;
+    for (i = 0; i < PyList_GET_SIZE(names); i++) {
+        PyObject *item, *fullname;
+
+        name = PyList_GET_ITEM(names, i);
+        entry = PyDict_GetItem(self->modules, name);
+        if (prefix != NULL)
+            fullname = PyUnicode_Concat(prefix, name);
+        else {
+            fullname = name;
+            Py_INCREF(fullname);
+        }
+        if (fullname == NULL)
+            goto error;
+        item = Py_BuildValue("(NO)", fullname,
+                             MODULE_ENTRY_TYPE(entry) & IS_PACKAGE ?
+                             Py_True : Py_False);
+        if (item == NULL)
+            goto error;
+        PyList_SET_ITEM(res, i, item);
+    }
+    Py_DECREF(names);
+    return res;
+
+error:
+    Py_DECREF(names);
+    Py_XDECREF(res);
+    return NULL;
+}
+
+/* Return a bool signifying whether the module is a package or not. */
+static PyObject *
+importer7z_is_package(PyObject *obj, PyObject *args)
 {
     Importer7z *self = (Importer7z *)obj;
-    PyObject *toc_entry;
-    PyObject *fullname, *subname, *path, *fullpath;
+    PyObject *fullname;
     enum zi_module_info mi;
 
-    if (!PyArg_ParseTuple(args, "U:importer7z.get_source", &fullname))
+    if (!PyArg_ParseTuple(args, "U:importer7z.is_package",
+                          &fullname))
         return NULL;
 
     mi = get_module_info(self, fullname);
@@ -659,42 +1154,377 @@ importer7z_get_source(PyObject *obj, PyObject *args)
         PyErr_Format(Import7zError, "can't find module %R", fullname);
         return NULL;
     }
+    return PyBool_FromLong(mi == MI_PACKAGE);
+}
 
-    subname = get_subname(fullname);
-    if (subname == NULL)
-        return NULL;
 
-    path = make_filename(self->prefix, subname);
-    Py_DECREF(subname);
-    if (path == NULL)
+/* Return the toc_entry of the file 'path', which may start with the
+   archive path, as a borrowed reference. */
+static PyObject *
+get_file_entry(Importer7z *self, PyObject *path)
+{
+    PyObject *key;
+    PyObject *toc_entry = NULL;
+    Py_ssize_t path_start, path_len, len;
+
+#ifdef ALTSEP
+    path = _PyObject_CallMethodId((PyObject *)&PyUnicode_Type, &PyId_replace,
+                                  "OCC", path, ALTSEP, SEP);
+    if (!path)
         return NULL;
+#else
+    Py_INCREF(path);
+#endif
+    if (PyUnicode_READY(path) == -1)
+        goto error;
 
-    if (mi == MI_PACKAGE)
-        fullpath = PyUnicode_FromFormat("%U%c__init__.py", path, SEP);
-    else
-        fullpath = PyUnicode_FromFormat("%U.py", path);
+    path_len = PyUnicode_GET_LENGTH(path);
+
+    len = PyUnicode_GET_LENGTH(self->archive);
+    path_start = 0;
+    if (PyUnicode_Tailmatch(path, self->archive, 0, len, -1)
+        && PyUnicode_READ_CHAR(path, len) == SEP) {
+        path_start = len + 1;
+    }
+
+    key = PyUnicode_Substring(path, path_start, path_len);
+    if (key == NULL)
+        goto error;
+    toc_entry = PyDict_GetItem(self->files, key);
+    if (toc_entry == NULL)
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, key);
+    Py_DECREF(key);
+  error:
     Py_DECREF(path);
-    if (fullpath == NULL)
+    return toc_entry;
+}
+
+static PyObject *
+importer7z_get_data(PyObject *obj, PyObject *args)
+{
+    Importer7z *self = (Importer7z *)obj;
+    PyObject *path, *toc_entry;
+
+    if (!PyArg_ParseTuple(args, "U:importer7z.get_data", &path))
+        return NULL;
+    toc_entry = get_file_entry(self, path);
+    if (toc_entry == NULL)
         return NULL;
+    return get_data(self->archive, toc_entry);
+}
 
-    toc_entry = PyDict_GetItem(self->files, fullpath);
-    Py_DECREF(fullpath);
-    if (toc_entry != NULL) {
-        PyObject *res, *bytes;
-        bytes = get_data(self->archive, toc_entry);
-        if (bytes == NULL)
-            return NULL;
-        res = PyUnicode_FromStringAndSize(PyBytes_AS_STRING(bytes),
-                                          PyBytes_GET_SIZE(bytes));
-        Py_DECREF(bytes);
-        return res;
+static PyObject *
+importer7z_get_file_info(PyObject *obj, PyObject *args)
+{
+    Importer7z *self = (Importer7z *)obj;
+    PyObject *path, *toc_entry;
+
+    if (!PyArg_ParseTuple(args, "U:importer7z.get_file_info", &path))
+        return NULL;
+    toc_entry = get_file_entry(self, path);
+    if (toc_entry == NULL)
+        return NULL;
+    return get_file_info(self->archive, toc_entry);
+}
+
+static PyObject *
+importer7z_get_code(PyObject *obj, PyObject *args)
+{
+    Importer7z *self = (Importer7z *)obj;
+    PyObject *fullname;
+
+    if (!PyArg_ParseTuple(args, "U:importer7z.get_code", &fullname))
+        return NULL;
+
+    return get_module_code(self, fullname, NULL, NULL);
+}
+
+/* The source cache is a dict used as an LRU: lookups move the item to
+   the end, and the oldest items are evicted from the front to stay
+   within source_cache_limit bytes. A source_item is a list:
+
+   [source,        # decoded source text
+    size,          # bytes accounted for the item
+    lines,         # bytes object with the Py_ssize_t offset of every
+                   # line start and of the end of source, or None until
+                   # get_source_line() asks for it
+   ]
+*/
+
+/* Return the cached source_item for key as a borrowed reference and
+   mark it as most recently used, or NULL if it isn't cached. */
+static PyObject *
+source_cache_lookup(Importer7z *self, PyObject *key)
+{
+    PyObject *item;
+    int err;
+
+    if (self->source_cache == NULL)
+        return NULL;
+    item = PyDict_GetItemWithError(self->source_cache, key);
+    if (item == NULL)
+        return NULL;
+    Py_INCREF(item);
+    err = PyDict_DelItem(self->source_cache, key) != 0 ||
+          PyDict_SetItem(self->source_cache, key, item) != 0;
+    Py_DECREF(item);
+    if (err)
+        return NULL;
+    /* still owned by the cache */
+    return item;
+}
+
+/* Account 'size' more bytes to the cache, evicting the least recently
+   used items, but never 'keep', to make room. Return 1 if they were
+   accounted, 0 if there is no room for them even then, and -1 on
+   error. */
+static int
+source_cache_reserve(Importer7z *self, Py_ssize_t size, PyObject *keep)
+{
+    PyObject *key, *item;
+    Py_ssize_t pos = 0;
+    int err;
+
+    while (self->source_cache_size + size > self->source_cache_limit &&
+           PyDict_Next(self->source_cache, &pos, &key, &item)) {
+        if (item == keep)
+            continue;
+        self->source_cache_size -= PyLong_AsSsize_t(PyList_GET_ITEM(item, 1));
+        Py_INCREF(key);
+        err = PyDict_DelItem(self->source_cache, key);
+        Py_DECREF(key);
+        if (err != 0)
+            return -1;
+        /* the dict changed, start over from its oldest item */
+        pos = 0;
+    }
+    if (self->source_cache_size + size > self->source_cache_limit)
+        return 0;
+    self->source_cache_size += size;
+    return 1;
+}
+
+/* Decode the source code in 'bytes' like importlib does: honour the
+   PEP 263 coding cookie or BOM and translate universal newlines.
+   Returns a new reference. */
+static PyObject *
+decode_source(PyObject *bytes)
+{
+    PyObject *util, *text;
+
+    util = PyImport_ImportModule("importlib.util");
+    if (util == NULL)
+        return NULL;
+    text = PyObject_CallMethod(util, "decode_source", "O", bytes);
+    Py_DECREF(util);
+    return text;
+}
+
+/* Return the source_item for toc_entry as a new reference, decoding
+   the source and caching it if needed. */
+static PyObject *
+get_source_item(Importer7z *self, PyObject *toc_entry)
+{
+    PyObject *key, *item, *text, *bytes;
+    Py_ssize_t size;
+
+    key = PyTuple_GET_ITEM(toc_entry, 1);
+    item = source_cache_lookup(self, key);
+    if (item != NULL) {
+        Py_INCREF(item);
+        return item;
+    }
+    if (PyErr_Occurred())
+        return NULL;
+
+    bytes = get_data(self->archive, toc_entry);
+    if (bytes == NULL)
+        return NULL;
+    size = PyBytes_GET_SIZE(bytes);
+    text = decode_source(bytes);
+    Py_DECREF(bytes);
+    if (text == NULL)
+        return NULL;
+    item = Py_BuildValue("[NnO]", text, size, Py_None);
+    if (item == NULL)
+        return NULL;
+
+    if (size <= self->source_cache_limit) {
+        int rv;
+
+        if (self->source_cache == NULL) {
+            self->source_cache = PyDict_New();
+            if (self->source_cache == NULL)
+                goto error;
+        }
+        rv = source_cache_reserve(self, size, NULL);
+        if (rv < 0 ||
+            (rv == 1 && PyDict_SetItem(self->source_cache, key, item) != 0))
+            goto error;
+    }
+    return item;
+error:
+    Py_DECREF(item);
+    return NULL;
+}
+
+/* Return the decoded source for toc_entry. */
+static PyObject *
+get_source_text(Importer7z *self, PyObject *toc_entry)
+{
+    PyObject *item, *text;
+
+    item = get_source_item(self, toc_entry);
+    if (item == NULL)
+        return NULL;
+    text = PyList_GET_ITEM(item, 0);
+    Py_INCREF(text);
+    Py_DECREF(item);
+    return text;
+}
+
+/* Build the line offsets of the source_item for key, see above. */
+static int
+build_line_index(Importer7z *self, PyObject *key, PyObject *item)
+{
+    PyObject *text = PyList_GET_ITEM(item, 0), *lines;
+    Py_ssize_t len, nlines = 1, i, *offsets;
+    int kind;
+    void *data;
+
+    len = PyUnicode_GET_LENGTH(text);
+    kind = PyUnicode_KIND(text);
+    data = PyUnicode_DATA(text);
+    for (i = 0; i < len; i++)
+        if (PyUnicode_READ(kind, data, i) == '\n')
+            nlines++;
+
+    lines = PyBytes_FromStringAndSize(NULL, (nlines + 1) * sizeof(Py_ssize_t));
+    if (lines == NULL)
+        return -1;
+    offsets = (Py_ssize_t *)PyBytes_AS_STRING(lines);
+    *offsets++ = 0;
+    for (i = 0; i < len; i++)
+        if (PyUnicode_READ(kind, data, i) == '\n')
+            *offsets++ = i + 1;
+    *offsets = len;
+
+    if (PyList_SetItem(item, 2, lines) != 0)
+        return -1;
+    if (self->source_cache != NULL &&
+        PyDict_GetItemWithError(self->source_cache, key) == item) {
+        Py_ssize_t size = PyLong_AsSsize_t(PyList_GET_ITEM(item, 1));
+        PyObject *sizeobj;
+        int rv = 0;
+
+        sizeobj = PyLong_FromSsize_t(size + PyBytes_GET_SIZE(lines));
+        if (sizeobj == NULL)
+            return -1;
+        if (size + PyBytes_GET_SIZE(lines) <= self->source_cache_limit)
+            rv = source_cache_reserve(self, PyBytes_GET_SIZE(lines), item);
+        if (rv != 1) {
+            Py_DECREF(sizeobj);
+            if (rv < 0)
+                return -1;
+            /* the item doesn't fit anymore */
+            self->source_cache_size -= size;
+            return PyDict_DelItem(self->source_cache, key);
+        }
+        PyList_SetItem(item, 1, sizeobj);
+    }
+    return 0;
+}
+
+static PyObject *
+importer7z_get_source(PyObject *obj, PyObject *args)
+{
+    Importer7z *self = (Importer7z *)obj;
+    PyObject *entry, *toc_entry;
+    PyObject *fullname;
+
+    if (!PyArg_ParseTuple(args, "U:importer7z.get_source", &fullname))
+        return NULL;
+
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL || MODULE_ENTRY_TOC(entry) == Py_None) {
+        if (!PyErr_Occurred())
+            PyErr_Format(Import7zError, "can't find module %R", fullname);
+        return NULL;
     }
 
+    toc_entry = MODULE_ENTRY_SOURCE(entry);
+    if (toc_entry != Py_None)
+        return get_source_text(self, toc_entry);
+
     /* we have the module, but no source */
     Py_INCREF(Py_None);
     return Py_None;
 }
 
+/* Return line 'lineno' (1-based) of the module's source, as
+   linecache.getline() would. */
+static PyObject *
+importer7z_get_source_line(PyObject *obj, PyObject *args)
+{
+    Importer7z *self = (Importer7z *)obj;
+    PyObject *fullname, *entry, *toc_entry, *item, *res;
+    Py_ssize_t lineno, nlines;
+    const Py_ssize_t *offsets;
+
+    if (!PyArg_ParseTuple(args, "Un:importer7z.get_source_line",
+                          &fullname, &lineno))
+        return NULL;
+
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL || MODULE_ENTRY_TOC(entry) == Py_None) {
+        if (!PyErr_Occurred())
+            PyErr_Format(Import7zError, "can't find module %R", fullname);
+        return NULL;
+    }
+    toc_entry = MODULE_ENTRY_SOURCE(entry);
+    if (toc_entry == Py_None)
+        Py_RETURN_NONE;
+
+    item = get_source_item(self, toc_entry);
+    if (item == NULL)
+        return NULL;
+    if (PyList_GET_ITEM(item, 2) == Py_None &&
+        build_line_index(self, PyTuple_GET_ITEM(toc_entry, 1), item) < 0) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    offsets = (const Py_ssize_t *)PyBytes_AS_STRING(PyList_GET_ITEM(item, 2));
+    nlines = PyBytes_GET_SIZE(PyList_GET_ITEM(item, 2)) /
+             sizeof(Py_ssize_t) - 1;
+    if (lineno < 1 || lineno > nlines)
+        res = PyUnicode_New(0, 0);
+    else
+        res = PyUnicode_Substring(PyList_GET_ITEM(item, 0),
+                                  offsets[lineno - 1], offsets[lineno]);
+    Py_DECREF(item);
+    return res;
+}
+
+PyDoc_STRVAR(doc_find_spec,
+"find_spec(fullname, target=None) -> ModuleSpec or None.\n\
+\n\
+Search for a module specified by 'fullname'. 'fullname' must be the\n\
+fully qualified (dotted) module name. It returns a ModuleSpec whose\n\
+loader is the importer7z instance itself if the module was found, a\n\
+ModuleSpec without a loader if it's possibly a portion of a namespace\n\
+package, or None otherwise. The optional 'target' argument is ignored.");
+
+PyDoc_STRVAR(doc_create_module,
+"create_module(spec) -> None.\n\
+\n\
+Use the default semantics for module creation.");
+
+PyDoc_STRVAR(doc_exec_module,
+"exec_module(module) -> None.\n\
+\n\
+Execute the module in its own namespace. Raise Import7zError if it\n\
+wasn't found.");
+
 PyDoc_STRVAR(doc_find_module,
 "find_module(fullname, path=None) -> self or None.\n\
 \n\
@@ -727,6 +1557,21 @@ PyDoc_STRVAR(doc_get_data,
 Return the data associated with 'pathname'. Raise IOError if\n\
 the file wasn't found.");
 
+PyDoc_STRVAR(doc_get_file_info,
+"get_file_info(pathname) -> (file_size, mtime, ctime, attributes).\n\
+\n\
+Return the size, modification and creation times and attributes of\n\
+'pathname', as recorded in the archive. The times are POSIX timestamps;\n\
+any of the last three is None if the archive doesn't record it. Raise\n\
+IOError if the file wasn't found.");
+
+PyDoc_STRVAR(doc_iter_modules,
+"iter_modules(prefix='') -> list of (name, ispkg).\n\
+\n\
+Return the modules and packages directly below the importer's path,\n\
+sorted by name, each name preceded by 'prefix'. Used by\n\
+pkgutil.iter_modules().");
+
 PyDoc_STRVAR(doc_is_package,
 "is_package(fullname) -> bool.\n\
 \n\
@@ -747,51 +1592,184 @@ if the module couldn't be found, return None if the archive does\n\
 contain the module, but has no source for it.");
 
 
+PyDoc_STRVAR(doc_get_source_line,
+"get_source_line(fullname, lineno) -> source line string.\n\
+\n\
+Return line 'lineno' of the source of the specified module, or an\n\
+empty string if there is no such line. Raise Import7zError if the\n\
+module couldn't be found, return None if it has no source.");
+
 PyDoc_STRVAR(doc_get_filename,
 "get_filename(fullname) -> filename string.\n\
 \n\
 Return the filename for the specified module.");
 
-static PyMethodDef importer7z_methods[] = {
-    {"find_module", importer7z_find_module, METH_VARARGS,
-     doc_find_module},
-    {"find_loader", importer7z_find_loader, METH_VARARGS,
-     doc_find_loader},
-    {"load_module", importer7z_load_module, METH_VARARGS,
-     doc_load_module},
-    {"get_data", importer7z_get_data, METH_VARARGS,
-     doc_get_data},
-    {"get_code", importer7z_get_code, METH_VARARGS,
-     doc_get_code},
-    {"get_source", importer7z_get_source, METH_VARARGS,
-     doc_get_source},
-    {"get_filename", importer7z_get_filename, METH_VARARGS,
-     doc_get_filename},
-    {"is_package", importer7z_is_package, METH_VARARGS,
-     doc_is_package},
-    {NULL,              NULL}   /* sentinel */
-};
-
-static PyMemberDef importer7z_members[] = {
-    {"archive",  T_OBJECT, offsetof(Importer7z, archive),  READONLY},
-    {"prefix",   T_OBJECT, offsetof(Importer7z, prefix),   READONLY},
-    {"_files",   T_OBJECT, offsetof(Importer7z, files),    READONLY},
-    {NULL}
-};
+PyDoc_STRVAR(doc_get_resource_reader,
+"get_resource_reader(fullname) -> resource reader or None.\n\
+\n\
+Return a resource reader for the package specified by 'fullname', or\n\
+None if it isn't a package.");
 
-PyDoc_STRVAR(importer7z_doc,
-"importer7z(archivepath) -> importer7z object\n\
+PyDoc_STRVAR(doc_from_fileobj,
+"from_fileobj(fileobj, path=None) -> importer7z object\n\
 \n\
-Create a new importer7z instance. 'archivepath' must be a path to\n\
-a zipfile, or to a specific path inside a zipfile. For example, it can be\n\
-'/tmp/myimport.zip', or '/tmp/myimport.zip/mydirectory', if mydirectory is a\n\
-valid directory inside the archive.\n\
+Create an importer for the 7z archive read from 'fileobj', a binary\n\
+file object supporting seek() and readinto(). The archive is registered\n\
+under 'path', which defaults to a name made from the object, so that\n\
+importer7z(path) and sys.path items below it find it.");
+
+/* Open the archive in 'source' with 'open' and register it under the
+   path in args, or a name made from 'source' if there is none. */
+static PyObject *
+open_virtual_archive(PyObject *type, PyObject *args, const char *format,
+                     PyObject *(*open)(PyObject *, PyObject *))
+{
+    PyObject *source, *path = NULL, *capsule, *importer = NULL;
+
+    if (!PyArg_ParseTuple(args, format, &source, PyUnicode_FSDecoder, &path))
+        return NULL;
+    if (path == NULL)
+        path = PyUnicode_FromFormat("<%s %p>", Py_TYPE(source)->tp_name,
+                                    source);
+    if (path == NULL)
+        return NULL;
+#ifdef ALTSEP
+    Py_SETREF(path, _PyObject_CallMethodId(path, &PyId_replace, "CC",
+                                           ALTSEP, SEP));
+    if (path == NULL)
+        return NULL;
+#endif
+    if (PyUnicode_GET_LENGTH(path) == 0) {
+        PyErr_SetString(Import7zError, "archive path is empty");
+        goto error;
+    }
+
+    capsule = open(path, source);
+    if (capsule == NULL)
+        goto error;
+    importer = register_archive(type, path, capsule);
+    Py_DECREF(capsule);
+error:
+    Py_DECREF(path);
+    return importer;
+}
+
+static PyObject *
+importer7z_from_fileobj(PyObject *type, PyObject *args)
+{
+    return open_virtual_archive(type, args, "O|O&:from_fileobj",
+                                open_fileobj_archive);
+}
+
+PyDoc_STRVAR(doc_from_buffer,
+"from_buffer(buffer, path=None) -> importer7z object\n\
+\n\
+Create an importer for the 7z archive held in 'buffer', any object\n\
+supporting the buffer protocol, without copying it. The buffer stays\n\
+exported while the archive is in use. The archive is registered under\n\
+'path' as with from_fileobj().");
+
+static PyObject *
+importer7z_from_buffer(PyObject *type, PyObject *args)
+{
+    return open_virtual_archive(type, args, "O|O&:from_buffer",
+                                open_buffer_archive);
+}
+
+static PyMethodDef importer7z_methods[] = {
+    {"from_fileobj", importer7z_from_fileobj, METH_VARARGS | METH_CLASS,
+     doc_from_fileobj},
+    {"from_buffer", importer7z_from_buffer, METH_VARARGS | METH_CLASS,
+     doc_from_buffer},
+    {"find_spec", importer7z_find_spec, METH_VARARGS,
+     doc_find_spec},
+    {"create_module", importer7z_create_module, METH_O,
+     doc_create_module},
+    {"exec_module", importer7z_exec_module, METH_O,
+     doc_exec_module},
+    {"find_module", importer7z_find_module, METH_VARARGS,
+     doc_find_module},
+    {"find_loader", importer7z_find_loader, METH_VARARGS,
+     doc_find_loader},
+    {"load_module", importer7z_load_module, METH_VARARGS,
+     doc_load_module},
+    {"get_data", importer7z_get_data, METH_VARARGS,
+     doc_get_data},
+    {"get_code", importer7z_get_code, METH_VARARGS,
+     doc_get_code},
+    {"get_file_info", importer7z_get_file_info, METH_VARARGS,
+     doc_get_file_info},
+    {"get_source", importer7z_get_source, METH_VARARGS,
+     doc_get_source},
+    {"get_source_line", importer7z_get_source_line, METH_VARARGS,
+     doc_get_source_line},
+    {"get_filename", importer7z_get_filename, METH_VARARGS,
+     doc_get_filename},
+    {"is_package", importer7z_is_package, METH_VARARGS,
+     doc_is_package},
+    {"iter_modules", importer7z_iter_modules, METH_VARARGS,
+     doc_iter_modules},
+    {"get_resource_reader", importer7z_get_resource_reader, METH_VARARGS,
+     doc_get_resource_reader},
+    {NULL,              NULL}   /* sentinel */
+};
+
+static PyMemberDef importer7z_members[] = {
+    {"archive",  T_OBJECT, offsetof(Importer7z, archive),  READONLY},
+    {"prefix",   T_OBJECT, offsetof(Importer7z, prefix),   READONLY},
+    {"_files",   T_OBJECT, offsetof(Importer7z, files),    READONLY},
+    {"_lookup_hits", T_PYSSIZET, offsetof(Importer7z, lookup_hits),
+     READONLY},
+    {"_lookup_misses", T_PYSSIZET, offsetof(Importer7z, lookup_misses),
+     READONLY},
+    {"_filter_rejects", T_PYSSIZET, offsetof(Importer7z, filter_rejects),
+     READONLY},
+    {"_source_cache_size", T_PYSSIZET,
+     offsetof(Importer7z, source_cache_size), READONLY},
+    {"source_cache_limit", T_PYSSIZET,
+     offsetof(Importer7z, source_cache_limit), 0,
+     "max bytes of decoded source kept for get_source()"},
+    {NULL}
+};
+
+static PyObject *
+importer7z_get_read_stats(Importer7z *self, void *closure)
+{
+    Archive7z *arc = get_archive(self->archive);
+
+    if (arc == NULL)
+        return NULL;
+    return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+                         "folders", arc->folder_reads,
+                         "cached", arc->window_hits,
+                         "reads", arc->read_calls,
+                         "bytes", arc->read_bytes);
+}
+
+static PyGetSetDef importer7z_getset[] = {
+    {"_read_stats", (getter)importer7z_get_read_stats, NULL,
+     "folders and stored files read from the archive, how many of them\n"
+     "were found in the read window, and the number of reads and bytes\n"
+     "it took"},
+    {NULL}
+};
+
+PyDoc_STRVAR(importer7z_doc,
+"importer7z(archivepath) -> importer7z object\n\
+\n\
+Create a new importer7z instance. 'archivepath' must be a path to\n\
+a zipfile, or to a specific path inside a zipfile. For example, it can be\n\
+'/tmp/myimport.zip', or '/tmp/myimport.zip/mydirectory', if mydirectory is a\n\
+valid directory inside the archive.\n\
 \n\
 'Import7zError is raised if 'archivepath' doesn't point to a valid 7z\n\
 archive.\n\
 \n\
 The 'archive' attribute of importer7z objects contains the name of the\n\
-zipfile targeted.");
+zipfile targeted.\n\
+\n\
+importer7z.from_fileobj() and importer7z.from_buffer() read the archive\n\
+from a file object or from memory instead.");
 
 #define DEFERRED_ADDRESS(ADDR) 0
 
@@ -826,7 +1804,7 @@ static PyTypeObject Importer7z_Type = {
     0,                                          /* tp_iternext */
     importer7z_methods,                         /* tp_methods */
     importer7z_members,                         /* tp_members */
-    0,                                          /* tp_getset */
+    importer7z_getset,                          /* tp_getset */
     0,                                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
@@ -839,233 +1817,3695 @@ static PyTypeObject Importer7z_Type = {
 };
 
 
-/* implementation */
+/* ResourceReader7z object definition and support */
 
-/* Given a buffer, return the unsigned int that is represented by the first
-   4 bytes, encoded as little endian. This partially reimplements
-   marshal.c:r_long() */
-static unsigned int
-get_uint32(const unsigned char *buf)
+static void
+resourcereader7z_dealloc(ResourceReader7z *self)
 {
-    unsigned int x;
-    x =  buf[0];
-    x |= (unsigned int)buf[1] <<  8;
-    x |= (unsigned int)buf[2] << 16;
-    x |= (unsigned int)buf[3] << 24;
-    return x;
+    Py_XDECREF(self->importer);
+    Py_XDECREF(self->prefix);
+    PyObject_Del(self);
 }
 
-static void
-set_file_error(PyObject *archive, int eof)
+/* Return the toc_entry of the resource 'name' in the package as a
+   borrowed reference, or NULL with FileNotFoundError set. */
+static PyObject *
+get_resource_entry(ResourceReader7z *self, PyObject *name)
 {
-    if (eof) {
-        PyErr_SetString(PyExc_EOFError, "EOF read where not expected");
-    }
-    else {
-        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, archive);
-    }
+    PyObject *path, *toc_entry;
+
+    path = PyUnicode_Concat(self->prefix, name);
+    if (path == NULL)
+        return NULL;
+    toc_entry = PyDict_GetItemWithError(self->importer->files, path);
+    if (toc_entry == NULL && !PyErr_Occurred())
+        PyErr_SetObject(PyExc_FileNotFoundError, name);
+    Py_DECREF(path);
+    return toc_entry;
 }
 
+/* Return True if 'name' is a directory in the package. */
 static int
-open_7z_archive(CSzFile *p, PyObject *archive)
+is_resource_directory(ResourceReader7z *self, PyObject *name)
 {
-#ifdef WIN32
-    return InFile_OpenW(p, PyUnicode_AsUnicode(archive));
-#else
-    return InFile_Open(p, PyUnicode_AsUTF8(archive));
-#endif
+    PyObject *table, *modules, *entry;
+
+    table = PyDict_GetItemWithError(module_cache, self->importer->archive);
+    if (table == NULL)
+        return PyErr_Occurred() ? -1 : 0;
+    modules = PyDict_GetItemWithError(table, self->prefix);
+    if (modules == NULL)
+        return PyErr_Occurred() ? -1 : 0;
+    entry = PyDict_GetItemWithError(modules, name);
+    if (entry == NULL)
+        return PyErr_Occurred() ? -1 : 0;
+    return MODULE_ENTRY_ISDIR(entry);
 }
 
-/*
-   read_directory(archive) -> files dict (new reference)
-
-   Given a path to a 7z archive, build a dict, mapping file names
-   (local to the archive, using SEP as a separator) to toc entries.
+static PyObject *
+resourcereader7z_open_resource(PyObject *obj, PyObject *args)
+{
+    ResourceReader7z *self = (ResourceReader7z *)obj;
+    PyObject *name, *toc_entry, *data, *io, *res;
 
-   A toc_entry is a tuple:
+    if (!PyArg_ParseTuple(args, "U:open_resource", &name))
+        return NULL;
+    toc_entry = get_resource_entry(self, name);
+    if (toc_entry == NULL)
+        return NULL;
+    /* large files are decoded as they're read, the others at once */
+    data = open_file_stream(self->importer->archive, toc_entry);
+    if (data == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        data = get_data(self->importer->archive, toc_entry);
+        if (data == NULL)
+            return NULL;
+    }
+    io = PyImport_ImportModule("io");
+    if (io == NULL) {
+        Py_DECREF(data);
+        return NULL;
+    }
+    res = PyObject_CallMethod(io, PyBytes_Check(data) ? "BytesIO" :
+                                                        "BufferedReader",
+                              "O", data);
+    Py_DECREF(io);
+    Py_DECREF(data);
+    return res;
+}
 
-   (__file__,      # value to use for __file__, available for all files,
-                   # encoded to the filesystem encoding
-    index,         # index of file
-    file_size,     # size of decompressed data
-   )
-*/
 static PyObject *
-read_directory(PyObject *archive)
+resourcereader7z_resource_path(PyObject *obj, PyObject *args)
 {
-    PyObject *files = NULL;
-    PyObject *nameobj = NULL;
-    PyObject *path = NULL;
-    const char *errmsg = NULL;
+    PyObject *name;
 
-    ISzAlloc alloc = { SzAlloc, SzFree };
-    ISzAlloc alloc_tmp = { SzAllocTemp, SzFreeTemp };
+    if (!PyArg_ParseTuple(args, "U:resource_path", &name))
+        return NULL;
+    /* resources in the archive have no path in the file system */
+    PyErr_SetObject(PyExc_FileNotFoundError, name);
+    return NULL;
+}
 
-    CFileInStream stream_arc;
-    CLookToRead2 stream_look;
+static PyObject *
+resourcereader7z_is_resource(PyObject *obj, PyObject *args)
+{
+    ResourceReader7z *self = (ResourceReader7z *)obj;
+    PyObject *name;
+    int isdir;
 
-    if (open_7z_archive(&stream_arc.file, archive) != SZ_OK) {
-        _PyErr_FormatFromCause(Import7zError,
-            "can't open 7z file: %R", archive);
+    if (!PyArg_ParseTuple(args, "U:is_resource", &name))
         return NULL;
+    if (get_resource_entry(self, name) == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_FileNotFoundError))
+            return NULL;
+        PyErr_Clear();
+        Py_RETURN_FALSE;
     }
+    isdir = is_resource_directory(self, name);
+    if (isdir < 0)
+        return NULL;
+    return PyBool_FromLong(!isdir);
+}
 
-    FileInStream_CreateVTable(&stream_arc);
-    LookToRead2_CreateVTable(&stream_look, False);
+static PyObject *
+resourcereader7z_contents(PyObject *obj, PyObject *unused)
+{
+    ResourceReader7z *self = (ResourceReader7z *)obj;
+    PyObject *names;
 
-    stream_look.buf = (Byte*)ISzAlloc_Alloc(&alloc, INPUT_BUFSIZE);
-    stream_look.bufSize = INPUT_BUFSIZE;
-    stream_look.realStream = &stream_arc.vt;
-    LookToRead2_Init(&stream_look);
+    names = get_children(self->importer->archive, self->importer->files,
+                         self->prefix);
+    if (names == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        return PyList_New(0);
+    }
+    return PyList_GetSlice(names, 0, PyList_GET_SIZE(names));
+}
 
-    CSzArEx db;
-    SzArEx_Init(&db);
+static PyMethodDef resourcereader7z_methods[] = {
+    {"open_resource", resourcereader7z_open_resource, METH_VARARGS,
+     "open_resource(resource) -> binary file object."},
+    {"resource_path", resourcereader7z_resource_path, METH_VARARGS,
+     "resource_path(resource) -> raise FileNotFoundError."},
+    {"is_resource", resourcereader7z_is_resource, METH_VARARGS,
+     "is_resource(name) -> bool."},
+    {"contents", resourcereader7z_contents, METH_NOARGS,
+     "contents() -> sorted list of the names in the package."},
+    {NULL,              NULL}   /* sentinel */
+};
 
-    if (SzArEx_Open(&db, &stream_look.vt, &alloc, &alloc_tmp) != SZ_OK) {
-        goto file_error;
-    }
-    files = PyDict_New();
-    if (files == NULL) {
-        goto error;
-    }
+static PyTypeObject ResourceReader7z_Type = {
+    PyVarObject_HEAD_INIT(DEFERRED_ADDRESS(&PyType_Type), 0)
+    "import7z.ResourceReader",
+    sizeof(ResourceReader7z),
+    0,                                          /* tp_itemsize */
+    (destructor)resourcereader7z_dealloc,       /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Resource reader for a package in a 7z archive.", /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    resourcereader7z_methods,                   /* tp_methods */
+};
 
-    for (uint32_t i = 0; i < db.NumFiles; i++) {
-        PyObject *t;
-        int err;
-        UInt16 name[MAX_PATH];
-        size_t name_size = SzArEx_GetFileNameUtf16(&db, i, name);
-        int file_size = (int)SzArEx_GetFileSize(&db, i);
 
-        if (SEP != '/') {
-            for (size_t i = 0; i < name_size; i++) {
-                if (name[i] == '/') {
-                    name[i] = SEP;
-                }
-            }
-        }
+/* Finder7z object definition and support */
 
-        nameobj = PyUnicode_FromKindAndData(PyUnicode_2BYTE_KIND, name, name_size - 1);
-        if (nameobj == NULL) {
-            goto error;
-        }
-        if (PyUnicode_READY(nameobj) == -1) {
+/* Add the modules below the prefix of 'importer', the importer of the
+   path entry 'path_entry', to self->table. Modules already in the table
+   keep their location. */
+static int
+finder7z_add_modules(Finder7z *self, Importer7z *importer,
+                     PyObject *path_entry)
+{
+    PyObject *modtable, *prefix, *modules, *name, *entry;
+    PyObject *package = NULL, *location = NULL, *fullname;
+    Py_ssize_t pos = 0, plen;
+
+    modtable = PyDict_GetItem(module_cache, importer->archive);
+    if (modtable == NULL)
+        return 0;
+    plen = PyUnicode_GET_LENGTH(importer->prefix);
+
+    while (PyDict_Next(modtable, &pos, &prefix, &modules)) {
+        Py_ssize_t len = PyUnicode_GET_LENGTH(prefix), mpos = 0;
+        Py_ssize_t i;
+        int kind;
+        void *data;
+
+        if (PyUnicode_Tailmatch(prefix, importer->prefix, 0, plen, -1) != 1)
+            continue;
+        /* "a/sub/" below the importer prefix is package "a.sub." */
+        package = PyUnicode_Substring(prefix, plen, len);
+        if (package == NULL)
             goto error;
+        if (PyUnicode_FindChar(package, '.', 0, len - plen, 1) != -1) {
+            /* not a package name, or an error */
+            Py_CLEAR(package);
+            if (PyErr_Occurred())
+                goto error;
+            continue;
         }
-        path = PyUnicode_FromFormat("%U%c%U", archive, SEP, nameobj);
-        if (path == NULL) {
-            goto error;
+        if (len - plen > 0) {
+            Py_SETREF(package, PyUnicode_New(len - plen,
+                                             PyUnicode_MAX_CHAR_VALUE(package)));
+            if (package == NULL)
+                goto error;
+            kind = PyUnicode_KIND(package);
+            data = PyUnicode_DATA(package);
+            for (i = 0; i < len - plen; i++) {
+                Py_UCS4 ch = PyUnicode_READ_CHAR(prefix, plen + i);
+                PyUnicode_WRITE(kind, data, i, ch == SEP ? '.' : ch);
+            }
+            location = PyUnicode_FromFormat("%U%c%U", importer->archive, SEP,
+                                            prefix);
+            if (location != NULL)
+                Py_SETREF(location, PyUnicode_Substring(
+                    location, 0, PyUnicode_GET_LENGTH(location) - 1));
         }
-        t = Py_BuildValue("NII", path, i, file_size);
-        if (t == NULL) {
-            goto error;
+        else {
+            /* top level modules are found at the path entry itself,
+               which find_spec() looks up on sys.path */
+            location = path_entry;
+            Py_INCREF(location);
         }
-        err = PyDict_SetItem(files, nameobj, t);
-        Py_CLEAR(nameobj);
-        Py_DECREF(t);
-        if (err != 0) {
+        if (location == NULL)
             goto error;
+
+        while (PyDict_Next(modules, &mpos, &name, &entry)) {
+            /* directories alone are left to the path based finder, which
+               collects the portions of namespace packages */
+            if (MODULE_ENTRY_TOC(entry) == Py_None)
+                continue;
+            fullname = PyUnicode_Concat(package, name);
+            if (fullname == NULL)
+                goto error;
+            if (PyDict_SetDefault(self->table, fullname, location) == NULL) {
+                Py_DECREF(fullname);
+                goto error;
+            }
+            Py_DECREF(fullname);
         }
+        Py_CLEAR(package);
+        Py_CLEAR(location);
     }
-    SzArEx_Free(&db, &alloc);
-    ISzAlloc_Free(&alloc, stream_look.buf);
-    File_Close(&stream_arc.file);
-    return files;
-
-file_error:
-    PyErr_Format(Import7zError, "can't read 7z file: %R", archive);
-    return NULL;
+    return 0;
 
 error:
-    SzArEx_Free(&db, &alloc);
-    ISzAlloc_Free(&alloc, stream_look.buf);
-    File_Close(&stream_arc.file);
-    Py_XDECREF(files);
-    Py_XDECREF(nameobj);
-    return NULL;
+    Py_XDECREF(package);
+    Py_XDECREF(location);
+    return -1;
 }
 
-/* Given a path to a 7z file and a toc_entry, return the (uncompressed)
-   data as a new reference. */
-static PyObject *
-get_data(PyObject *archive, PyObject *toc_entry)
+/* (Re)build the module table of self from its paths. */
+static int
+finder7z_build(Finder7z *self)
 {
-    PyObject *data = NULL;
-    PyObject *datapath;
-    const char *errmsg = NULL;
-    unsigned int index, file_size;
-    UInt32 idx_blk = 0xFFFFFFFF;
-    Byte* out_ptr = 0;
-    size_t out_length = 0;
-    size_t offset = 0;
-    size_t processed = 0;
+    PyObject *table;
+    Py_ssize_t i;
 
-    ISzAlloc alloc = { SzAlloc, SzFree };
-    ISzAlloc alloc_tmp = { SzAllocTemp, SzFreeTemp };
-    
-    CFileInStream stream_arc;
-    CLookToRead2 stream_look;
+    table = PyDict_New();
+    if (table == NULL)
+        return -1;
+    Py_XSETREF(self->table, table);
+    PyDict_Clear(self->importers);
 
-    if (!PyArg_ParseTuple(toc_entry, "OII", &datapath, &index, &file_size)) {
-        return NULL;
+    for (i = 0; i < PyList_GET_SIZE(self->paths); i++) {
+        PyObject *importer;
+        int err;
+
+        importer = PyObject_CallFunctionObjArgs((PyObject *)&Importer7z_Type,
+                                                PyList_GET_ITEM(self->paths, i),
+                                                NULL);
+        if (importer == NULL)
+            return -1;
+        err = finder7z_add_modules(self, (Importer7z *)importer,
+                                   PyList_GET_ITEM(self->paths, i));
+        Py_DECREF(importer);
+        if (err < 0)
+            return -1;
     }
+    return 0;
+}
 
-    if (open_7z_archive(&stream_arc.file, archive) != SZ_OK) {
-        _PyErr_FormatFromCause(Import7zError, "can't open 7z file: %R", archive);
-        return NULL;
+static int
+finder7z_init(Finder7z *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *paths;
+
+    if (!_PyArg_NoKeywords("finder7z()", kwds))
+        return -1;
+    if (!PyArg_ParseTuple(args, "O:finder7z", &paths))
+        return -1;
+
+    Py_XSETREF(self->paths, PySequence_List(paths));
+    if (self->paths == NULL)
+        return -1;
+    if (self->importers == NULL) {
+        self->importers = PyDict_New();
+        if (self->importers == NULL)
+            return -1;
     }
+    return finder7z_build(self);
+}
+
+static int
+finder7z_traverse(PyObject *obj, visitproc visit, void *arg)
+{
+    Finder7z *self = (Finder7z *)obj;
+    Py_VISIT(self->paths);
+    Py_VISIT(self->table);
+    Py_VISIT(self->importers);
+    return 0;
+}
+
+static void
+finder7z_dealloc(Finder7z *self)
+{
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->paths);
+    Py_XDECREF(self->table);
+    Py_XDECREF(self->importers);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Return 1 if the top level module 'fullname' of the path entry
+   'location' is shadowed by one in an entry before it on sys.path that
+   isn't one of self->paths, 0 if not, and -1 on error. Those entries
+   are left to the path based finder, which comes after self on
+   sys.meta_path. */
+static int
+finder7z_shadowed(Finder7z *self, PyObject *fullname, PyObject *location)
+{
+    PyObject *sys_path, *earlier, *machinery = NULL, *spec = NULL, *loader;
+    Py_ssize_t i;
+    int rv = -1;
+
+    sys_path = PySys_GetObject("path");
+    if (sys_path == NULL || !PyList_Check(sys_path))
+        return 0;
+    earlier = PyList_New(0);
+    if (earlier == NULL)
+        return -1;
+    for (i = 0; i < PyList_GET_SIZE(sys_path); i++) {
+        PyObject *item = PyList_GET_ITEM(sys_path, i);
+        int found;
+
+        found = PyObject_RichCompareBool(item, location, Py_EQ);
+        if (found < 0)
+            goto done;
+        if (found)
+            break;
+        found = PySequence_Contains(self->paths, item);
+        if (found < 0 || (!found && PyList_Append(earlier, item) < 0))
+            goto done;
+    }
+    /* archives not on sys.path come before it */
+    if (i == PyList_GET_SIZE(sys_path) || PyList_GET_SIZE(earlier) == 0) {
+        rv = 0;
+        goto done;
+    }
+
+    machinery = PyImport_ImportModule("importlib.machinery");
+    if (machinery == NULL)
+        goto done;
+    spec = _PyObject_GetAttrId(machinery, &PyId_PathFinder);
+    if (spec == NULL)
+        goto done;
+    Py_SETREF(spec, _PyObject_CallMethodId(spec, &PyId_find_spec, "OO",
+                                           fullname, earlier));
+    if (spec == NULL)
+        goto done;
+    rv = 0;
+    if (spec != Py_None) {
+        /* namespace portions rank below modules */
+        loader = _PyObject_GetAttrId(spec, &PyId_loader);
+        if (loader == NULL)
+            rv = -1;
+        else {
+            rv = loader != Py_None;
+            Py_DECREF(loader);
+        }
+    }
+
+done:
+    Py_DECREF(earlier);
+    Py_XDECREF(machinery);
+    Py_XDECREF(spec);
+    return rv;
+}
+
+/* Return a ModuleSpec for 'fullname' from the first archive that has
+   it, None if none has. A submodule is only found in the archive its
+   package was, as given by 'path', the __path__ of the package; a top
+   level module is left to the path based finder when a directory
+   before its archive on sys.path has it. */
+static PyObject *
+finder7z_find_spec(PyObject *obj, PyObject *args)
+{
+    Finder7z *self = (Finder7z *)obj;
+    PyObject *fullname, *path = Py_None, *target = NULL;
+    PyObject *location, *importer, *spec_args, *spec;
+
+    if (!PyArg_ParseTuple(args, "U|OO:finder7z.find_spec",
+                          &fullname, &path, &target))
+        return NULL;
+
+    location = PyDict_GetItemWithError(self->table, fullname);
+    if (location == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if (path != Py_None) {
+        int rv = PySequence_Contains(path, location);
+        if (rv < 0)
+            return NULL;
+        if (rv == 0)
+            Py_RETURN_NONE;
+    }
+    else {
+        int rv = finder7z_shadowed(self, fullname, location);
+        if (rv < 0)
+            return NULL;
+        if (rv == 1)
+            Py_RETURN_NONE;
+    }
+
+    importer = PyDict_GetItemWithError(self->importers, location);
+    if (importer == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        importer = PyObject_CallFunctionObjArgs((PyObject *)&Importer7z_Type,
+                                                location, NULL);
+        if (importer == NULL)
+            return NULL;
+        if (PyDict_SetItem(self->importers, location, importer) != 0) {
+            Py_DECREF(importer);
+            return NULL;
+        }
+        Py_DECREF(importer);
+    }
+
+    spec_args = PyTuple_Pack(1, fullname);
+    if (spec_args == NULL)
+        return NULL;
+    spec = importer7z_find_spec(importer, spec_args);
+    Py_DECREF(spec_args);
+    return spec;
+}
+
+/* Rebuild the module table, for archives that changed. */
+static PyObject *
+finder7z_invalidate_caches(PyObject *obj, PyObject *unused)
+{
+    if (finder7z_build((Finder7z *)obj) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef finder7z_methods[] = {
+    {"find_spec", finder7z_find_spec, METH_VARARGS,
+     "find_spec(fullname, path=None, target=None) -> ModuleSpec or None."},
+    {"invalidate_caches", finder7z_invalidate_caches, METH_NOARGS,
+     "invalidate_caches() -> None. Rebuild the module table."},
+    {NULL,              NULL}   /* sentinel */
+};
+
+static PyMemberDef finder7z_members[] = {
+    {"paths",   T_OBJECT, offsetof(Finder7z, paths),   READONLY},
+    {"_table",  T_OBJECT, offsetof(Finder7z, table),   READONLY},
+    {NULL}
+};
+
+PyDoc_STRVAR(finder7z_doc,
+"finder7z(paths) -> finder7z object\n\
+\n\
+Create a finder for sys.meta_path over the 7z archives in 'paths', each\n\
+of which is a path as accepted by importer7z(). The modules of all the\n\
+archives are merged into one table, so that a module is found with a\n\
+single lookup however many archives there are. Where archives have a\n\
+module of the same name, the first one in 'paths' wins, as it would on\n\
+sys.path. A module is left to the path based finder when an entry of\n\
+sys.path before its archive, other than the archives in 'paths', has\n\
+it too. Namespace packages are left to the path based finder.");
+
+static PyTypeObject Finder7z_Type = {
+    PyVarObject_HEAD_INIT(DEFERRED_ADDRESS(&PyType_Type), 0)
+    "import7z.finder7z",
+    sizeof(Finder7z),
+    0,                                          /* tp_itemsize */
+    (destructor)finder7z_dealloc,               /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                     /* tp_flags */
+    finder7z_doc,                               /* tp_doc */
+    finder7z_traverse,                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    finder7z_methods,                           /* tp_methods */
+    finder7z_members,                           /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)finder7z_init,                    /* tp_init */
+    PyType_GenericAlloc,                        /* tp_alloc */
+    PyType_GenericNew,                          /* tp_new */
+    PyObject_GC_Del,                            /* tp_free */
+};
+
+
+/* implementation */
+
+/* Given a buffer, return the unsigned int that is represented by the first
+   4 bytes, encoded as little endian. This partially reimplements
+   marshal.c:r_long() */
+static unsigned int
+get_uint32(const unsigned char *buf)
+{
+    unsigned int x;
+    x =  buf[0];
+    x |= (unsigned int)buf[1] <<  8;
+    x |= (unsigned int)buf[2] << 16;
+    x |= (unsigned int)buf[3] << 24;
+    return x;
+}
+
+static int
+open_7z_archive(CSzFile *p, PyObject *archive)
+{
+#ifdef WIN32
+    return InFile_OpenW(p, PyUnicode_AsUnicode(archive));
+#else
+    return InFile_Open(p, PyUnicode_AsUTF8(archive));
+#endif
+}
+
+/* Return the build slots of 'name' below 'prefix' in the module table
+   as a borrowed reference, creating them if needed. The slots are a
+   list holding one toc_entry (or None) per searchorder_7z entry,
+   followed by the isdir flag. */
+static PyObject *
+get_module_slots(PyObject *table, PyObject *prefix, PyObject *name)
+{
+    PyObject *modules, *slots;
+    Py_ssize_t i;
+    int err;
+
+    modules = PyDict_GetItemWithError(table, prefix);
+    if (modules == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        modules = PyDict_New();
+        if (modules == NULL)
+            return NULL;
+        err = PyDict_SetItem(table, prefix, modules);
+        Py_DECREF(modules);
+        if (err != 0)
+            return NULL;
+    }
+
+    slots = PyDict_GetItemWithError(modules, name);
+    if (slots == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        slots = PyList_New(SEARCHORDER_LEN + 1);
+        if (slots == NULL)
+            return NULL;
+        for (i = 0; i < SEARCHORDER_LEN; i++) {
+            Py_INCREF(Py_None);
+            PyList_SET_ITEM(slots, i, Py_None);
+        }
+        Py_INCREF(Py_False);
+        PyList_SET_ITEM(slots, SEARCHORDER_LEN, Py_False);
+        err = PyDict_SetItem(modules, name, slots);
+        Py_DECREF(slots);
+        if (err != 0)
+            return NULL;
+    }
+    return slots;
+}
+
+/* Store 'value' in slot 'index' of name below the path prefix
+   path[0:prefix_end]. The name is path[start:end]. */
+static int
+set_module_slot(PyObject *table, PyObject *path, Py_ssize_t prefix_end,
+                Py_ssize_t start, Py_ssize_t end, Py_ssize_t index,
+                PyObject *value)
+{
+    PyObject *prefix, *name, *slots = NULL;
+
+    prefix = PyUnicode_Substring(path, 0, prefix_end);
+    name = PyUnicode_Substring(path, start, end);
+    if (prefix != NULL && name != NULL)
+        slots = get_module_slots(table, prefix, name);
+    Py_XDECREF(prefix);
+    Py_XDECREF(name);
+    if (slots == NULL)
+        return -1;
+    Py_INCREF(value);
+    return PyList_SetItem(slots, index, value);
+}
+
+/* Return the slot index of the source entry that goes with the
+   searchorder_7z entry 'i', or -1 if there is none. */
+static Py_ssize_t
+get_source_slot(PyObject *slots, Py_ssize_t i)
+{
+    int type = searchorder_7z[i].type;
+
+    for (; i < SEARCHORDER_LEN; i++) {
+        int t = searchorder_7z[i].type;
+        if (!(t & IS_BYTECODE) && (t & IS_PACKAGE) == (type & IS_PACKAGE)
+            && PyList_GET_ITEM(slots, i) != Py_None)
+            return i;
+    }
+    return -1;
+}
+
+/* Turn build slots into a module_entry tuple (new reference). The
+   best entry is the first one in search order; the source is the
+   source entry of the same kind, used if the bytecode can't be.
+   __pycache__ entries only count if there is a source (PEP 3147). */
+static PyObject *
+make_module_entry(PyObject *slots)
+{
+    PyObject *entry = Py_None, *source = Py_None;
+    Py_ssize_t i, j = -1;
+    int type = -1;
+
+    for (i = 0; i < SEARCHORDER_LEN; i++) {
+        if (PyList_GET_ITEM(slots, i) == Py_None)
+            continue;
+        j = get_source_slot(slots, i);
+        if ((searchorder_7z[i].type & IS_PYCACHE) && j < 0)
+            continue;
+        entry = PyList_GET_ITEM(slots, i);
+        type = searchorder_7z[i].type;
+        break;
+    }
+    if (j >= 0)
+        source = PyList_GET_ITEM(slots, j);
+    return Py_BuildValue("iOOO", type, entry, source,
+                         PyList_GET_ITEM(slots, SEARCHORDER_LEN));
+}
+
+/*
+   build_module_table(files) -> module table (new reference)
+
+   Given a files dict as returned by read_directory(), resolve the
+   search order once for every module in the archive. The table maps
+   each directory prefix ("" or "a/sub/directory/", using SEP as a
+   separator) to a dict {name: module_entry}, where name is the last
+   component of the dotted module name.
+
+   A module_entry is a tuple:
+
+   (type,          # searchorder_7z type of entry, -1 if there is none
+    entry,         # toc_entry to load the module from, or None
+    source,        # toc_entry of the source, or None
+    isdir,         # True if name is a directory, and so possibly a
+                   # portion of a namespace package
+   )
+*/
+static PyObject *
+build_module_table(PyObject *files)
+{
+    PyObject *table, *suffixes, *path, *toc_entry, *modules, *slots;
+    Py_ssize_t pos = 0, i;
+
+    table = PyDict_New();
+    suffixes = PyList_New(SEARCHORDER_LEN + 1);
+    if (table == NULL || suffixes == NULL)
+        goto error;
+    for (i = 0; i <= SEARCHORDER_LEN; i++) {
+        /* the last one is the name of the __pycache__ directory */
+        PyObject *suffix = PyUnicode_FromString(i < SEARCHORDER_LEN ?
+                                                searchorder_7z[i].suffix :
+                                                PYCACHE);
+        if (suffix == NULL)
+            goto error;
+        PyList_SET_ITEM(suffixes, i, suffix);
+    }
+
+    while (PyDict_Next(files, &pos, &path, &toc_entry)) {
+        Py_ssize_t len, start = 0, parent = -1, grandparent = -1, sep;
+        int in_pycache;
+
+        if (PyUnicode_READY(path) == -1)
+            goto error;
+        len = PyUnicode_GET_LENGTH(path);
+
+        /* every parent path element is a directory */
+        while ((sep = PyUnicode_FindChar(path, SEP, start, len, 1)) >= 0) {
+            if (set_module_slot(table, path, start, start, sep,
+                                SEARCHORDER_LEN, Py_True) < 0)
+                goto error;
+            grandparent = parent;
+            parent = start;
+            start = sep + 1;
+        }
+        if (sep == -2)
+            goto error;
+        in_pycache = parent >= 0 &&
+                     start - 1 - parent == (Py_ssize_t)strlen(PYCACHE) &&
+                     PyUnicode_Tailmatch(path, PyList_GET_ITEM(suffixes,
+                                                               SEARCHORDER_LEN),
+                                         parent, start - 1, 1) == 1;
+
+        for (i = 0; i < SEARCHORDER_LEN; i++) {
+            PyObject *suffix = PyList_GET_ITEM(suffixes, i);
+            Py_ssize_t end = len - PyUnicode_GET_LENGTH(suffix);
+            int type = searchorder_7z[i].type;
+            int rv;
+
+            if (PyUnicode_GET_LENGTH(suffix) == 0)
+                continue;
+            if ((type & IS_PYCACHE) && !in_pycache)
+                continue;
+            if ((type & IS_PACKAGE) && (type & IS_PYCACHE)) {
+                /* "sub/__pycache__/__init__.tag.pyc" */
+                if (grandparent < 0 || end != parent - 1)
+                    continue;
+            }
+            else if (type & IS_PACKAGE) {
+                /* "sub/__init__.py" is package sub below the parent */
+                if (parent < 0 || end != start - 1)
+                    continue;
+            }
+            else if (end <= start)
+                continue;
+            rv = PyUnicode_Tailmatch(path, suffix, 0, len, 1);
+            if (rv < 0)
+                goto error;
+            if (!rv)
+                continue;
+            if ((type & IS_PACKAGE) && (type & IS_PYCACHE))
+                rv = set_module_slot(table, path, grandparent, grandparent,
+                                     end, i, toc_entry);
+            else if (type & IS_PACKAGE)
+                rv = set_module_slot(table, path, parent, parent, end, i,
+                                     toc_entry);
+            else if (type & IS_PYCACHE)
+                /* "__pycache__/name.tag.pyc" is module name below the
+                   parent of __pycache__ */
+                rv = set_module_slot(table, path, parent, start, end, i,
+                                     toc_entry);
+            else
+                rv = set_module_slot(table, path, start, start, end, i,
+                                     toc_entry);
+            if (rv < 0)
+                goto error;
+        }
+    }
+
+    /* resolve the slots into module entries */
+    pos = 0;
+    while (PyDict_Next(table, &pos, NULL, &modules)) {
+        Py_ssize_t mpos = 0;
+        PyObject *name;
+
+        while (PyDict_Next(modules, &mpos, &name, &slots)) {
+            PyObject *entry = make_module_entry(slots);
+            int err;
+
+            if (entry == NULL)
+                goto error;
+            /* replacing the value of an existing key is safe here */
+            err = PyDict_SetItem(modules, name, entry);
+            Py_DECREF(entry);
+            if (err != 0)
+                goto error;
+        }
+    }
+    Py_DECREF(suffixes);
+    return table;
+
+error:
+    Py_XDECREF(table);
+    Py_XDECREF(suffixes);
+    return NULL;
+}
+
+/*
+   build_children(files) -> children index (new reference)
+
+   Map each directory prefix of the files dict ("" or "a/sub/directory/",
+   using SEP as a separator) to the sorted list of the names directly
+   below it, so that a directory is listed without a scan of the
+   archive.
+*/
+static PyObject *
+build_children(PyObject *files)
+{
+    PyObject *index, *path, *names;
+    Py_ssize_t pos = 0;
+
+    index = PyDict_New();
+    if (index == NULL)
+        return NULL;
+
+    while (PyDict_Next(files, &pos, &path, NULL)) {
+        Py_ssize_t len = PyUnicode_GET_LENGTH(path), start = 0, sep;
+
+        for (;;) {
+            PyObject *prefix, *name;
+            int err;
+
+            sep = PyUnicode_FindChar(path, SEP, start, len, 1);
+            if (sep == -2)
+                goto error;
+            if ((sep < 0 ? len : sep) > start) {
+                prefix = PyUnicode_Substring(path, 0, start);
+                if (prefix == NULL)
+                    goto error;
+                names = PyDict_GetItemWithError(index, prefix);
+                if (names == NULL) {
+                    names = PyErr_Occurred() ? NULL : PySet_New(NULL);
+                    if (names == NULL ||
+                        PyDict_SetItem(index, prefix, names) != 0) {
+                        Py_XDECREF(names);
+                        Py_DECREF(prefix);
+                        goto error;
+                    }
+                    Py_DECREF(names);
+                }
+                Py_DECREF(prefix);
+                name = PyUnicode_Substring(path, start, sep < 0 ? len : sep);
+                if (name == NULL)
+                    goto error;
+                err = PySet_Add(names, name);
+                Py_DECREF(name);
+                if (err != 0)
+                    goto error;
+            }
+            if (sep < 0)
+                break;
+            start = sep + 1;
+        }
+    }
+
+    /* turn the sets into sorted lists */
+    pos = 0;
+    while (PyDict_Next(index, &pos, &path, &names)) {
+        PyObject *list = PySequence_List(names);
+        int err;
+
+        if (list == NULL)
+            goto error;
+        if (PyList_Sort(list) != 0) {
+            Py_DECREF(list);
+            goto error;
+        }
+        /* replacing the value of an existing key is safe here */
+        err = PyDict_SetItem(index, path, list);
+        Py_DECREF(list);
+        if (err != 0)
+            goto error;
+    }
+    return index;
+
+error:
+    Py_DECREF(index);
+    return NULL;
+}
+
+/* Return the sorted names directly below the directory 'prefix' of
+   archive as a borrowed reference, or NULL without an exception if
+   there is no such directory. The index is built from 'files' on
+   first use. */
+static PyObject *
+get_children(PyObject *archive, PyObject *files, PyObject *prefix)
+{
+    PyObject *index;
+
+    index = PyDict_GetItemWithError(children_cache, archive);
+    if (index == NULL) {
+        int err;
+
+        if (PyErr_Occurred())
+            return NULL;
+        index = build_children(files);
+        if (index == NULL)
+            return NULL;
+        err = PyDict_SetItem(children_cache, archive, index);
+        Py_DECREF(index);
+        if (err != 0)
+            return NULL;
+    }
+    return PyDict_GetItemWithError(index, prefix);
+}
+
+/* Archive7z support */
+
+static void
+archive7z_free(PyObject *capsule)
+{
+    Archive7z *arc = PyCapsule_GetPointer(capsule, NULL);
+    ISzAlloc alloc = { SzAlloc, SzFree };
+
+    if (arc->index == NULL)
+        SzArEx_Free(&arc->db, &alloc);
+    else {
+        /* only the properties loaded later are owned by db */
+        CSzArEx props;
+
+        SzArEx_Init(&props);
+        props.Attribs = arc->db.Attribs;
+        props.MTime = arc->db.MTime;
+        props.CTime = arc->db.CTime;
+        SzArEx_Free(&props, &alloc);
+#ifdef HAVE_INDEX_MMAP
+        if (arc->index_data == NULL)
+            munmap(arc->index, arc->index_size);
+#endif
+    }
+    Py_XDECREF(arc->index_data);
+    Py_XDECREF(arc->window);
+#ifdef USE_POSIX_FILE
+    File_Close(&arc->file);
+#endif
+    Py_XDECREF(arc->fileobj);
+    if (arc->view.buf != NULL)
+        PyBuffer_Release(&arc->view);
+    PyMem_Free(arc->blocks);
+    if (arc->fileobj_lock != NULL)
+        PyThread_free_lock(arc->fileobj_lock);
+    PyMem_Free(arc);
+}
+
+/* The fingerprint an index sidecar is valid for. */
+typedef struct {
+    UInt64 size;
+    Int64 mtime_ns;
+    UInt64 start_pos;           /* offset of the start header */
+    UInt32 start_header_crc;    /* CRC of the whole start header */
+} archive_fingerprint;
+
+/* Layout of an index sidecar: an index_header, the archive path
+   encoded to UTF-8, then the arrays of CSzArEx listed by
+   get_index_sections(), each one aligned to INDEX_ALIGN. The sidecar
+   is only meant for the machine that wrote it, so it's in native
+   byte order and sizes. */
+typedef struct {
+    char magic[8];
+    UInt32 header_size;     /* sizeof(index_header) */
+    UInt32 sizeof_size_t;
+    archive_fingerprint fingerprint;
+    UInt64 total_size;      /* size of the whole sidecar */
+    UInt32 payload_crc;     /* CRC of everything after the header */
+    UInt32 path_size;
+    UInt64 data_pos;
+    UInt64 start_pos_after_header;
+    UInt32 num_files;
+    UInt32 num_folders;
+    UInt32 num_pack_streams;
+    UInt32 lazy_props;
+    CSzPropRef attribs_ref;     /* properties left in the archive */
+    CSzPropRef mtime_ref;
+    CSzPropRef ctime_ref;
+    UInt64 offsets[INDEX_NUM_SECTIONS];     /* 0 for NULL arrays */
+    UInt64 sizes[INDEX_NUM_SECTIONS];
+} index_header;
+
+/* Fill 'ptrs' with the addresses of the arrays of db that go into the
+   index sidecar, and 'sizes' with their sizes in bytes. */
+static void
+get_index_sections(CSzArEx *db, void **ptrs[], UInt64 sizes[])
+{
+    CSzAr *ar = &db->db;
+    UInt64 nf = db->NumFiles, nfo = ar->NumFolders;
+    int i = 0;
+
+#define SECTION(field, size) \
+    ptrs[i] = (void **)&(field); \
+    sizes[i++] = (field) ? (UInt64)(size) : 0;
+
+    SECTION(ar->PackPositions, (ar->NumPackStreams + 1) * sizeof(UInt64))
+    SECTION(ar->FolderCRCs.Defs, (nfo + 7) >> 3)
+    SECTION(ar->FolderCRCs.Vals, nfo * sizeof(UInt32))
+    SECTION(ar->FoCodersOffsets, (nfo + 1) * sizeof(size_t))
+    SECTION(ar->FoStartPackStreamIndex, (nfo + 1) * sizeof(UInt32))
+    SECTION(ar->FoToCoderUnpackSizes, (nfo + 1) * sizeof(UInt32))
+    SECTION(ar->FoToMainUnpackSizeIndex, nfo)
+    SECTION(ar->CoderUnpackSizes,
+            ar->FoToCoderUnpackSizes[nfo] * sizeof(UInt64))
+    SECTION(ar->CodersData, ar->FoCodersOffsets[nfo])
+    SECTION(db->UnpackPositions, (nf + 1) * sizeof(UInt64))
+    SECTION(db->IsDirs, (nf + 7) >> 3)
+    SECTION(db->CRCs.Defs, (nf + 7) >> 3)
+    SECTION(db->CRCs.Vals, nf * sizeof(UInt32))
+    SECTION(db->FolderToFile, (nfo + 1) * sizeof(UInt32))
+    SECTION(db->FileToFolder, nf * sizeof(UInt32))
+    SECTION(db->FileNameOffsets, (nf + 1) * sizeof(size_t))
+    SECTION(db->FileNames, db->FileNameOffsets[nf] * 2)
+
+#undef SECTION
+    assert(i == INDEX_NUM_SECTIONS);
+}
+
+/* Return the path of the index sidecar for archive in cache_dir. */
+static PyObject *
+get_index_path(PyObject *archive)
+{
+    uint64_t h = name_hash(archive, 0, PyUnicode_GET_LENGTH(archive));
+
+    return PyUnicode_FromFormat("%U%c%08x%08x%s", cache_dir, SEP,
+                                (unsigned int)(h >> 32),
+                                (unsigned int)h, INDEX_SUFFIX);
+}
+
+/* Store the size of the archive file and its modification time in
+   nanoseconds in *p_size and *p_mtime_ns. */
+static int
+stat_archive(PyObject *archive, UInt64 *p_size, Int64 *p_mtime_ns)
+{
+    struct stat statbuf;
+
+    if (_Py_stat(archive, &statbuf) != 0) {
+        PyErr_Clear();
+        return -1;
+    }
+    *p_size = (UInt64)statbuf.st_size;
+    /* whole seconds would let a rewrite within the same second pass */
+    *p_mtime_ns = (Int64)statbuf.st_mtime * 1000000000;
+#if defined(HAVE_STAT_TV_NSEC)
+    *p_mtime_ns += statbuf.st_mtim.tv_nsec;
+#elif defined(HAVE_STAT_TV_NSEC2)
+    *p_mtime_ns += statbuf.st_mtimespec.tv_nsec;
+#endif
+    return 0;
+}
+
+/* Return the fingerprint of the archive open in 'stream'. The start
+   header is the one found after any stub, so that rewriting the archive
+   behind an unchanged stub changes the fingerprint too. */
+static int
+get_fingerprint(PyObject *archive, CFileInStream *stream,
+                archive_fingerprint *fp)
+{
+    ISzAlloc alloc = { SzAlloc, SzFree };
+    CLookToRead2 stream_look;
+    Byte header[k7zStartHeaderSize];
+    UInt64 start_pos;
+    SRes res;
+
+    memset(fp, 0, sizeof(*fp));
+    if (stat_archive(archive, &fp->size, &fp->mtime_ns) < 0)
+        return -1;
+    FileInStream_CreateVTable(stream);
+    LookToRead2_CreateVTable(&stream_look, False);
+    stream_look.buf = (Byte*)ISzAlloc_Alloc(&alloc, INPUT_BUFSIZE);
+    if (stream_look.buf == NULL)
+        return -1;
+    stream_look.bufSize = INPUT_BUFSIZE;
+    stream_look.realStream = &stream->vt;
+    LookToRead2_Init(&stream_look);
+    res = seek_to_start_header(&stream_look.vt, &start_pos);
+    if (res == SZ_OK)
+        res = LookInStream_Read(&stream_look.vt, header, sizeof(header));
+    ISzAlloc_Free(&alloc, stream_look.buf);
+    if (res != SZ_OK)
+        return -1;
+
+    fp->start_pos = start_pos;
+    fp->start_header_crc = CrcCalc(header, sizeof(header));
+    return 0;
+}
+
+/* Point the arrays of arc->db into the index sidecar at arc->index, if
+   it's a valid index for archive with the given fingerprint. */
+static int
+check_index(Archive7z *arc, PyObject *archive,
+            const archive_fingerprint *fp)
+{
+    const index_header *h = arc->index;
+    const char *base = arc->index;
+    void **ptrs[INDEX_NUM_SECTIONS];
+    UInt64 sizes[INDEX_NUM_SECTIONS];
+    const char *path;
+    Py_ssize_t path_size;
+    int i;
+
+    if (arc->index_size < sizeof(index_header) ||
+        memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->header_size != sizeof(index_header) ||
+        h->sizeof_size_t != sizeof(size_t) ||
+        h->total_size != arc->index_size ||
+        memcmp(&h->fingerprint, fp, sizeof(*fp)) != 0)
+        return 0;
+
+    path = PyUnicode_AsUTF8AndSize(archive, &path_size);
+    if (path == NULL)
+        return -1;
+    if (h->path_size != (UInt64)path_size ||
+        h->path_size > arc->index_size - sizeof(index_header) ||
+        memcmp(base + sizeof(index_header), path, path_size) != 0)
+        return 0;
+    if (CrcCalc(base + sizeof(index_header),
+                arc->index_size - sizeof(index_header)) != h->payload_crc)
+        return 0;
+
+    arc->db.NumFiles = h->num_files;
+    arc->db.db.NumFolders = h->num_folders;
+    arc->db.db.NumPackStreams = h->num_pack_streams;
+    arc->db.LazyProps = (Byte)h->lazy_props;
+    arc->db.AttribsRef = h->attribs_ref;
+    arc->db.MTimeRef = h->mtime_ref;
+    arc->db.CTimeRef = h->ctime_ref;
+    arc->db.dataPos = h->data_pos;
+    arc->db.startPosAfterHeader = h->start_pos_after_header;
+    for (i = 0; i < INDEX_NUM_SECTIONS; i++) {
+        if (h->offsets[i] > arc->index_size ||
+            h->sizes[i] > arc->index_size - h->offsets[i])
+            return 0;
+    }
+    get_index_sections(&arc->db, ptrs, sizes);
+    for (i = 0; i < INDEX_NUM_SECTIONS; i++)
+        *ptrs[i] = h->offsets[i] ? (void *)(base + h->offsets[i]) : NULL;
+    /* the sizes of the variable arrays depend on the others */
+    get_index_sections(&arc->db, ptrs, sizes);
+    for (i = 0; i < INDEX_NUM_SECTIONS; i++) {
+        if (sizes[i] != h->sizes[i]) {
+            SzArEx_Init(&arc->db);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Try to load the index sidecar of archive. Return 1 if arc->db was
+   set up from it, 0 if there is no valid sidecar. */
+static int
+load_index(Archive7z *arc, PyObject *archive,
+           const archive_fingerprint *fp)
+{
+    PyObject *index_path;
+    int rv;
+
+    index_path = get_index_path(archive);
+    if (index_path == NULL)
+        return -1;
+#ifdef HAVE_INDEX_MMAP
+    {
+        PyObject *encoded;
+        struct stat statbuf;
+        int fd;
+
+        if (!PyUnicode_FSConverter(index_path, &encoded)) {
+            Py_DECREF(index_path);
+            return -1;
+        }
+        Py_DECREF(index_path);
+        fd = open(PyBytes_AS_STRING(encoded), O_RDONLY | O_CLOEXEC);
+        Py_DECREF(encoded);
+        if (fd < 0)
+            return 0;
+        if (fstat(fd, &statbuf) != 0 || statbuf.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        arc->index_size = (size_t)statbuf.st_size;
+        arc->index = mmap(NULL, arc->index_size, PROT_READ, MAP_PRIVATE,
+                          fd, 0);
+        close(fd);
+        if (arc->index == MAP_FAILED) {
+            arc->index = NULL;
+            return 0;
+        }
+    }
+#else
+    {
+        FILE *fp_index = _Py_fopen_obj(index_path, "rb");
+        long size;
+
+        Py_DECREF(index_path);
+        if (fp_index == NULL) {
+            PyErr_Clear();
+            return 0;
+        }
+        if (fseek(fp_index, 0, SEEK_END) != 0 ||
+            (size = ftell(fp_index)) <= 0 ||
+            fseek(fp_index, 0, SEEK_SET) != 0) {
+            fclose(fp_index);
+            return 0;
+        }
+        arc->index_data = PyBytes_FromStringAndSize(NULL, size);
+        if (arc->index_data == NULL) {
+            fclose(fp_index);
+            return -1;
+        }
+        if (fread(PyBytes_AS_STRING(arc->index_data), 1, size,
+                  fp_index) != (size_t)size) {
+            fclose(fp_index);
+            Py_CLEAR(arc->index_data);
+            return 0;
+        }
+        fclose(fp_index);
+        arc->index = PyBytes_AS_STRING(arc->index_data);
+        arc->index_size = (size_t)size;
+    }
+#endif
+    rv = check_index(arc, archive, fp);
+    if (rv != 1) {
+#ifdef HAVE_INDEX_MMAP
+        munmap(arc->index, arc->index_size);
+#endif
+        Py_CLEAR(arc->index_data);
+        arc->index = NULL;
+        arc->index_size = 0;
+    }
+    return rv;
+}
+
+/* Write a cache file, creating its directory if needed. It's written
+   to a temporary file first and then moved in place, so that
+   concurrent processes never see a partial one. The temporary name is
+   unique to the process, thread and call, as threads writing the same
+   file would otherwise share it. */
+static int
+write_cache_file(PyObject *path, const void *data, size_t size)
+{
+    static unsigned long tmp_counter = 0;   /* guarded by the GIL */
+    PyObject *os, *dir, *tmp_path = NULL, *res;
+    Py_ssize_t sep;
+    FILE *f;
+    int ok;
+
+    os = PyImport_ImportModule("os");
+    if (os == NULL)
+        return -1;
+    sep = PyUnicode_FindChar(path, SEP, 0, PyUnicode_GET_LENGTH(path), -1);
+    if (sep == -2)
+        goto error;
+    if (sep > 0) {
+        dir = PyUnicode_Substring(path, 0, sep);
+        if (dir == NULL)
+            goto error;
+        res = PyObject_CallMethod(os, "makedirs", "OiO", dir, 0777, Py_True);
+        Py_DECREF(dir);
+        if (res == NULL)
+            goto error;
+        Py_DECREF(res);
+    }
+    tmp_path = PyUnicode_FromFormat("%U.%ld.%lu.%lu.tmp", path,
+                                    (long)getpid(), PyThread_get_thread_ident(),
+                                    ++tmp_counter);
+    if (tmp_path == NULL)
+        goto error;
+    f = _Py_fopen_obj(tmp_path, "wb");
+    if (f == NULL)
+        goto error;
+    ok = fwrite(data, 1, size, f) == size;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, tmp_path);
+        goto error;
+    }
+    res = PyObject_CallMethod(os, "replace", "OO", tmp_path, path);
+    if (res == NULL)
+        goto error;
+    Py_DECREF(res);
+    Py_DECREF(os);
+    Py_DECREF(tmp_path);
+    return 0;
+
+error:
+    if (tmp_path != NULL) {
+        PyObject *exc, *val, *tb;
+        PyErr_Fetch(&exc, &val, &tb);
+        res = PyObject_CallMethod(os, "unlink", "O", tmp_path);
+        Py_XDECREF(res);
+        PyErr_Clear();
+        PyErr_Restore(exc, val, tb);
+    }
+    Py_DECREF(os);
+    Py_XDECREF(tmp_path);
+    return -1;
+}
+
+/* Write the index sidecar for archive. */
+static int
+save_index(Archive7z *arc, PyObject *archive,
+           const archive_fingerprint *fp)
+{
+    void **ptrs[INDEX_NUM_SECTIONS];
+    UInt64 sizes[INDEX_NUM_SECTIONS];
+    index_header *h;
+    PyObject *data, *index_path;
+    const char *path;
+    Py_ssize_t path_size;
+    UInt64 pos;
+    int i, rv;
+
+    path = PyUnicode_AsUTF8AndSize(archive, &path_size);
+    if (path == NULL)
+        return -1;
+    get_index_sections(&arc->db, ptrs, sizes);
+    pos = sizeof(index_header) + path_size;
+    for (i = 0; i < INDEX_NUM_SECTIONS; i++) {
+        pos = (pos + INDEX_ALIGN - 1) & ~(UInt64)(INDEX_ALIGN - 1);
+        pos += sizes[i];
+    }
+    if ((Py_ssize_t)pos < 0 || (UInt64)(Py_ssize_t)pos != pos) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    data = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)pos);
+    if (data == NULL)
+        return -1;
+    memset(PyBytes_AS_STRING(data), 0, (size_t)pos);
+    h = (index_header *)PyBytes_AS_STRING(data);
+    memcpy(h->magic, INDEX_MAGIC, sizeof(h->magic));
+    h->header_size = sizeof(index_header);
+    h->sizeof_size_t = sizeof(size_t);
+    h->fingerprint = *fp;
+    h->total_size = pos;
+    h->path_size = (UInt32)path_size;
+    h->data_pos = arc->db.dataPos;
+    h->start_pos_after_header = arc->db.startPosAfterHeader;
+    h->num_files = arc->db.NumFiles;
+    h->num_folders = arc->db.db.NumFolders;
+    h->num_pack_streams = arc->db.db.NumPackStreams;
+    h->lazy_props = arc->db.LazyProps;
+    h->attribs_ref = arc->db.AttribsRef;
+    h->mtime_ref = arc->db.MTimeRef;
+    h->ctime_ref = arc->db.CTimeRef;
+    memcpy((char *)h + sizeof(index_header), path, path_size);
+    pos = sizeof(index_header) + path_size;
+    for (i = 0; i < INDEX_NUM_SECTIONS; i++) {
+        pos = (pos + INDEX_ALIGN - 1) & ~(UInt64)(INDEX_ALIGN - 1);
+        h->sizes[i] = sizes[i];
+        if (*ptrs[i] != NULL) {
+            h->offsets[i] = pos;
+            memcpy((char *)h + pos, *ptrs[i], (size_t)sizes[i]);
+        }
+        pos += sizes[i];
+    }
+    h->payload_crc = CrcCalc((char *)h + sizeof(index_header),
+                             (size_t)pos - sizeof(index_header));
+
+    index_path = get_index_path(archive);
+    if (index_path == NULL) {
+        Py_DECREF(data);
+        return -1;
+    }
+    rv = write_cache_file(index_path, h, (size_t)pos);
+    Py_DECREF(index_path);
+    Py_DECREF(data);
+    return rv;
+}
+
+/* Read the blocks of arc->fileobj from 'block' on into the block cache,
+   FILEOBJ_READ_AHEAD at a time. Called with the GIL and the cache lock
+   held. */
+static int
+read_fileobj_blocks(Archive7z *arc, UInt64 block)
+{
+    Byte *staging = arc->blocks + FILEOBJ_NUM_BLOCKS * FILEOBJ_BLOCK_SIZE;
+    UInt64 start = block * FILEOBJ_BLOCK_SIZE;
+    size_t size = FILEOBJ_READ_AHEAD * FILEOBJ_BLOCK_SIZE;
+    size_t pos = 0, i;
+    PyObject *view, *res;
+
+    if (size > arc->fileobj_size - start)
+        size = (size_t)(arc->fileobj_size - start);
+    res = _PyObject_CallMethodId(arc->fileobj, &PyId_seek, "K",
+                                 (unsigned long long)start);
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    while (pos < size) {
+        Py_ssize_t n;
+
+        view = PyMemoryView_FromMemory((char *)staging + pos, size - pos,
+                                       PyBUF_WRITE);
+        if (view == NULL)
+            return -1;
+        res = _PyObject_CallMethodIdObjArgs(arc->fileobj, &PyId_readinto,
+                                            view, NULL);
+        Py_DECREF(view);
+        if (res == NULL)
+            return -1;
+        n = res == Py_None ? -1 : PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+        if (n <= 0 || (size_t)n > size - pos) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(Import7zError, "short read from file object");
+            return -1;
+        }
+        pos += (size_t)n;
+    }
+    for (i = 0; i * FILEOBJ_BLOCK_SIZE < size; i++) {
+        size_t slot = (size_t)((block + i) % FILEOBJ_NUM_BLOCKS);
+        size_t n = size - i * FILEOBJ_BLOCK_SIZE;
+
+        if (n > FILEOBJ_BLOCK_SIZE)
+            n = FILEOBJ_BLOCK_SIZE;
+        memcpy(arc->blocks + slot * FILEOBJ_BLOCK_SIZE,
+               staging + i * FILEOBJ_BLOCK_SIZE, n);
+        arc->block_ids[slot] = block + i + 1;
+    }
+    return 0;
+}
+
+/* An ISeekInStream over the file object of an archive. Reads are
+   served from the block cache of the archive, so that the small reads
+   of the decoder don't each become a call into Python. They may come
+   from any thread, with or without the GIL. */
+typedef struct {
+    ISeekInStream vt;
+    Archive7z *arc;
+    UInt64 pos;
+} CFileObjInStream;
+
+static SRes
+FileObjInStream_Read(const ISeekInStream *pp, void *buf, size_t *size)
+{
+    CFileObjInStream *p = CONTAINER_FROM_VTBL(pp, CFileObjInStream, vt);
+    Archive7z *arc = p->arc;
+    UInt64 block = p->pos / FILEOBJ_BLOCK_SIZE;
+    size_t offset = (size_t)(p->pos % FILEOBJ_BLOCK_SIZE);
+    size_t slot = (size_t)(block % FILEOBJ_NUM_BLOCKS);
+    size_t avail = FILEOBJ_BLOCK_SIZE - offset;
+    PyGILState_STATE gil;
+    SRes res = SZ_OK;
+
+    if (p->pos >= arc->fileobj_size) {
+        *size = 0;
+        return SZ_OK;
+    }
+    if (avail > arc->fileobj_size - p->pos)
+        avail = (size_t)(arc->fileobj_size - p->pos);
+    if (*size > avail)
+        *size = avail;
+
+    gil = PyGILState_Ensure();
+    /* the file object may release the GIL, so the cache has a lock of
+       its own, which is never waited for with the GIL held */
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(arc->fileobj_lock, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+    if (arc->block_ids[slot] != block + 1 &&
+        read_fileobj_blocks(arc, block) < 0) {
+        PyErr_Clear();
+        res = SZ_ERROR_READ;
+    }
+    else {
+        memcpy(buf, arc->blocks + slot * FILEOBJ_BLOCK_SIZE + offset, *size);
+        p->pos += *size;
+    }
+    PyThread_release_lock(arc->fileobj_lock);
+    PyGILState_Release(gil);
+    return res;
+}
+
+static SRes
+FileObjInStream_Seek(const ISeekInStream *pp, Int64 *pos, ESzSeek origin)
+{
+    CFileObjInStream *p = CONTAINER_FROM_VTBL(pp, CFileObjInStream, vt);
+    Int64 base;
+
+    switch (origin) {
+    case SZ_SEEK_SET: base = 0; break;
+    case SZ_SEEK_CUR: base = (Int64)p->pos; break;
+    case SZ_SEEK_END: base = (Int64)p->arc->fileobj_size; break;
+    default: return SZ_ERROR_PARAM;
+    }
+    base += *pos;
+    if (base < 0)
+        return SZ_ERROR_PARAM;
+    p->pos = (UInt64)base;
+    *pos = base;
+    return SZ_OK;
+}
+
+static void
+FileObjInStream_Init(CFileObjInStream *p, Archive7z *arc)
+{
+    p->vt.Read = FileObjInStream_Read;
+    p->vt.Seek = FileObjInStream_Seek;
+    p->arc = arc;
+    p->pos = 0;
+}
+
+/* Keep the archive file open in arc for later readers, or close it if
+   the file backend can't share it. */
+static void
+keep_archive_file(Archive7z *arc, CSzFile *file)
+{
+#ifdef USE_POSIX_FILE
+    arc->file = *file;
+#else
+    File_Close(file);
+#endif
+}
+
+/* Return a capsule holding a new, empty Archive7z, stored in *p_arc. */
+static PyObject *
+new_archive(Archive7z **p_arc)
+{
+    Archive7z *arc;
+    PyObject *capsule;
+
+    *p_arc = NULL;
+    arc = PyMem_Calloc(1, sizeof(Archive7z));
+    if (arc == NULL)
+        return PyErr_NoMemory();
+    SzArEx_Init(&arc->db);
+#ifdef USE_POSIX_FILE
+    File_Construct(&arc->file);
+#endif
+    capsule = PyCapsule_New(arc, NULL, archive7z_free);
+    if (capsule == NULL) {
+        PyMem_Free(arc);
+        return NULL;
+    }
+    *p_arc = arc;
+    return capsule;
+}
+
+/* Return the offset of the first valid start header in buf[0:size],
+   or -1 if there is none. */
+static Py_ssize_t
+find_start_header(const Byte *buf, size_t size)
+{
+    const Byte *p = buf, *end = buf + size;
+
+    while (end - p >= k7zStartHeaderSize &&
+           (p = memchr(p, k7zSignature[0],
+                       end - p - k7zStartHeaderSize + 1)) != NULL) {
+        if (memcmp(p, k7zSignature, k7zSignatureSize) == 0 &&
+            CrcCalc(p + 12, 20) == GetUi32(p + 8))
+            return p - buf;
+        p++;
+    }
+    return -1;
+}
+
+/* Return the offset of the last start header in buf[0:size] whose
+   archive ends at 'file_size', buf being at archive offset 'base', or
+   -1 if there is none. */
+static Py_ssize_t
+find_last_start_header(const Byte *buf, size_t size, UInt64 base,
+                       UInt64 file_size)
+{
+    size_t i;
+
+    if (size < k7zStartHeaderSize)
+        return -1;
+    for (i = size - k7zStartHeaderSize + 1; i-- > 0; ) {
+        const Byte *p = buf + i;
+        UInt64 left = file_size - (base + i + k7zStartHeaderSize);
+
+        /* the next header is the last thing in an archive */
+        if (p[0] == k7zSignature[0] &&
+            memcmp(p, k7zSignature, k7zSignatureSize) == 0 &&
+            CrcCalc(p + 12, 20) == GetUi32(p + 8) &&
+            GetUi64(p + 12) <= left &&
+            GetUi64(p + 20) == left - GetUi64(p + 12))
+            return (Py_ssize_t)i;
+    }
+    return -1;
+}
+
+/* Seek 'stream' to the start header of the archive, and store its
+   offset in *p_pos if p_pos isn't NULL. It's at offset 0 of plain
+   archives; self-extracting and other prefixed archives have it after a
+   stub, which is searched for it up to SFX_SCAN_LIMIT. Archives after a
+   larger stub are found from the end of the file, where their next
+   header ends. */
+static SRes
+seek_to_start_header(const ILookInStream *stream, UInt64 *p_pos)
+{
+    ILookInStream *in = (ILookInStream *)stream;
+    Byte *buf;
+    size_t have, size;
+    Py_ssize_t found = -1;
+    UInt64 base = 0;
+    Int64 file_size = 0;
+    SRes res;
+
+    RINOK(LookInStream_SeekTo(in, 0));
+    buf = PyMem_Malloc(INPUT_BUFSIZE + k7zStartHeaderSize);
+    if (buf == NULL)
+        return SZ_ERROR_MEM;
+    /* the common case reads no more than the start header */
+    have = k7zStartHeaderSize;
+    res = LookInStream_Read2(in, buf, have, SZ_ERROR_NO_ARCHIVE);
+    while (res == SZ_OK &&
+           (found = find_start_header(buf, have)) < 0 &&
+           base < SFX_SCAN_LIMIT) {
+        /* keep the bytes a header split between reads could start in */
+        size = k7zStartHeaderSize - 1;
+        memmove(buf, buf + have - size, size);
+        base += have - size;
+        have = INPUT_BUFSIZE;
+        res = ILookInStream_Read(in, buf + size, &have);
+        if (res == SZ_OK && have == 0)
+            res = SZ_ERROR_NO_ARCHIVE;
+        have += size;
+    }
+    if (res == SZ_OK && found < 0) {
+        /* the whole head was scanned without reaching the end */
+        UInt64 pos;
+
+        res = ILookInStream_Seek(in, &file_size, SZ_SEEK_END);
+        pos = (UInt64)file_size;
+        while (res == SZ_OK && found < 0 && pos > 0) {
+            base = pos > INPUT_BUFSIZE ? pos - INPUT_BUFSIZE : 0;
+            /* and the start of the headers read before */
+            have = (size_t)(pos - base) + k7zStartHeaderSize - 1;
+            if (have > (UInt64)file_size - base)
+                have = (size_t)((UInt64)file_size - base);
+            res = LookInStream_SeekTo(in, base);
+            if (res == SZ_OK)
+                res = LookInStream_Read(in, buf, have);
+            if (res == SZ_OK)
+                found = find_last_start_header(buf, have, base,
+                                               (UInt64)file_size);
+            pos = base;
+        }
+    }
+    PyMem_Free(buf);
+    RINOK(res);
+    if (found < 0)
+        return SZ_ERROR_NO_ARCHIVE;
+    if (p_pos != NULL)
+        *p_pos = base + found;
+    return LookInStream_SeekTo(in, base + found);
+}
+
+/* Parse the header of the archive looked into by 'stream' into arc->db. */
+static int
+parse_archive_db(Archive7z *arc, PyObject *archive, const ILookInStream *stream)
+{
+    ISzAlloc alloc = { SzAlloc, SzFree };
+    ISzAlloc alloc_tmp = { SzAllocTemp, SzFreeTemp };
+
+    /* the importer doesn't need the attributes and times of files until
+       get_file_info() asks for them */
+    if (seek_to_start_header(stream, NULL) != SZ_OK ||
+        SzArEx_OpenLazy(&arc->db, (ILookInStream *)stream, 1, &alloc,
+                        &alloc_tmp) != SZ_OK) {
+        PyErr_Format(Import7zError, "can't read 7z file: %R", archive);
+        return -1;
+    }
+    return 0;
+}
+
+/* Parse the header of the archive read from 'stream' into arc->db. */
+static int
+read_archive_db(Archive7z *arc, PyObject *archive, const ISeekInStream *stream)
+{
+    ISzAlloc alloc = { SzAlloc, SzFree };
+    CLookToRead2 stream_look;
+    int rv;
+
+    LookToRead2_CreateVTable(&stream_look, False);
+    stream_look.buf = (Byte*)ISzAlloc_Alloc(&alloc, INPUT_BUFSIZE);
+    if (stream_look.buf == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    stream_look.bufSize = INPUT_BUFSIZE;
+    stream_look.realStream = stream;
+    LookToRead2_Init(&stream_look);
+
+    rv = parse_archive_db(arc, archive, &stream_look.vt);
+    ISzAlloc_Free(&alloc, stream_look.buf);
+    return rv;
+}
+
+/*
+   open_archive(archive) -> Archive7z capsule (new reference)
+
+   Read the database of a 7z archive. If caching is enabled, it's
+   mapped from the index sidecar written by an earlier process when
+   the archive's fingerprint still matches; otherwise the archive
+   header is parsed and a new sidecar is written for the next time.
+*/
+static PyObject *
+open_archive(PyObject *archive)
+{
+    Archive7z *arc;
+    PyObject *capsule;
+    archive_fingerprint fp;
+    int have_fp, rv = 0;
+
+    CFileInStream stream_arc;
+
+    capsule = new_archive(&arc);
+    if (capsule == NULL)
+        return NULL;
+
+    if (open_7z_archive(&stream_arc.file, archive) != SZ_OK) {
+        PyErr_Format(Import7zError, "can't open 7z file: %R", archive);
+        Py_DECREF(capsule);
+        return NULL;
+    }
+
+    have_fp = cache_dir != NULL &&
+              get_fingerprint(archive, &stream_arc, &fp) == 0;
+    if (have_fp) {
+        arc->file_size = fp.size;
+        arc->file_mtime_ns = fp.mtime_ns;
+        rv = load_index(arc, archive, &fp);
+    }
+    else if (stat_archive(archive, &arc->file_size,
+                          &arc->file_mtime_ns) < 0)
+        arc->file_mtime_ns = -1;    /* never matches */
+    if (rv < 0)
+        goto error;
+    if (rv == 1) {
+        keep_archive_file(arc, &stream_arc.file);
+        return capsule;
+    }
+
+    FileInStream_CreateVTable(&stream_arc);
+    if (read_archive_db(arc, archive, &stream_arc.vt) < 0)
+        goto error;
+    keep_archive_file(arc, &stream_arc.file);
+
+    /* the sidecar is only a cache, failing to write it is fine */
+    if (have_fp && save_index(arc, archive, &fp) < 0)
+        PyErr_Clear();
+    return capsule;
+
+error:
+    File_Close(&stream_arc.file);
+    Py_DECREF(capsule);
+    return NULL;
+}
+
+/*
+   open_fileobj_archive(archive, fileobj) -> Archive7z capsule (new reference)
+
+   Read the database of the 7z archive in the binary file object
+   'fileobj', which must support seek() and readinto(). 'archive' is
+   the path the archive is known by. No index sidecar is used, as there
+   is no file to check it against.
+*/
+static PyObject *
+open_fileobj_archive(PyObject *archive, PyObject *fileobj)
+{
+    Archive7z *arc;
+    PyObject *capsule, *size;
+    CFileObjInStream stream;
+
+    capsule = new_archive(&arc);
+    if (capsule == NULL)
+        return NULL;
+    Py_INCREF(fileobj);
+    arc->fileobj = fileobj;
+
+    size = _PyObject_CallMethodId(fileobj, &PyId_seek, "ii", 0, 2);
+    if (size == NULL)
+        goto error;
+    arc->fileobj_size = PyLong_AsUnsignedLongLong(size);
+    Py_DECREF(size);
+    if (PyErr_Occurred())
+        goto error;
+
+    arc->blocks = PyMem_Malloc((FILEOBJ_NUM_BLOCKS + FILEOBJ_READ_AHEAD) *
+                               FILEOBJ_BLOCK_SIZE);
+    if (arc->blocks == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    arc->fileobj_lock = PyThread_allocate_lock();
+    if (arc->fileobj_lock == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "can't allocate lock");
+        goto error;
+    }
+
+    FileObjInStream_Init(&stream, arc);
+    if (read_archive_db(arc, archive, &stream.vt) < 0)
+        goto error;
+    return capsule;
+
+error:
+    Py_DECREF(capsule);
+    return NULL;
+}
+
+/* Drop what the caches hold for the archive at 'path'. */
+static int
+forget_archive(PyObject *path)
+{
+    PyObject *caches[] = { directory_cache, module_cache, archive_cache,
+                           snapshot_cache, children_cache };
+    size_t i;
+
+    for (i = 0; i < sizeof(caches) / sizeof(caches[0]); i++) {
+        if (PyDict_GetItem(caches[i], path) != NULL &&
+            PyDict_DelItem(caches[i], path) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Register the archive of 'capsule' under 'path', replacing what was
+   read from there before, and return a new importer of type 'type'
+   for it. */
+static PyObject *
+register_archive(PyObject *type, PyObject *path, PyObject *capsule)
+{
+    if (forget_archive(path) < 0)
+        return NULL;
+    if (PyDict_SetItem(virtual_archives, path, capsule) < 0)
+        return NULL;
+    return PyObject_CallFunctionObjArgs(type, path, NULL);
+}
+
+/* Return the Archive7z capsule of archive as a borrowed reference,
+   opening the archive if it isn't cached. */
+static PyObject *
+get_archive_capsule(PyObject *archive)
+{
+    PyObject *capsule;
+    int err;
+
+    capsule = PyDict_GetItem(virtual_archives, archive);
+    if (capsule != NULL)
+        return capsule;
+    capsule = PyDict_GetItemWithError(archive_cache, archive);
+    if (capsule == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        capsule = open_archive(archive);
+        if (capsule == NULL)
+            return NULL;
+        err = PyDict_SetItem(archive_cache, archive, capsule);
+        Py_DECREF(capsule);
+        if (err != 0)
+            return NULL;
+    }
+    return capsule;
+}
+
+/* Return the Archive7z of archive, opening it if it isn't cached. */
+static Archive7z *
+get_archive(PyObject *archive)
+{
+    PyObject *capsule = get_archive_capsule(archive);
+
+    if (capsule == NULL)
+        return NULL;
+    return PyCapsule_GetPointer(capsule, NULL);
+}
+
+/* Open a reader of the archive file of arc in 'file'. Where the file
+   backend supports it, readers share the descriptor arc keeps open,
+   each one with its own offset. */
+static WRes
+open_archive_file(Archive7z *arc, PyObject *archive, CSzFile *file)
+{
+#ifdef USE_POSIX_FILE
+    if (arc->file.fd >= 0) {
+        File_Share(file, &arc->file);
+        return 0;
+    }
+#endif
+    return open_7z_archive(file, archive);
+}
+
+/* Return 1 if the 'n' UTF-16LE code units at 'p' are all ASCII. */
+static int
+utf16_is_ascii(const Byte *p, size_t n)
+{
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + 2 * i)));
+    }
+    acc = _mm_and_si128(acc, _mm_set1_epi16((short)0xFF80));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(acc, _mm_setzero_si128())) != 0xFFFF)
+        return 0;
+#endif
+    for (; i < n; i++) {
+        if (GetUi16(p + 2 * i) >= 0x80)
+            return 0;
+    }
+    return 1;
+}
+
+/* Narrow 'n' ASCII UTF-16LE code units at 'src' to bytes at 'dst'. */
+static void
+utf16_narrow(Py_UCS1 *dst, const Byte *src, size_t n)
+{
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(v, v));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = (Py_UCS1)src[2 * i];
+    }
+}
+
+/* Return the name of file 'index' of 'db' as a str, with '/' replaced by
+   SEP. The name is read in place from db->FileNames; ASCII names, the
+   common case, are narrowed straight into a compact string. */
+static PyObject *
+get_file_name(const CSzArEx *db, UInt32 index)
+{
+    size_t start = db->FileNameOffsets[index];
+    size_t len = db->FileNameOffsets[index + 1] - start - 1;
+    const Byte *src = db->FileNames + start * 2;
+    int byteorder = -1;
+    PyObject *name;
+
+    if (utf16_is_ascii(src, len)) {
+        Py_UCS1 *data;
+
+        name = PyUnicode_New(len, 127);
+        if (name == NULL)
+            return NULL;
+        data = PyUnicode_1BYTE_DATA(name);
+        utf16_narrow(data, src, len);
+        if (SEP != '/') {
+            for (Py_UCS1 *q = memchr(data, '/', len); q != NULL;
+                 q = memchr(q + 1, '/', len - (q + 1 - data))) {
+                *q = SEP;
+            }
+        }
+        return name;
+    }
+
+    /* 7z names are always UTF-16-LE, with no BOM. Surrogate pairs are
+       combined; lone surrogates are kept. */
+    name = PyUnicode_DecodeUTF16((const char *)src, len * 2,
+                                 "surrogatepass", &byteorder);
+    if (name == NULL || SEP == '/')
+        return name;
+    if (PyUnicode_READY(name) == -1) {
+        Py_DECREF(name);
+        return NULL;
+    }
+    if (PyUnicode_FindChar(name, '/', 0, PyUnicode_GET_LENGTH(name), 1) >= 0) {
+        /* the string is fresh and longer than one character, so it's not
+           shared and can be modified in place */
+        int kind = PyUnicode_KIND(name);
+        void *data = PyUnicode_DATA(name);
+        for (Py_ssize_t j = 0; j < PyUnicode_GET_LENGTH(name); j++) {
+            if (PyUnicode_READ(kind, data, j) == '/')
+                PyUnicode_WRITE(kind, data, j, SEP);
+        }
+    }
+    return name;
+}
+
+/*
+   read_directory(archive) -> files dict (new reference)
+
+   Given a path to a 7z archive, build a dict, mapping file names
+   (local to the archive, using SEP as a separator) to toc entries.
+   The archive database is kept in archive_cache for get_data().
+
+   A toc_entry is a tuple:
+
+   (__file__,      # value to use for __file__, available for all files,
+                   # encoded to the filesystem encoding
+    index,         # index of file
+    file_size,     # size of decompressed data
+   )
+*/
+static PyObject *
+read_directory(PyObject *archive)
+{
+    PyObject *files = NULL;
+    PyObject *nameobj = NULL;
+    PyObject *path = NULL;
+    PyObject *prefix = NULL;
+    PyObject *capsule;
+    Archive7z *arc;
+    CSzArEx *db;
+    int err;
+
+    capsule = PyDict_GetItem(virtual_archives, archive);
+    if (capsule == NULL) {
+        capsule = open_archive(archive);
+        if (capsule == NULL)
+            return NULL;
+        err = PyDict_SetItem(archive_cache, archive, capsule);
+        Py_DECREF(capsule);
+        if (err != 0)
+            return NULL;
+    }
+    arc = PyCapsule_GetPointer(capsule, NULL);
+    db = &arc->db;
+
+    files = PyDict_New();
+    if (files == NULL) {
+        goto error;
+    }
+    prefix = PyUnicode_FromFormat("%U%c", archive, SEP);
+    if (prefix == NULL) {
+        goto error;
+    }
+
+    for (uint32_t i = 0; i < db->NumFiles; i++) {
+        PyObject *t;
+        unsigned long long file_size = SzArEx_GetFileSize(db, i);
+
+        nameobj = get_file_name(db, i);
+        if (nameobj == NULL) {
+            goto error;
+        }
+        path = PyUnicode_Concat(prefix, nameobj);
+        if (path == NULL) {
+            goto error;
+        }
+        t = Py_BuildValue("NIK", path, i, file_size);
+        if (t == NULL) {
+            goto error;
+        }
+        err = PyDict_SetItem(files, nameobj, t);
+        Py_CLEAR(nameobj);
+        Py_DECREF(t);
+        if (err != 0) {
+            goto error;
+        }
+    }
+    Py_DECREF(prefix);
+    return files;
+
+error:
+    Py_XDECREF(files);
+    Py_XDECREF(nameobj);
+    Py_XDECREF(prefix);
+    return NULL;
+}
+
+/* A file extracted from the archive. The bytes of the file are at
+   data[0:size], and data[size] can be written, so that the file can
+   be NUL-terminated without a copy. They live either in the decoded
+   folder buffer 'out', or in the bytes object 'bytes'. */
+typedef struct {
+    Byte *out;          /* folder buffer, or NULL */
+    PyObject *bytes;    /* bytes object, or NULL */
+    char *data;
+    size_t size;
+} extracted_file;
+
+static void
+release_file(extracted_file *f)
+{
+    ISzAlloc alloc = { SzAlloc, SzFree };
+
+    IAlloc_Free(&alloc, f->out);
+    Py_CLEAR(f->bytes);
+    f->out = NULL;
+}
+
+/* An ISeekInStream over an archive, read from its file or its file
+   object, that counts the reads. */
+typedef struct {
+    ISeekInStream vt;
+    CSzFile file;
+    CFileObjInStream fileobj;
+    int use_fileobj;
+    UInt64 read_calls;
+    UInt64 read_bytes;
+} CCountingInStream;
+
+static SRes
+CountingInStream_Read(const ISeekInStream *pp, void *buf, size_t *size)
+{
+    CCountingInStream *p = CONTAINER_FROM_VTBL(pp, CCountingInStream, vt);
+
+    p->read_calls++;
+    if (p->use_fileobj) {
+        RINOK(p->fileobj.vt.Read(&p->fileobj.vt, buf, size));
+    }
+    else if (File_Read(&p->file, buf, size) != 0)
+        return SZ_ERROR_READ;
+    p->read_bytes += *size;
+    return SZ_OK;
+}
+
+static SRes
+CountingInStream_Seek(const ISeekInStream *pp, Int64 *pos, ESzSeek origin)
+{
+    CCountingInStream *p = CONTAINER_FROM_VTBL(pp, CCountingInStream, vt);
+
+    if (p->use_fileobj)
+        return p->fileobj.vt.Seek(&p->fileobj.vt, pos, origin);
+    return File_Seek(&p->file, pos, origin);
+}
+
+/* Open a counting reader of the archive of arc in 'p'. */
+static WRes
+open_archive_stream(Archive7z *arc, PyObject *archive, CCountingInStream *p)
+{
+    p->vt.Read = CountingInStream_Read;
+    p->vt.Seek = CountingInStream_Seek;
+    p->read_calls = 0;
+    p->read_bytes = 0;
+    p->use_fileobj = arc->fileobj != NULL;
+    File_Construct(&p->file);
+    if (p->use_fileobj) {
+        FileObjInStream_Init(&p->fileobj, arc);
+        return 0;
+    }
+    return open_archive_file(arc, archive, &p->file);
+}
+
+/* Read exactly 'size' bytes at archive offset 'pos' into buf. */
+static SRes
+read_at(CCountingInStream *stream, UInt64 pos, void *buf, size_t size)
+{
+    Int64 offset = (Int64)pos;
+
+    RINOK(stream->vt.Seek(&stream->vt, &offset, SZ_SEEK_SET));
+    return SeqInStream_Read((const ISeqInStream *)&stream->vt, buf, size);
+}
+
+/* An ILookInStream over the pack streams of a folder, staged in one
+   buffer before decoding. Positions are archive offsets, so that the
+   decoder can seek between the pack streams for free. */
+typedef struct {
+    ILookInStream vt;
+    Byte *buf;
+    UInt64 start;   /* archive offset of buf[0] */
+    size_t size;
+    size_t pos;
+} CStagedInStream;
+
+static SRes
+StagedInStream_Look(const ILookInStream *pp, const void **buf, size_t *size)
+{
+    CStagedInStream *p = CONTAINER_FROM_VTBL(pp, CStagedInStream, vt);
+    size_t rem = p->size - p->pos;
+
+    if (*size > rem)
+        *size = rem;
+    *buf = p->buf + p->pos;
+    return SZ_OK;
+}
+
+static SRes
+StagedInStream_Skip(const ILookInStream *pp, size_t offset)
+{
+    CStagedInStream *p = CONTAINER_FROM_VTBL(pp, CStagedInStream, vt);
+
+    if (offset > p->size - p->pos)
+        return SZ_ERROR_INPUT_EOF;
+    p->pos += offset;
+    return SZ_OK;
+}
+
+static SRes
+StagedInStream_Read(const ILookInStream *pp, void *buf, size_t *size)
+{
+    CStagedInStream *p = CONTAINER_FROM_VTBL(pp, CStagedInStream, vt);
+    size_t rem = p->size - p->pos;
+
+    if (*size > rem)
+        *size = rem;
+    memcpy(buf, p->buf + p->pos, *size);
+    p->pos += *size;
+    return SZ_OK;
+}
+
+static SRes
+StagedInStream_Seek(const ILookInStream *pp, Int64 *pos, ESzSeek origin)
+{
+    CStagedInStream *p = CONTAINER_FROM_VTBL(pp, CStagedInStream, vt);
+    Int64 base;
+
+    switch (origin) {
+    case SZ_SEEK_SET: base = 0; break;
+    case SZ_SEEK_CUR: base = (Int64)(p->start + p->pos); break;
+    case SZ_SEEK_END: base = (Int64)(p->start + p->size); break;
+    default: return SZ_ERROR_PARAM;
+    }
+    base += *pos;
+    if (base < (Int64)p->start || base > (Int64)(p->start + p->size))
+        return SZ_ERROR_PARAM;
+    p->pos = (size_t)(base - (Int64)p->start);
+    *pos = base;
+    return SZ_OK;
+}
+
+static void
+StagedInStream_Init(CStagedInStream *p, Byte *buf, UInt64 start,
+                    size_t size)
+{
+    p->vt.Look = StagedInStream_Look;
+    p->vt.Skip = StagedInStream_Skip;
+    p->vt.Read = StagedInStream_Read;
+    p->vt.Seek = StagedInStream_Seek;
+    p->buf = buf;
+    p->start = start;
+    p->size = size;
+    p->pos = 0;
+}
+
+/*
+   open_buffer_archive(archive, buffer) -> Archive7z capsule (new reference)
+
+   Read the database of the 7z archive held by 'buffer', an object
+   supporting the buffer protocol. The buffer is kept exported while
+   the archive is open, and the archive is decoded from it in place.
+   'archive' is the path the archive is known by.
+*/
+static PyObject *
+open_buffer_archive(PyObject *archive, PyObject *buffer)
+{
+    Archive7z *arc;
+    PyObject *capsule;
+    CStagedInStream stream;
+
+    capsule = new_archive(&arc);
+    if (capsule == NULL)
+        return NULL;
+    if (PyObject_GetBuffer(buffer, &arc->view, PyBUF_SIMPLE) < 0) {
+        arc->view.buf = NULL;
+        Py_DECREF(capsule);
+        return NULL;
+    }
+    StagedInStream_Init(&stream, arc->view.buf, 0, (size_t)arc->view.len);
+    if (parse_archive_db(arc, archive, &stream.vt) < 0) {
+        Py_DECREF(capsule);
+        return NULL;
+    }
+    return capsule;
+}
+
+/* Return the number of pack streams of folder 'fo' and set *start and
+   *size to the archive range they take. The pack streams of a folder
+   have consecutive indices and PackPositions holds their running sums,
+   so they are adjacent by construction and every seek of the decoder
+   between them stays in the range. */
+static UInt32
+get_pack_range(const CSzArEx *db, UInt32 fo, UInt64 *start, UInt64 *size)
+{
+    const CSzAr *ar = &db->db;
+    UInt32 first = ar->FoStartPackStreamIndex[fo];
+    UInt32 last = ar->FoStartPackStreamIndex[fo + 1];
+
+    *start = db->dataPos + ar->PackPositions[first];
+    *size = ar->PackPositions[last] - ar->PackPositions[first];
+    return last - first;
+}
+
+#ifdef HAVE_READ_AHEAD
+/* An ILookInStream over the range [start, end) of an archive, read in
+   order by a thread of its own into two buffers: while the decoder
+   looks into one, the reader fills the other. */
+typedef struct {
+    ILookInStream vt;
+    CCountingInStream *stream;
+    Byte *bufs[2];
+    size_t buf_size;
+    size_t sizes[2];    /* bytes in each buffer once it's ready */
+    int ready[2];
+    int cur;            /* buffer the decoder looks into */
+    size_t cur_pos;
+    UInt64 pos;         /* archive offset of bufs[cur] + cur_pos */
+    UInt64 end;
+    int done;           /* the reader has read up to end or failed */
+    int stop;
+    SRes res;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CReadAheadInStream;
+
+static void *
+read_ahead_thread(void *arg)
+{
+    CReadAheadInStream *p = arg;
+    UInt64 fill_pos = p->pos;
+    int i = 0;
+    SRes res = SZ_OK;
+    int stop = 0;
+
+    while (fill_pos < p->end && res == SZ_OK) {
+        size_t size = p->buf_size;
+
+        pthread_mutex_lock(&p->lock);
+        while (p->ready[i] && !p->stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+
+        if (size > p->end - fill_pos)
+            size = (size_t)(p->end - fill_pos);
+        res = read_at(p->stream, fill_pos, p->bufs[i], size);
+
+        pthread_mutex_lock(&p->lock);
+        p->sizes[i] = size;
+        p->ready[i] = (res == SZ_OK);
+        p->res = res;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        fill_pos += size;
+        i ^= 1;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static SRes
+ReadAheadInStream_Look(const ILookInStream *pp, const void **buf,
+                       size_t *size)
+{
+    CReadAheadInStream *p = CONTAINER_FROM_VTBL(pp, CReadAheadInStream, vt);
+    SRes res;
+    size_t rem;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->ready[p->cur] && p->cur_pos == p->sizes[p->cur]) {
+        /* hand the used buffer back to the reader */
+        p->ready[p->cur] = 0;
+        p->cur ^= 1;
+        p->cur_pos = 0;
+        pthread_cond_broadcast(&p->cond);
+    }
+    while (!p->ready[p->cur] && !p->done)
+        pthread_cond_wait(&p->cond, &p->lock);
+    res = p->res;
+    rem = p->ready[p->cur] ? p->sizes[p->cur] - p->cur_pos : 0;
+    pthread_mutex_unlock(&p->lock);
+
+    if (rem == 0 && res != SZ_OK)
+        return res;
+    if (*size > rem)
+        *size = rem;
+    *buf = p->bufs[p->cur] + p->cur_pos;
+    return SZ_OK;
+}
+
+static SRes
+ReadAheadInStream_Skip(const ILookInStream *pp, size_t offset)
+{
+    CReadAheadInStream *p = CONTAINER_FROM_VTBL(pp, CReadAheadInStream, vt);
+
+    /* only what Look returned can be skipped */
+    p->cur_pos += offset;
+    p->pos += offset;
+    return SZ_OK;
+}
+
+static SRes
+ReadAheadInStream_Read(const ILookInStream *pp, void *buf, size_t *size)
+{
+    const void *look;
+
+    RINOK(ReadAheadInStream_Look(pp, &look, size));
+    memcpy(buf, look, *size);
+    return ReadAheadInStream_Skip(pp, *size);
+}
+
+/* The decoders only seek to the start of a pack stream, so seeking
+   forward reads up to the new position, and seeking back fails. */
+static SRes
+ReadAheadInStream_Seek(const ILookInStream *pp, Int64 *pos, ESzSeek origin)
+{
+    CReadAheadInStream *p = CONTAINER_FROM_VTBL(pp, CReadAheadInStream, vt);
+    UInt64 target;
+
+    switch (origin) {
+    case SZ_SEEK_SET: target = (UInt64)*pos; break;
+    case SZ_SEEK_CUR: target = p->pos + *pos; break;
+    case SZ_SEEK_END: target = p->end + *pos; break;
+    default: return SZ_ERROR_PARAM;
+    }
+    if (target < p->pos || target > p->end)
+        return SZ_ERROR_PARAM;
+    while (p->pos < target) {
+        const void *look;
+        size_t size = (size_t)(target - p->pos);
+
+        if (size != target - p->pos)
+            size = p->buf_size;
+        RINOK(ReadAheadInStream_Look(pp, &look, &size));
+        if (size == 0)
+            return SZ_ERROR_INPUT_EOF;
+        ReadAheadInStream_Skip(pp, size);
+    }
+    *pos = (Int64)target;
+    return SZ_OK;
+}
+
+/* Start reading [start, start + size) of 'stream' ahead into buf, which
+   holds two buffers of buf_size bytes each. */
+static SRes
+ReadAheadInStream_Start(CReadAheadInStream *p, CCountingInStream *stream,
+                        Byte *buf, size_t buf_size, UInt64 start,
+                        UInt64 size)
+{
+    p->vt.Look = ReadAheadInStream_Look;
+    p->vt.Skip = ReadAheadInStream_Skip;
+    p->vt.Read = ReadAheadInStream_Read;
+    p->vt.Seek = ReadAheadInStream_Seek;
+    p->stream = stream;
+    p->bufs[0] = buf;
+    p->bufs[1] = buf + buf_size;
+    p->buf_size = buf_size;
+    p->ready[0] = p->ready[1] = 0;
+    p->cur = 0;
+    p->cur_pos = 0;
+    p->pos = start;
+    p->end = start + size;
+    p->done = 0;
+    p->stop = 0;
+    p->res = SZ_OK;
+    if (pthread_mutex_init(&p->lock, NULL) != 0)
+        return SZ_ERROR_THREAD;
+    if (pthread_cond_init(&p->cond, NULL) != 0) {
+        pthread_mutex_destroy(&p->lock);
+        return SZ_ERROR_THREAD;
+    }
+    if (pthread_create(&p->thread, NULL, read_ahead_thread, p) != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        return SZ_ERROR_THREAD;
+    }
+    return SZ_OK;
+}
+
+/* Stop the reader, which may still be reading ahead, and wait for it. */
+static void
+ReadAheadInStream_Stop(CReadAheadInStream *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+}
+#endif
+
+/* Return a new reference to the window of arc if it holds the range
+   [start, start + size), else NULL. */
+static PyObject *
+get_window(Archive7z *arc, UInt64 start, UInt64 size)
+{
+    PyObject *window = arc->window;
+
+    if (window == NULL || start < arc->window_start ||
+        start + size > arc->window_start + PyBytes_GET_SIZE(window))
+        return NULL;
+    Py_INCREF(window);
+    return window;
+}
+
+/* Return the size of the window to read for folder 'fo': its own pack
+   streams and those of the folders after it, as long as they fit in
+   READ_WINDOW_SIZE. */
+static UInt64
+get_window_size(const CSzArEx *db, UInt32 fo)
+{
+    const CSzAr *ar = &db->db;
+    UInt64 start = ar->PackPositions[ar->FoStartPackStreamIndex[fo]];
+    UInt64 end = ar->PackPositions[ar->FoStartPackStreamIndex[fo + 1]];
+    UInt32 next;
+
+    for (next = fo + 1; next < ar->NumFolders; next++) {
+        UInt64 next_end =
+            ar->PackPositions[ar->FoStartPackStreamIndex[next + 1]];
+        if (next_end - start > READ_WINDOW_SIZE)
+            break;
+        end = next_end;
+    }
+    return end - start;
+}
+
+#define FILE_SIZE(db, index) \
+    ((db)->UnpackPositions[(index) + 1] - (db)->UnpackPositions[index])
+
+/* Return true if file 'index' is the only file in its folder, as in
+   non-solid archives. */
+static int
+is_single_file_folder(const CSzArEx *db, UInt32 index)
+{
+    UInt32 folder = db->FileToFolder[index];
+
+    return folder != (UInt32)-1 &&
+           SzAr_GetFolderUnpackSize(&db->db, folder) == FILE_SIZE(db, index);
+}
+
+/* Return true if file 'index' is stored in a folder with no coder but
+   Copy, and set *pos to the archive offset of its bytes. */
+static int
+get_stored_position(const CSzArEx *db, UInt32 index, UInt64 *pos)
+{
+    const CSzAr *ar = &db->db;
+    UInt32 fo = db->FileToFolder[index];
+    CSzFolder folder;
+    CSzData sd;
+
+    if (fo == (UInt32)-1)
+        return 0;
+    sd.Data = ar->CodersData + ar->FoCodersOffsets[fo];
+    sd.Size = ar->FoCodersOffsets[(size_t)fo + 1] - ar->FoCodersOffsets[fo];
+    if (SzGetNextFolderItem(&folder, &sd) != SZ_OK ||
+        folder.NumCoders != 1 || folder.NumPackStreams != 1 ||
+        folder.Coders[0].MethodID != METHOD_COPY)
+        return 0;
+    *pos = db->dataPos + ar->PackPositions[ar->FoStartPackStreamIndex[fo]] +
+           db->UnpackPositions[index] -
+           db->UnpackPositions[db->FolderToFile[fo]];
+    return 1;
+}
+
+/* Point f at a new bytes object for file 'index' to be read into. */
+static int
+alloc_file_bytes(const CSzArEx *db, UInt32 index, extracted_file *f)
+{
+    UInt64 size = FILE_SIZE(db, index);
+
+    if (size > (UInt64)PY_SSIZE_T_MAX) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    f->bytes = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)size);
+    if (f->bytes == NULL)
+        return -1;
+    f->data = PyBytes_AS_STRING(f->bytes);
+    f->size = (size_t)size;
+    return 0;
+}
+
+static SRes
+check_file_crc(const CSzArEx *db, UInt32 index, const extracted_file *f)
+{
+    if (SzBitWithVals_Check(&db->CRCs, index) &&
+        CrcCalc(f->data, f->size) != db->CRCs.Vals[index])
+        return SZ_ERROR_CRC;
+    return SZ_OK;
+}
+
+/* Read the stored file 'index' at archive offset 'pos' into f->data. */
+static SRes
+read_stored_file(const CSzArEx *db, CCountingInStream *stream, UInt32 index,
+                 UInt64 pos, extracted_file *f)
+{
+    RINOK(read_at(stream, pos, f->data, f->size));
+    return check_file_crc(db, index, f);
+}
+
+/* Decode the folder of file 'index', which holds that file alone,
+   straight into f->data. */
+static SRes
+decode_single_file(const CSzArEx *db, ILookInStream *stream, UInt32 index,
+                   extracted_file *f, ISzAllocPtr alloc_tmp)
+{
+    RINOK(SzAr_DecodeFolder(&db->db, db->FileToFolder[index], stream,
+                            db->dataPos, (Byte *)f->data, f->size,
+                            alloc_tmp));
+    return check_file_crc(db, index, f);
+}
+
+/* Load the file properties left in the archive by SzArEx_OpenLazy()
+   into arc->db, if they aren't loaded yet. */
+static int
+load_archive_props(Archive7z *arc, PyObject *archive)
+{
+    ISzAlloc alloc = { SzAlloc, SzFree };
+    ISzAlloc alloc_tmp = { SzAllocTemp, SzFreeTemp };
+    CCountingInStream stream_arc;
+    CLookToRead2 stream_look;
+    CStagedInStream stream_staged;
+    CSzArEx props;
+    SRes res;
+
+    if (!arc->db.LazyProps)
+        return 0;
+    SzArEx_Init(&props);
+    if (arc->view.buf != NULL) {
+        StagedInStream_Init(&stream_staged, arc->view.buf, 0,
+                            (size_t)arc->view.len);
+        res = SzArEx_LoadProps(&arc->db, &stream_staged.vt, &props, &alloc,
+                               &alloc_tmp);
+    }
+    else {
+        if (open_archive_stream(arc, archive, &stream_arc) != SZ_OK) {
+            _PyErr_FormatFromCause(Import7zError, "can't open 7z file: %R",
+                                   archive);
+            return -1;
+        }
+        stream_look.buf = (Byte*)ISzAlloc_Alloc(&alloc, INPUT_BUFSIZE);
+        if (stream_look.buf == NULL) {
+            File_Close(&stream_arc.file);
+            PyErr_NoMemory();
+            return -1;
+        }
+        LookToRead2_CreateVTable(&stream_look, False);
+        stream_look.bufSize = INPUT_BUFSIZE;
+        stream_look.realStream = &stream_arc.vt;
+        LookToRead2_Init(&stream_look);
+        res = SzArEx_LoadProps(&arc->db, &stream_look.vt, &props, &alloc,
+                               &alloc_tmp);
+        ISzAlloc_Free(&alloc, stream_look.buf);
+        File_Close(&stream_arc.file);
+    }
+    if (res != SZ_OK) {
+        PyErr_Format(Import7zError, "can't read 7z file: %R", archive);
+        return -1;
+    }
+    /* a file object may have let another thread load them meanwhile */
+    if (arc->db.LazyProps) {
+        arc->db.Attribs = props.Attribs;
+        arc->db.MTime = props.MTime;
+        arc->db.CTime = props.CTime;
+        arc->db.LazyProps = 0;
+    }
+    else
+        SzArEx_Free(&props, &alloc);
+    return 0;
+}
+
+/* Return the NTFS file time 'ft' as a POSIX timestamp. */
+static PyObject *
+filetime_to_timestamp(const CNtfsFileTime *ft)
+{
+    UInt64 t = ((UInt64)ft->High << 32) | ft->Low;
+
+    /* 100 ns units since 1601-01-01 */
+    return PyFloat_FromDouble(((double)t - 116444736000000000.0) / 1e7);
+}
+
+/*
+   get_file_info(archive, toc_entry) -> (file_size, mtime, ctime, attributes)
+
+   The times are POSIX timestamps, and each of the three is None if the
+   archive doesn't record it for the file.
+*/
+static PyObject *
+get_file_info(PyObject *archive, PyObject *toc_entry)
+{
+    PyObject *datapath, *mtime = NULL, *ctime = NULL, *attrib = NULL;
+    Archive7z *arc;
+    unsigned int index;
+    unsigned long long file_size;
+
+    if (!PyArg_ParseTuple(toc_entry, "OIK", &datapath, &index, &file_size))
+        return NULL;
+    arc = get_archive(archive);
+    if (arc == NULL)
+        return NULL;
+    if (index >= arc->db.NumFiles) {
+        PyErr_SetString(Import7zError, "bad toc entry");
+        return NULL;
+    }
+    if (load_archive_props(arc, archive) < 0)
+        return NULL;
+
+    if (SzBitWithVals_Check(&arc->db.MTime, index))
+        mtime = filetime_to_timestamp(arc->db.MTime.Vals + index);
+    else {
+        Py_INCREF(Py_None);
+        mtime = Py_None;
+    }
+    if (SzBitWithVals_Check(&arc->db.CTime, index))
+        ctime = filetime_to_timestamp(arc->db.CTime.Vals + index);
+    else {
+        Py_INCREF(Py_None);
+        ctime = Py_None;
+    }
+    if (SzBitWithVals_Check(&arc->db.Attribs, index))
+        attrib = PyLong_FromUnsignedLong(arc->db.Attribs.Vals[index]);
+    else {
+        Py_INCREF(Py_None);
+        attrib = Py_None;
+    }
+    if (mtime == NULL || ctime == NULL || attrib == NULL) {
+        Py_XDECREF(mtime);
+        Py_XDECREF(ctime);
+        Py_XDECREF(attrib);
+        return NULL;
+    }
+    return Py_BuildValue("KNNN", SzArEx_GetFileSize(&arc->db, index),
+                         mtime, ctime, attrib);
+}
+
+/* Extract the file of toc_entry from the archive into 'f'. Stored
+   files are read as they are, files that have a folder of their own
+   are decoded into a bytes object, and the others are sliced from
+   the decoded folder. The GIL is released while reading and decoding,
+   so that other threads can extract files of the same archive.
+
+   Small folders are read together with the folders after them into a
+   window kept by the archive, so that the next files of a non-solid
+   archive need no I/O. Larger ones are read ahead by another thread
+   while they are decoded, where threads are available. */
+static int
+extract_file(PyObject *archive, PyObject *toc_entry, extracted_file *f)
+{
+    PyObject *datapath, *capsule;
+    Archive7z *arc;
+    unsigned int index;
+    unsigned long long file_size;
+    UInt32 idx_blk = 0xFFFFFFFF;
+    UInt32 fo;
+    size_t out_length = 0;
+    size_t offset = 0;
+    size_t processed = 0;
+    UInt64 pos = 0, pack_start = 0, pack_size = 0;
+    UInt64 window_start = 0, window_size;
+    UInt32 num_pack_streams = 0;
+    PyObject *window = NULL;
+    Byte *stage = NULL;     /* pack streams in memory, or NULL */
+    UInt64 stage_start = 0;
+    size_t stage_size = 0;
+    int stored, single, need_read = 0, keep_window = 0;
+    SRes res;
+
+    ISzAlloc alloc = { SzAlloc, SzFree };
+    ISzAlloc alloc_tmp = { SzAllocTemp, SzFreeTemp };
+
+    CCountingInStream stream_arc;
+    CLookToRead2 stream_look;
+    CStagedInStream stream_staged;
+#ifdef HAVE_READ_AHEAD
+    CReadAheadInStream stream_ahead;
+    int reading_ahead = 0;
+#endif
+    size_t look_size = INPUT_BUFSIZE;
+    const ILookInStream *in_stream;
+
+    memset(f, 0, sizeof(*f));
+    if (!PyArg_ParseTuple(toc_entry, "OIK", &datapath, &index, &file_size)) {
+        return -1;
+    }
+
+    capsule = get_archive_capsule(archive);
+    if (capsule == NULL)
+        return -1;
+    arc = PyCapsule_GetPointer(capsule, NULL);
+    if (index >= arc->db.NumFiles) {
+        PyErr_SetString(Import7zError, "bad toc entry");
+        return -1;
+    }
+
+    stored = get_stored_position(&arc->db, index, &pos);
+    single = !stored && is_single_file_folder(&arc->db, index);
+    fo = arc->db.FileToFolder[index];
+    if (fo != (UInt32)-1)
+        num_pack_streams = get_pack_range(&arc->db, fo, &pack_start,
+                                          &pack_size);
+    if ((stored || single) && alloc_file_bytes(&arc->db, index, f) < 0)
+        return -1;
+
+    /* In-memory archives are decoded in place. Otherwise, folders found
+       in the window are decoded from it. Small folders are read with
+       their neighbours into a new window, and larger ones with several
+       pack streams (BCJ2) are staged with one read of their own. The
+       others are decoded through a lookahead buffer. */
+    if (fo != (UInt32)-1 && arc->view.buf == NULL) {
+        window = get_window(arc, pack_start, pack_size);
+        if (window != NULL) {
+            window_start = arc->window_start;
+            arc->window_hits++;
+        }
+        else {
+            window_size = pack_size;
+            if (pack_size <= READ_WINDOW_SIZE) {
+                window_size = get_window_size(&arc->db, fo);
+                keep_window = 1;
+            }
+            if (keep_window || num_pack_streams > 1) {
+                if (window_size > (UInt64)PY_SSIZE_T_MAX) {
+                    PyErr_NoMemory();
+                    release_file(f);
+                    return -1;
+                }
+                window = PyBytes_FromStringAndSize(NULL,
+                                                   (Py_ssize_t)window_size);
+                if (window == NULL) {
+                    release_file(f);
+                    return -1;
+                }
+                window_start = pack_start;
+                need_read = 1;
+            }
+        }
+    }
+    if (arc->view.buf != NULL) {
+        stage = arc->view.buf;
+        stage_size = (size_t)arc->view.len;
+    }
+    else if (window != NULL) {
+        stage = (Byte *)PyBytes_AS_STRING(window);
+        stage_start = window_start;
+        stage_size = (size_t)PyBytes_GET_SIZE(window);
+    }
+    stream_look.buf = NULL;
+#ifdef HAVE_READ_AHEAD
+    if (pack_size > INPUT_BUFSIZE) {
+        /* two read-ahead buffers, or one lookahead buffer if no thread */
+        look_size = pack_size < READ_AHEAD_BUFSIZE ?
+                    (size_t)pack_size : READ_AHEAD_BUFSIZE;
+        look_size *= 2;
+    }
+#endif
+    if (!stored && stage == NULL) {
+        stream_look.buf = (Byte*)ISzAlloc_Alloc(&alloc, look_size);
+        if (stream_look.buf == NULL) {
+            PyErr_NoMemory();
+            release_file(f);
+            return -1;
+        }
+    }
+    if (stage == NULL || need_read) {
+        if (open_archive_stream(arc, archive, &stream_arc) != SZ_OK) {
+            _PyErr_FormatFromCause(Import7zError, "can't open 7z file: %R",
+                                   archive);
+            ISzAlloc_Free(&alloc, stream_look.buf);
+            Py_XDECREF(window);
+            release_file(f);
+            return -1;
+        }
+        if (stage != NULL || stream_arc.use_fileobj)
+            ;
+        else if (stored)
+            File_WillNeed(&stream_arc.file, pos, f->size);
+        else if (fo != (UInt32)-1) {
+            File_Sequential(&stream_arc.file, pack_start, pack_size);
+            File_WillNeed(&stream_arc.file, pack_start, pack_size);
+        }
+    }
+
+    /* the capsule keeps arc alive while the GIL is released */
+    Py_INCREF(capsule);
+    Py_BEGIN_ALLOW_THREADS
+    res = SZ_OK;
+    if (stage != NULL) {
+        StagedInStream_Init(&stream_staged, stage, stage_start, stage_size);
+        if (need_read)
+            res = read_at(&stream_arc, stage_start, stage, stage_size);
+    }
+    if (res != SZ_OK)
+        ;
+    else if (stored && stage != NULL) {
+        memcpy(f->data, stage + (pos - stage_start), f->size);
+        res = check_file_crc(&arc->db, index, f);
+    }
+    else if (stored)
+        /* no decoder and no lookahead buffer needed */
+        res = read_stored_file(&arc->db, &stream_arc, index, pos, f);
+    else {
+        if (stage != NULL)
+            in_stream = &stream_staged.vt;
+#ifdef HAVE_READ_AHEAD
+        else if (look_size > INPUT_BUFSIZE &&
+                 ReadAheadInStream_Start(&stream_ahead, &stream_arc,
+                                         stream_look.buf, look_size / 2,
+                                         pack_start, pack_size) == SZ_OK) {
+            reading_ahead = 1;
+            in_stream = &stream_ahead.vt;
+        }
+#endif
+        else {
+            LookToRead2_CreateVTable(&stream_look, False);
+            stream_look.bufSize = look_size;
+            stream_look.realStream = &stream_arc.vt;
+            LookToRead2_Init(&stream_look);
+            in_stream = &stream_look.vt;
+        }
+        if (single)
+            res = decode_single_file(&arc->db, (ILookInStream *)in_stream,
+                                     index, f, &alloc_tmp);
+        else
+            res = SzArEx_Extract(&arc->db, (ILookInStream *)in_stream,
+                                 index, &idx_blk, &f->out, &out_length,
+                                 &offset, &processed, &alloc, &alloc_tmp);
+#ifdef HAVE_READ_AHEAD
+        if (reading_ahead)
+            ReadAheadInStream_Stop(&stream_ahead);
+#endif
+    }
+    Py_END_ALLOW_THREADS
+    Py_DECREF(capsule);
+    ISzAlloc_Free(&alloc, stream_look.buf);
+    if (stage == NULL || need_read) {
+        File_Close(&stream_arc.file);
+        arc->read_calls += (Py_ssize_t)stream_arc.read_calls;
+        arc->read_bytes += (Py_ssize_t)stream_arc.read_bytes;
+    }
+    if (fo != (UInt32)-1)
+        arc->folder_reads++;
+    if (keep_window && res == SZ_OK) {
+        Py_XSETREF(arc->window, window);
+        arc->window_start = window_start;
+    }
+    else
+        Py_XDECREF(window);
+    if (res != SZ_OK) {
+        PyErr_SetString(Import7zError, stored ? "can't read stored data" :
+                                                "can't decompress data");
+        release_file(f);
+        return -1;
+    }
+    if (f->bytes != NULL)
+        return 0;
+
+    if (offset + processed < out_length) {
+        f->data = (char *)f->out + offset;
+        f->size = processed;
+        return 0;
+    }
+    /* the last file of the folder has no spare byte after it */
+    f->bytes = PyBytes_FromStringAndSize((const char *)f->out + offset,
+                                         processed);
+    IAlloc_Free(&alloc, f->out);
+    f->out = NULL;
+    if (f->bytes == NULL)
+        return -1;
+    f->data = PyBytes_AS_STRING(f->bytes);
+    f->size = processed;
+    return 0;
+}
+
+/* Given a path to a 7z archive and a toc_entry, return the
+   (uncompressed) data as a new reference. */
+static PyObject *
+get_data(PyObject *archive, PyObject *toc_entry)
+{
+    PyObject *data;
+    extracted_file f;
+
+    if (extract_file(archive, toc_entry, &f) < 0)
+        return NULL;
+    if (f.bytes != NULL) {
+        data = f.bytes;
+        f.bytes = NULL;
+    }
+    else
+        data = PyBytes_FromStringAndSize(f.data, f.size);
+    release_file(&f);
+    return data;
+}
+
+/* ResourceFile7z: a raw binary stream over a file of the archive */
+
+enum { STREAM_COPY, STREAM_LZMA, STREAM_LZMA2 };
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *name;         /* path of the file, as in its toc_entry */
+    PyObject *capsule;      /* Archive7z capsule of the archive */
+    PyThread_type_lock lock;    /* held while the stream is used without
+                                   the GIL */
+    UInt32 index;           /* index of the file */
+    int method;             /* STREAM_* coder of its folder */
+    int closed;
+    int stream_open;        /* stream holds the archive file open */
+    UInt64 size;            /* size of the file */
+    UInt64 pos;             /* position in the file */
+    UInt64 file_start;      /* offset of the file in the folder output */
+    UInt64 decoded;         /* folder output decoded so far */
+    UInt64 pack_start;      /* archive offset of the pack stream */
+    UInt64 pack_size;
+    UInt64 pack_pos;        /* pack stream read so far */
+    CLzma2Dec dec;          /* decoder; LZMA uses dec.decoder */
+    Byte *in_buf;           /* INPUT_BUFSIZE bytes of the pack stream,
+                               then STREAM_SKIP_BUFSIZE for output that
+                               is skipped */
+    size_t in_pos;
+    size_t in_size;
+    CCountingInStream stream;
+    UInt32 crc;             /* CRC of the file up to crc_pos */
+    UInt64 crc_pos;
+} ResourceFile7z;
+
+/* Read the next part of the pack stream into self->in_buf. */
+static SRes
+stream_fill(ResourceFile7z *self, Archive7z *arc)
+{
+    size_t size = INPUT_BUFSIZE;
+
+    if (self->pack_size - self->pack_pos < size)
+        size = (size_t)(self->pack_size - self->pack_pos);
+    if (size == 0)
+        return SZ_ERROR_INPUT_EOF;
+    if (arc->view.buf != NULL)
+        memcpy(self->in_buf, (Byte *)arc->view.buf + self->pack_start +
+                             self->pack_pos, size);
+    else {
+        RINOK(read_at(&self->stream, self->pack_start + self->pack_pos,
+                      self->in_buf, size));
+    }
+    self->pack_pos += size;
+    self->in_pos = 0;
+    self->in_size = size;
+    return SZ_OK;
+}
+
+/* Decode the next 'size' bytes of the folder output into dest, or skip
+   them if dest is NULL. Skipped output goes through a small scratch
+   buffer; the decoder keeps no more than its dictionary. */
+static SRes
+stream_decode(ResourceFile7z *self, Archive7z *arc, Byte *dest, size_t size)
+{
+    if (self->method == STREAM_COPY) {
+        UInt64 pos = self->pack_start + self->decoded;
+
+        if (dest == NULL)
+            ;
+        else if (arc->view.buf != NULL)
+            memcpy(dest, (Byte *)arc->view.buf + pos, size);
+        else {
+            RINOK(read_at(&self->stream, pos, dest, size));
+        }
+        self->decoded += size;
+        return SZ_OK;
+    }
+
+    while (size > 0) {
+        Byte *out = dest != NULL ? dest : self->in_buf + INPUT_BUFSIZE;
+        SizeT out_len = size, in_len;
+        ELzmaStatus status;
+
+        if (dest == NULL && out_len > STREAM_SKIP_BUFSIZE)
+            out_len = STREAM_SKIP_BUFSIZE;
+        /* once the pack stream is exhausted, the decoder is still called
+           with no input, as it may hold output of the last match */
+        if (self->in_pos == self->in_size && self->pack_pos < self->pack_size) {
+            RINOK(stream_fill(self, arc));
+        }
+        in_len = self->in_size - self->in_pos;
+        if (self->method == STREAM_LZMA2) {
+            RINOK(Lzma2Dec_DecodeToBuf(&self->dec, out, &out_len,
+                                       self->in_buf + self->in_pos, &in_len,
+                                       LZMA_FINISH_ANY, &status));
+        }
+        else {
+            RINOK(LzmaDec_DecodeToBuf(&self->dec.decoder, out, &out_len,
+                                      self->in_buf + self->in_pos, &in_len,
+                                      LZMA_FINISH_ANY, &status));
+        }
+        if (out_len == 0 && in_len == 0)
+            /* no progress: the stream ended before the folder did */
+            return SZ_ERROR_DATA;
+        self->in_pos += in_len;
+        self->decoded += out_len;
+        size -= out_len;
+        if (dest != NULL)
+            dest += out_len;
+    }
+    return SZ_OK;
+}
+
+/* Read the 'size' bytes at self->pos into buf, decoding up to them.
+   Going backwards restarts the decoder at the start of the folder.
+   The CRC of the file is checked when it's read through in order. */
+static SRes
+stream_read(ResourceFile7z *self, Archive7z *arc, Byte *buf, size_t size)
+{
+    UInt64 target = self->file_start + self->pos;
+    const CSzArEx *db = &arc->db;
+
+    if (target < self->decoded) {
+        if (self->method == STREAM_LZMA2)
+            Lzma2Dec_Init(&self->dec);
+        else if (self->method == STREAM_LZMA)
+            LzmaDec_Init(&self->dec.decoder);
+        self->decoded = 0;
+        self->pack_pos = 0;
+        self->in_pos = self->in_size = 0;
+    }
+    if (target > self->decoded) {
+        RINOK(stream_decode(self, arc, NULL,
+                            (size_t)(target - self->decoded)));
+    }
+    RINOK(stream_decode(self, arc, buf, size));
+
+    if (self->pos == self->crc_pos) {
+        self->crc = CrcUpdate(self->crc, buf, size);
+        self->crc_pos += size;
+        if (self->crc_pos == self->size &&
+            SzBitWithVals_Check(&db->CRCs, self->index) &&
+            CRC_GET_DIGEST(self->crc) != db->CRCs.Vals[self->index])
+            return SZ_ERROR_CRC;
+    }
+    self->pos += size;
+    return SZ_OK;
+}
+
+/* Release what the stream holds. The caller holds self->lock, or is
+   the only user. */
+static void
+stream_close(ResourceFile7z *self)
+{
+    ISzAlloc alloc = { SzAlloc, SzFree };
+
+    if (self->closed)
+        return;
+    self->closed = 1;
+    Lzma2Dec_Free(&self->dec, &alloc);
+    ISzAlloc_Free(&alloc, self->in_buf);
+    self->in_buf = NULL;
+    if (self->stream_open) {
+        Archive7z *arc = PyCapsule_GetPointer(self->capsule, NULL);
+
+        File_Close(&self->stream.file);
+        arc->read_calls += (Py_ssize_t)self->stream.read_calls;
+        arc->read_bytes += (Py_ssize_t)self->stream.read_bytes;
+        self->stream_open = 0;
+    }
+}
+
+/* Return a ResourceFile7z for the file of 'toc_entry', or NULL without
+   an exception if it's better read at once: it's small, or its folder
+   needs more than one coder. */
+static PyObject *
+open_file_stream(PyObject *archive, PyObject *toc_entry)
+{
+    PyObject *datapath, *capsule;
+    ResourceFile7z *self;
+    Archive7z *arc;
+    const CSzAr *ar;
+    unsigned int index;
+    unsigned long long file_size;
+    UInt32 fo, pi;
+    CSzFolder folder;
+    CSzData sd;
+    const Byte *props;
+    int method;
+    SRes res = SZ_OK;
+    ISzAlloc alloc = { SzAlloc, SzFree };
+
+    if (!PyArg_ParseTuple(toc_entry, "OIK", &datapath, &index, &file_size))
+        return NULL;
+    capsule = get_archive_capsule(archive);
+    if (capsule == NULL)
+        return NULL;
+    arc = PyCapsule_GetPointer(capsule, NULL);
+    ar = &arc->db.db;
+    if (index >= arc->db.NumFiles) {
+        PyErr_SetString(Import7zError, "bad toc entry");
+        return NULL;
+    }
+    fo = arc->db.FileToFolder[index];
+    if (fo == (UInt32)-1 || FILE_SIZE(&arc->db, index) < STREAM_MIN_SIZE)
+        return NULL;
+
+    sd.Data = ar->CodersData + ar->FoCodersOffsets[fo];
+    sd.Size = ar->FoCodersOffsets[(size_t)fo + 1] - ar->FoCodersOffsets[fo];
+    if (SzGetNextFolderItem(&folder, &sd) != SZ_OK ||
+        folder.NumCoders != 1 || folder.NumPackStreams != 1)
+        return NULL;
+    props = ar->CodersData + ar->FoCodersOffsets[fo] +
+            folder.Coders[0].PropsOffset;
+    switch (folder.Coders[0].MethodID) {
+    case METHOD_COPY:
+        method = STREAM_COPY;
+        break;
+    case METHOD_LZMA:
+        method = STREAM_LZMA;
+        break;
+    case METHOD_LZMA2:
+        if (folder.Coders[0].PropsSize != 1)
+            return NULL;
+        method = STREAM_LZMA2;
+        break;
+    default:
+        return NULL;
+    }
+
+    self = PyObject_New(ResourceFile7z, &ResourceFile7z_Type);
+    if (self == NULL)
+        return NULL;
+    Py_INCREF(datapath);
+    self->name = datapath;
+    Py_INCREF(capsule);
+    self->capsule = capsule;
+    self->index = index;
+    self->method = method;
+    self->closed = 0;
+    self->stream_open = 0;
+    self->size = FILE_SIZE(&arc->db, index);
+    self->pos = 0;
+    self->file_start = arc->db.UnpackPositions[index] -
+                       arc->db.UnpackPositions[arc->db.FolderToFile[fo]];
+    self->decoded = 0;
+    pi = ar->FoStartPackStreamIndex[fo];
+    self->pack_start = arc->db.dataPos + ar->PackPositions[pi];
+    self->pack_size = ar->PackPositions[pi + 1] - ar->PackPositions[pi];
+    self->pack_pos = 0;
+    Lzma2Dec_Construct(&self->dec);
+    self->in_buf = NULL;
+    self->in_pos = self->in_size = 0;
+    self->crc = CRC_INIT_VAL;
+    self->crc_pos = 0;
+    self->lock = PyThread_allocate_lock();
+    if (self->lock == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    if (method != STREAM_COPY) {
+        self->in_buf = ISzAlloc_Alloc(&alloc, INPUT_BUFSIZE +
+                                              STREAM_SKIP_BUFSIZE);
+        if (self->in_buf == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        /* the dictionary is all the decoder keeps of the output */
+        if (method == STREAM_LZMA2)
+            res = Lzma2Dec_Allocate(&self->dec, props[0], &alloc);
+        else
+            res = LzmaDec_Allocate(&self->dec.decoder, props,
+                                   folder.Coders[0].PropsSize, &alloc);
+        if (res == SZ_ERROR_MEM) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        if (res != SZ_OK) {
+            PyErr_SetString(Import7zError, "can't decompress data");
+            goto error;
+        }
+        if (method == STREAM_LZMA2)
+            Lzma2Dec_Init(&self->dec);
+        else
+            LzmaDec_Init(&self->dec.decoder);
+    }
+
+    if (arc->view.buf == NULL) {
+        if (open_archive_stream(arc, archive, &self->stream) != SZ_OK) {
+            _PyErr_FormatFromCause(Import7zError, "can't open 7z file: %R",
+                                   archive);
+            goto error;
+        }
+        self->stream_open = 1;
+        if (!self->stream.use_fileobj)
+            File_Sequential(&self->stream.file, self->pack_start,
+                            self->pack_size);
+    }
+    return (PyObject *)self;
+
+error:
+    Py_DECREF(self);
+    return NULL;
+}
+
+static void
+resourcefile7z_dealloc(ResourceFile7z *self)
+{
+    stream_close(self);
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+    Py_XDECREF(self->name);
+    Py_XDECREF(self->capsule);
+    PyObject_Del(self);
+}
+
+/* Take self->lock, releasing the GIL while waiting for it. */
+static void
+stream_lock(ResourceFile7z *self)
+{
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void
+set_closed_error(void)
+{
+    PyErr_SetString(PyExc_ValueError, "I/O operation on closed file.");
+}
+
+/* Read up to 'size' bytes into buf, returning the number read, or -1
+   with an exception set. The position is only looked at under the
+   lock, so that concurrent reads never go past the end of the file. */
+static Py_ssize_t
+resourcefile7z_read_into(ResourceFile7z *self, char *buf, size_t size)
+{
+    Archive7z *arc = PyCapsule_GetPointer(self->capsule, NULL);
+    int closed;
+    SRes res = SZ_OK;
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    closed = self->closed;
+    if (closed || self->pos >= self->size)
+        size = 0;
+    else if (self->size - self->pos < size)
+        size = (size_t)(self->size - self->pos);
+    if (size > 0)
+        res = stream_read(self, arc, (Byte *)buf, size);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+    if (closed) {
+        set_closed_error();
+        return -1;
+    }
+    if (res != SZ_OK) {
+        PyErr_SetString(Import7zError,
+                        self->method == STREAM_COPY ? "can't read stored data" :
+                                                      "can't decompress data");
+        return -1;
+    }
+    return (Py_ssize_t)size;
+}
+
+static PyObject *
+resourcefile7z_readinto(PyObject *obj, PyObject *args)
+{
+    Py_buffer buf;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTuple(args, "w*:readinto", &buf))
+        return NULL;
+    n = resourcefile7z_read_into((ResourceFile7z *)obj, buf.buf,
+                                 (size_t)buf.len);
+    PyBuffer_Release(&buf);
+    if (n < 0)
+        return NULL;
+    return PyLong_FromSsize_t(n);
+}
+
+/* Return how much of the file is left after the position, at most
+   'limit' bytes. */
+static Py_ssize_t
+stream_left(ResourceFile7z *self, Py_ssize_t limit)
+{
+    UInt64 left = 0;
+
+    stream_lock(self);
+    if (!self->closed && self->pos < self->size)
+        left = self->size - self->pos;
+    PyThread_release_lock(self->lock);
+    return left < (UInt64)limit ? (Py_ssize_t)left : limit;
+}
+
+/* Read up to 'size' bytes, or all that is left if size < 0. The buffer
+   is only sized from the position; the read itself is clamped under the
+   lock, and goes on while another thread seeking back leaves more. */
+static PyObject *
+read_bytes(ResourceFile7z *self, Py_ssize_t size)
+{
+    PyObject *data;
+    Py_ssize_t len = 0, alloc, n, more;
+
+    if (size < 0)
+        size = PY_SSIZE_T_MAX;
+    alloc = stream_left(self, size);
+    data = PyBytes_FromStringAndSize(NULL, alloc);
+    if (data == NULL)
+        return NULL;
+    for (;;) {
+        n = resourcefile7z_read_into(self, PyBytes_AS_STRING(data) + len,
+                                     (size_t)(alloc - len));
+        if (n < 0)
+            goto error;
+        len += n;
+        if (len < alloc) {
+            if (n == 0)
+                break;
+            continue;
+        }
+        more = stream_left(self, size - len);
+        if (more == 0)
+            break;
+        alloc += more;
+        if (_PyBytes_Resize(&data, alloc) < 0)
+            return NULL;
+    }
+    if (len < alloc && _PyBytes_Resize(&data, len) < 0)
+        return NULL;
+    return data;
+
+error:
+    Py_DECREF(data);
+    return NULL;
+}
+
+static PyObject *
+resourcefile7z_read(PyObject *obj, PyObject *args)
+{
+    Py_ssize_t size = -1;
+
+    if (!PyArg_ParseTuple(args, "|n:read", &size))
+        return NULL;
+    return read_bytes((ResourceFile7z *)obj, size);
+}
+
+static PyObject *
+resourcefile7z_readall(PyObject *obj, PyObject *unused)
+{
+    return read_bytes((ResourceFile7z *)obj, -1);
+}
+
+static PyObject *
+resourcefile7z_seek(PyObject *obj, PyObject *args)
+{
+    ResourceFile7z *self = (ResourceFile7z *)obj;
+    long long offset;
+    int whence = SEEK_SET;
+
+    if (!PyArg_ParseTuple(args, "L|i:seek", &offset, &whence))
+        return NULL;
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+        PyErr_Format(PyExc_ValueError, "invalid whence (%d)", whence);
+        return NULL;
+    }
+
+    stream_lock(self);
+    if (self->closed) {
+        PyThread_release_lock(self->lock);
+        set_closed_error();
+        return NULL;
+    }
+    if (whence == SEEK_CUR)
+        offset += (long long)self->pos;
+    else if (whence == SEEK_END)
+        offset += (long long)self->size;
+    if (offset < 0) {
+        PyThread_release_lock(self->lock);
+        PyErr_SetString(PyExc_ValueError, "negative seek position");
+        return NULL;
+    }
+    /* nothing is decoded until the next read */
+    self->pos = (UInt64)offset;
+    PyThread_release_lock(self->lock);
+    return PyLong_FromLongLong(offset);
+}
+
+static PyObject *
+resourcefile7z_tell(PyObject *obj, PyObject *unused)
+{
+    ResourceFile7z *self = (ResourceFile7z *)obj;
+    UInt64 pos;
+    int closed;
+
+    stream_lock(self);
+    pos = self->pos;
+    closed = self->closed;
+    PyThread_release_lock(self->lock);
+    if (closed) {
+        set_closed_error();
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(pos);
+}
+
+static PyObject *
+resourcefile7z_close(PyObject *obj, PyObject *unused)
+{
+    ResourceFile7z *self = (ResourceFile7z *)obj;
+
+    stream_lock(self);
+    stream_close(self);
+    PyThread_release_lock(self->lock);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+resourcefile7z_flush(PyObject *obj, PyObject *unused)
+{
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+resourcefile7z_true(PyObject *obj, PyObject *unused)
+{
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+resourcefile7z_false(PyObject *obj, PyObject *unused)
+{
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+resourcefile7z_get_closed(ResourceFile7z *self, void *closure)
+{
+    return PyBool_FromLong(self->closed);
+}
+
+static PyMethodDef resourcefile7z_methods[] = {
+    {"readinto", resourcefile7z_readinto, METH_VARARGS,
+     "readinto(buffer) -> number of bytes read."},
+    {"read", resourcefile7z_read, METH_VARARGS,
+     "read(size=-1) -> bytes."},
+    {"readall", resourcefile7z_readall, METH_NOARGS,
+     "readall() -> bytes."},
+    {"seek", resourcefile7z_seek, METH_VARARGS,
+     "seek(offset, whence=0) -> new position."},
+    {"tell", resourcefile7z_tell, METH_NOARGS,
+     "tell() -> current position."},
+    {"close", resourcefile7z_close, METH_NOARGS,
+     "close() -> None."},
+    {"flush", resourcefile7z_flush, METH_NOARGS,
+     "flush() -> None."},
+    {"readable", resourcefile7z_true, METH_NOARGS,
+     "readable() -> True."},
+    {"seekable", resourcefile7z_true, METH_NOARGS,
+     "seekable() -> True."},
+    {"writable", resourcefile7z_false, METH_NOARGS,
+     "writable() -> False."},
+    {"isatty", resourcefile7z_false, METH_NOARGS,
+     "isatty() -> False."},
+    {NULL,              NULL}   /* sentinel */
+};
+
+static PyMemberDef resourcefile7z_members[] = {
+    {"name",    T_OBJECT, offsetof(ResourceFile7z, name),   READONLY},
+    {NULL}
+};
+
+static PyGetSetDef resourcefile7z_getset[] = {
+    {"closed", (getter)resourcefile7z_get_closed, NULL, NULL},
+    {NULL}
+};
+
+static PyTypeObject ResourceFile7z_Type = {
+    PyVarObject_HEAD_INIT(DEFERRED_ADDRESS(&PyType_Type), 0)
+    "import7z.ResourceFile",
+    sizeof(ResourceFile7z),
+    0,                                          /* tp_itemsize */
+    (destructor)resourcefile7z_dealloc,         /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    PyObject_GenericGetAttr,                    /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Raw binary stream over a file in a 7z archive, decoded as it's read.",
+                                                /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    resourcefile7z_methods,                     /* tp_methods */
+    resourcefile7z_members,                     /* tp_members */
+    resourcefile7z_getset,                      /* tp_getset */
+};
 
-    FileInStream_CreateVTable(&stream_arc);
-    LookToRead2_CreateVTable(&stream_look, False);
+/* Check the source size recorded in a timestamp-based pyc header at
+   'buf' against the source entry 'source'. The timestamps in the
+   archive aren't the ones the pyc was compiled against, but a source
+   edited after compiling usually changed size. Return 1 if the pyc can
+   be used, 0 if it can't, and -1 on error. */
+static int
+check_pyc_source_size(PyObject *pathname, const unsigned char *buf,
+                      PyObject *source)
+{
+    unsigned long long size;
 
-    stream_look.buf = (Byte*)ISzAlloc_Alloc(&alloc, INPUT_BUFSIZE);
-    stream_look.bufSize = INPUT_BUFSIZE;
-    stream_look.realStream = &stream_arc.vt;
-    LookToRead2_Init(&stream_look);
+    if (source == Py_None)
+        return 1;   /* nothing to check against */
+    size = PyLong_AsUnsignedLongLong(PyTuple_GET_ITEM(source, 2));
+    if (size == (unsigned long long)-1 && PyErr_Occurred())
+        return -1;
+    /* the size is stored modulo 2**32 */
+    if (get_uint32(buf) == (unsigned int)(size & 0xFFFFFFFFU))
+        return 1;
+    if (Py_VerboseFlag)
+        PySys_FormatStderr("# %R doesn't match the size of its source\n",
+                           pathname);
+    return 0;
+}
 
-    CSzArEx db;
-    SzArEx_Init(&db);
-    if (SzArEx_Open(&db, &stream_look.vt, &alloc, &alloc_tmp) != SZ_OK) {
-        goto file_error;
+#if PYC_HEADER_SIZE == 16
+/* Check the PEP 552 flags of the pyc header in 'buf'. Hash-based pycs
+   are checked against the source entry 'source' as configured by
+   _imp.check_hash_based_pycs, timestamp-based ones by the size of the
+   source. Return 1 if the pyc can be used, 0 if it can't, and -1 on
+   error. */
+static int
+check_pyc_flags(PyObject *archive, PyObject *pathname,
+                const unsigned char *buf, PyObject *source)
+{
+    PyObject *imp, *mode, *data, *hash;
+    unsigned int flags = get_uint32(buf + 4);
+    int check, rv;
+
+    if (flags == 0)
+        return check_pyc_source_size(pathname, buf + 12, source);
+    /* check_source without the hash bit is invalid (PEP 552) */
+    if ((flags & ~3U) || !(flags & 1)) {
+        if (Py_VerboseFlag)
+            PySys_FormatStderr("# %R has invalid flags\n", pathname);
+        return 0;
     }
+    if (source == Py_None)
+        return 1;   /* nothing to check against */
 
-    if (SzArEx_Extract(&db, &stream_look.vt, index, &idx_blk, &out_ptr,
-                       &out_length, &offset, &processed, &alloc,
-                       &alloc_tmp) != SZ_OK) {
-        PyErr_SetString(Import7zError, "can't decompress data");
-        goto error;
+    imp = PyImport_ImportModule("_imp");
+    if (imp == NULL)
+        return -1;
+    mode = PyObject_GetAttrString(imp, "check_hash_based_pycs");
+    if (mode == NULL) {
+        Py_DECREF(imp);
+        return -1;
+    }
+    if (PyUnicode_CompareWithASCIIString(mode, "never") == 0)
+        check = 0;
+    else if (PyUnicode_CompareWithASCIIString(mode, "always") == 0)
+        check = 1;
+    else
+        check = (flags & 2) != 0;
+    Py_DECREF(mode);
+    if (!check) {
+        Py_DECREF(imp);
+        return 1;
     }
-    data = PyBytes_FromStringAndSize(out_ptr + offset, processed);
-
-    IAlloc_Free(&alloc, out_ptr);
-    SzArEx_Free(&db, &alloc);
-    ISzAlloc_Free(&alloc, stream_look.buf);
-    File_Close(&stream_arc.file);
-
-    return data;
-
-file_error:
-    PyErr_Format(Import7zError, "can't read 7z file: %R", archive);
-    return NULL;
-
-error:
-    SzArEx_Free(&db, &alloc);
-    ISzAlloc_Free(&alloc, stream_look.buf);
-    File_Close(&stream_arc.file);
 
-    return NULL;
+    data = get_data(archive, source);
+    if (data == NULL) {
+        Py_DECREF(imp);
+        return -1;
+    }
+    hash = PyObject_CallMethod(imp, "source_hash", "lO",
+                               PyImport_GetMagicNumber(), data);
+    Py_DECREF(imp);
+    Py_DECREF(data);
+    if (hash == NULL)
+        return -1;
+    rv = PyBytes_Check(hash) && PyBytes_GET_SIZE(hash) == 8 &&
+         memcmp(PyBytes_AS_STRING(hash), buf + 8, 8) == 0;
+    Py_DECREF(hash);
+    if (!rv && Py_VerboseFlag)
+        PySys_FormatStderr("# %R has a stale source hash\n", pathname);
+    return rv;
 }
+#endif
 
 /* Given the contents of a .pyc file in a buffer, unmarshal the data
    and return the code object. Return None if it the magic word doesn't
-   match (we do this instead of raising an exception as we fall back
-   to .py if available and we don't want to mask other errors).
+   match or the pyc is stale (we do this instead of raising an exception
+   as we fall back to .py if available and we don't want to mask other
+   errors). 'source' is the toc_entry of the source, or None.
    Returns a new reference. */
 static PyObject *
-unmarshal_code(PyObject *pathname, PyObject *data, time_t mtime)
+unmarshal_code(PyObject *archive, PyObject *pathname, const char *data,
+               Py_ssize_t size, PyObject *source)
 {
     PyObject *code;
-    unsigned char *buf = (unsigned char *)PyBytes_AsString(data);
-    Py_ssize_t size = PyBytes_Size(data);
+    const unsigned char *buf = (const unsigned char *)data;
 
     if (size < PYC_HEADER_SIZE) {
         PyErr_SetString(Import7zError,
@@ -1082,9 +5522,21 @@ unmarshal_code(PyObject *pathname, PyObject *data, time_t mtime)
         return Py_None;  /* signal caller to try alternative */
     }
 
-    /* XXX the pyc's size field is ignored; timestamp collisions are probably
-       unimportant with zip files. */
-    code = PyMarshal_ReadObjectFromString((char *)buf + PYC_HEADER_SIZE, size - PYC_HEADER_SIZE);
+#if PYC_HEADER_SIZE == 16
+    switch (check_pyc_flags(archive, pathname, buf, source)) {
+#else
+    switch (check_pyc_source_size(pathname, buf + 8, source)) {
+#endif
+    case -1:
+        return NULL;
+    case 0:
+        Py_RETURN_NONE;
+    }
+
+    /* The pyc's timestamp is ignored; the archive doesn't keep the one
+       it was compiled against. */
+    code = PyMarshal_ReadObjectFromString(data + PYC_HEADER_SIZE,
+                                          size - PYC_HEADER_SIZE);
     if (code == NULL) {
         return NULL;
     }
@@ -1098,85 +5550,295 @@ unmarshal_code(PyObject *pathname, PyObject *data, time_t mtime)
     return code;
 }
 
-/* Replace any occurrences of "\r\n?" in the input string with "\n".
-   This converts DOS and Mac line endings to Unix line endings.
+/* Replace any occurrences of "\r\n?" in the source buf[0:size] with
+   "\n". This converts DOS and Mac line endings to Unix line endings.
    Also append a trailing "\n" to be compatible with
    PyParser_SimpleParseFile(). Returns a new reference. */
 static PyObject *
-normalize_line_endings(PyObject *source)
+normalize_line_endings(const char *buf, Py_ssize_t size)
 {
-    char *buf, *q, *p;
     PyObject *fixed_source;
-    int len = 0;
-
-    p = PyBytes_AsString(source);
-    if (p == NULL) {
-        return PyBytes_FromStringAndSize("\n\0", 2);
-    }
+    const char *p, *end = buf + size;
+    char *q;
 
-    /* one char extra for trailing \n and one for terminating \0 */
-    buf = (char *)PyMem_Malloc(PyBytes_Size(source) + 2);
-    if (buf == NULL) {
-        PyErr_SetString(PyExc_MemoryError,
-                        "import7z: no memory to allocate "
-                        "source buffer");
+    /* one char extra for trailing \n */
+    fixed_source = PyBytes_FromStringAndSize(NULL, size + 1);
+    if (fixed_source == NULL)
         return NULL;
-    }
     /* replace "\r\n?" by "\n" */
-    for (q = buf; *p != '\0'; p++) {
+    for (p = buf, q = PyBytes_AS_STRING(fixed_source); p < end; p++) {
         if (*p == '\r') {
             *q++ = '\n';
-            if (*(p + 1) == '\n')
+            if (p + 1 < end && *(p + 1) == '\n')
                 p++;
         }
         else
             *q++ = *p;
-        len++;
     }
     *q++ = '\n';  /* add trailing \n */
-    *q = '\0';
-    fixed_source = PyBytes_FromStringAndSize(buf, len + 2);
-    PyMem_Free(buf);
+    if (_PyBytes_Resize(&fixed_source, q - PyBytes_AS_STRING(fixed_source)) < 0)
+        return NULL;
     return fixed_source;
 }
 
-/* Given a string buffer containing Python source code, compile it
-   and return a code object as a new reference. */
+/* Given a buffer containing Python source code, compile it and return
+   a code object as a new reference. buf[size] must be writable; the
+   source is compiled in place unless its line endings need fixing. */
 static PyObject *
-compile_source(PyObject *pathname, PyObject *source)
+compile_source(PyObject *pathname, char *buf, Py_ssize_t size)
 {
     PyObject *code, *fixed_source;
+    char saved;
 
-    fixed_source = normalize_line_endings(source);
-    if (fixed_source == NULL) {
-        return NULL;
+    if (memchr(buf, '\r', size) != NULL) {
+        fixed_source = normalize_line_endings(buf, size);
+        if (fixed_source == NULL) {
+            return NULL;
+        }
+        code = Py_CompileStringObject(PyBytes_AS_STRING(fixed_source),
+                                      pathname, Py_file_input, NULL, -1);
+        Py_DECREF(fixed_source);
+        return code;
     }
 
-    code = Py_CompileStringObject(PyBytes_AsString(fixed_source),
-                                  pathname, Py_file_input, NULL, -1);
+    saved = buf[size];
+    buf[size] = '\0';
+    code = Py_CompileStringObject(buf, pathname, Py_file_input, NULL, -1);
+    buf[size] = saved;
+    return code;
+}
+
+/* Return the path of the code cache file for the source in toc_entry,
+   or None if it can't be cached because the archive has no CRC for
+   it. The name holds everything the code depends on: the path the
+   code is compiled for, the content CRC and size, the optimization
+   level and the magic of the interpreter. */
+static PyObject *
+get_code_cache_path(PyObject *archive, PyObject *toc_entry)
+{
+    PyObject *modpath;
+    Archive7z *arc;
+    unsigned int index;
+    unsigned long long file_size;
+    uint64_t h;
+
+    if (!PyArg_ParseTuple(toc_entry, "OIK", &modpath, &index, &file_size))
+        return NULL;
+    arc = get_archive(archive);
+    if (arc == NULL)
+        return NULL;
+    if (index >= arc->db.NumFiles ||
+        !SzBitWithVals_Check(&arc->db.CRCs, index))
+        Py_RETURN_NONE;
+
+    if (PyUnicode_READY(modpath) == -1)
+        return NULL;
+    h = name_hash(modpath, 0, PyUnicode_GET_LENGTH(modpath));
+    return PyUnicode_FromFormat("%U%c%08x%08x-%08x-%llu-%d-%08x%s",
+                                cache_dir, SEP,
+                                (unsigned int)(h >> 32), (unsigned int)h,
+                                (unsigned int)arc->db.CRCs.Vals[index],
+                                file_size, Py_OptimizeFlag,
+                                (unsigned int)PyImport_GetMagicNumber(),
+                                CODE_CACHE_SUFFIX);
+}
+
+/* Return the contents of the cache file 'path' as bytes, or None if
+   it can't be read. */
+static PyObject *
+read_cache_file(PyObject *path)
+{
+    PyObject *data;
+    FILE *f;
+    long size;
+
+    f = _Py_fopen_obj(path, "rb");
+    if (f == NULL) {
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+        fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        Py_RETURN_NONE;
+    }
+    data = PyBytes_FromStringAndSize(NULL, size);
+    if (data == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    if (fread(PyBytes_AS_STRING(data), 1, size, f) != (size_t)size) {
+        fclose(f);
+        Py_DECREF(data);
+        Py_RETURN_NONE;
+    }
+    fclose(f);
+    return data;
+}
 
-    Py_DECREF(fixed_source);
+/* Return the code object cached in 'path', or None if there is no
+   valid one. */
+static PyObject *
+load_cached_code(PyObject *path)
+{
+    PyObject *data, *code;
+    const char *buf;
+    Py_ssize_t size;
+
+    data = read_cache_file(path);
+    if (data == NULL || data == Py_None)
+        return data;
+    buf = PyBytes_AS_STRING(data);
+    size = PyBytes_GET_SIZE(data);
+    if (size < 4 || get_uint32((const unsigned char *)buf) !=
+                        (unsigned int)PyImport_GetMagicNumber()) {
+        Py_DECREF(data);
+        Py_RETURN_NONE;
+    }
+    code = PyMarshal_ReadObjectFromString(buf + 4, size - 4);
+    Py_DECREF(data);
+    if (code == NULL || !PyCode_Check(code)) {
+        /* a broken cache file is recompiled */
+        Py_XDECREF(code);
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    }
     return code;
 }
 
+/* Write 'code' to the code cache file 'path', as the interpreter magic
+   followed by the marshalled code. */
+static int
+save_cached_code(PyObject *path, PyObject *code)
+{
+    PyObject *data;
+    char *buf;
+    Py_ssize_t size;
+    unsigned long magic = (unsigned long)PyImport_GetMagicNumber();
+    int rv;
+
+    data = PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION);
+    if (data == NULL)
+        return -1;
+    size = PyBytes_GET_SIZE(data) + 4;
+    buf = PyMem_Malloc(size);
+    if (buf == NULL) {
+        Py_DECREF(data);
+        PyErr_NoMemory();
+        return -1;
+    }
+    buf[0] = (char)(magic & 0xff);
+    buf[1] = (char)((magic >> 8) & 0xff);
+    buf[2] = (char)((magic >> 16) & 0xff);
+    buf[3] = (char)((magic >> 24) & 0xff);
+    memcpy(buf + 4, PyBytes_AS_STRING(data), size - 4);
+    Py_DECREF(data);
+    rv = write_cache_file(path, buf, size);
+    PyMem_Free(buf);
+    return rv;
+}
+
 /* Return the code object for the module named by 'fullname' from the
-   7z archive as a new reference. */
+   7z archive as a new reference. 'source' is the toc_entry of the
+   source of bytecode, or None. Code compiled from source is kept in
+   the code cache, if caching is enabled. */
 static PyObject *
 get_code_from_data(Importer7z *self, int ispackage, int isbytecode,
-                   time_t mtime, PyObject *toc_entry)
+                   PyObject *toc_entry, PyObject *source)
 {
-    PyObject *data, *modpath, *code;
+    PyObject *modpath, *code;
+    PyObject *cache_path = NULL;
+    extracted_file f;
 
-    data = get_data(self->archive, toc_entry);
-    if (data == NULL)
+    if (!isbytecode && cache_dir != NULL) {
+        cache_path = get_code_cache_path(self->archive, toc_entry);
+        if (cache_path == NULL)
+            return NULL;
+        if (cache_path != Py_None) {
+            code = load_cached_code(cache_path);
+            if (code != Py_None) {
+                Py_DECREF(cache_path);
+                return code;
+            }
+            Py_DECREF(code);
+        }
+    }
+
+    if (extract_file(self->archive, toc_entry, &f) < 0) {
+        Py_XDECREF(cache_path);
         return NULL;
+    }
 
+    /* the code is read straight from the extracted file */
     modpath = PyTuple_GetItem(toc_entry, 0);
     if (isbytecode)
-        code = unmarshal_code(modpath, data, mtime);
+        code = unmarshal_code(self->archive, modpath, f.data, f.size,
+                              source);
     else
-        code = compile_source(modpath, data);
-    Py_DECREF(data);
+        code = compile_source(modpath, f.data, f.size);
+    release_file(&f);
+
+    if (code != NULL && cache_path != NULL && cache_path != Py_None) {
+        /* the cache is best effort */
+        if (save_cached_code(cache_path, code) < 0)
+            PyErr_Clear();
+    }
+    Py_XDECREF(cache_path);
+    return code;
+}
+
+/* Get the code object of the module specified by 'fullname' from its
+   resolved module_entry. */
+static PyObject *
+get_entry_code(Importer7z *self, PyObject *fullname, PyObject *entry,
+               int *p_ispackage, PyObject **p_modpath)
+{
+    PyObject *code, *toc_entry, *modpath;
+    int type;
+
+    type = MODULE_ENTRY_TYPE(entry);
+    toc_entry = MODULE_ENTRY_TOC(entry);
+
+    code = get_snapshot_code(self, fullname, &modpath);
+    if (code != NULL) {
+        if (p_ispackage != NULL)
+            *p_ispackage = type & IS_PACKAGE;
+        if (p_modpath != NULL) {
+            *p_modpath = modpath;
+            Py_INCREF(modpath);
+        }
+        Py_INCREF(code);
+        return code;
+    }
+
+    if (Py_VerboseFlag > 1)
+        PySys_FormatStderr("# trying %U\n", PyTuple_GET_ITEM(toc_entry, 0));
+    code = get_code_from_data(self, type & IS_PACKAGE, type & IS_BYTECODE,
+                              toc_entry, MODULE_ENTRY_SOURCE(entry));
+    if (code == Py_None) {
+        /* bad magic number or stale byte code,
+           fall back to the source */
+        Py_DECREF(code);
+        toc_entry = MODULE_ENTRY_SOURCE(entry);
+        if (toc_entry == Py_None) {
+            PyErr_Format(Import7zError, "can't find module %R", fullname);
+            return NULL;
+        }
+        if (Py_VerboseFlag > 1)
+            PySys_FormatStderr("# trying %U\n",
+                               PyTuple_GET_ITEM(toc_entry, 0));
+        code = get_code_from_data(self, type & IS_PACKAGE, 0,
+                                  toc_entry, Py_None);
+    }
+    if (code == NULL)
+        return NULL;
+
+    if (p_ispackage != NULL)
+        *p_ispackage = type & IS_PACKAGE;
+    if (p_modpath != NULL) {
+        *p_modpath = MODULE_ENTRY_PATH(entry);
+        Py_INCREF(*p_modpath);
+    }
     return code;
 }
 
@@ -1186,76 +5848,345 @@ static PyObject *
 get_module_code(Importer7z *self, PyObject *fullname,
                 int *p_ispackage, PyObject **p_modpath)
 {
-    PyObject *code = NULL, *toc_entry, *subname;
-    PyObject *path, *fullpath = NULL;
-    struct st_7z_searchorder *zso;
+    PyObject *entry;
 
-    subname = get_subname(fullname);
-    if (subname == NULL)
+    entry = find_module_entry(self, fullname);
+    if (entry == NULL || MODULE_ENTRY_TOC(entry) == Py_None) {
+        if (!PyErr_Occurred())
+            PyErr_Format(Import7zError, "can't find module %R", fullname);
         return NULL;
+    }
+    return get_entry_code(self, fullname, entry, p_ispackage, p_modpath);
+}
 
-    path = make_filename(self->prefix, subname);
-    Py_DECREF(subname);
+
+/* Code snapshots */
+
+/* Layout of a snapshot: a snapshot_header, then a marshalled dict
+   {fullname: (__file__, code)}. Like the index sidecar it's in native
+   byte order, and only valid for the archive it was made from. */
+typedef struct {
+    char magic[8];
+    UInt32 pyc_magic;       /* PyImport_GetMagicNumber() */
+    Int32 optimize;         /* Py_OptimizeFlag */
+    archive_fingerprint fingerprint;
+} snapshot_header;
+
+/* Return the path of the snapshot of archive. */
+static PyObject *
+get_snapshot_path(PyObject *archive)
+{
+    return PyUnicode_FromFormat("%U%s", archive, SNAPSHOT_SUFFIX);
+}
+
+/* Fill 'fp' with the fingerprint of archive. */
+static int
+get_archive_fingerprint(PyObject *archive, archive_fingerprint *fp)
+{
+    CFileInStream stream_arc;
+    int rv;
+
+    if (open_7z_archive(&stream_arc.file, archive) != SZ_OK)
+        return -1;
+    rv = get_fingerprint(archive, &stream_arc, fp);
+    File_Close(&stream_arc.file);
+    return rv;
+}
+
+/* Fill 'h' with the header of a snapshot of archive. */
+static int
+make_snapshot_header(PyObject *archive, snapshot_header *h)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->pyc_magic = (UInt32)PyImport_GetMagicNumber();
+    h->optimize = Py_OptimizeFlag;
+    return get_archive_fingerprint(archive, &h->fingerprint);
+}
+
+/* Return the code dict of the snapshot of archive, or None if there is
+   no snapshot valid for the archive and this interpreter. The archive
+   is only fingerprinted when there is a snapshot to check. */
+static PyObject *
+load_snapshot(PyObject *archive)
+{
+    PyObject *path, *data, *codes;
+    snapshot_header h;
+
+    path = get_snapshot_path(archive);
     if (path == NULL)
         return NULL;
+    data = read_cache_file(path);
+    Py_DECREF(path);
+    if (data == NULL || data == Py_None)
+        return data;
+    if (PyBytes_GET_SIZE(data) < (Py_ssize_t)sizeof(h) ||
+        make_snapshot_header(archive, &h) < 0 ||
+        memcmp(PyBytes_AS_STRING(data), &h, sizeof(h)) != 0) {
+        Py_DECREF(data);
+        Py_RETURN_NONE;
+    }
+    codes = PyMarshal_ReadObjectFromString(
+        PyBytes_AS_STRING(data) + sizeof(h),
+        PyBytes_GET_SIZE(data) - sizeof(h));
+    Py_DECREF(data);
+    if (codes == NULL || !PyDict_Check(codes)) {
+        /* a broken snapshot is ignored */
+        Py_XDECREF(codes);
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    }
+    return codes;
+}
 
-    for (zso = searchorder_7z; *zso->suffix; zso++) {
-        code = NULL;
+/* Return the snapshot code of the module 'fullname' and its __file__
+   as borrowed references, or NULL if it isn't in the snapshot. */
+static PyObject *
+get_snapshot_code(Importer7z *self, PyObject *fullname, PyObject **p_modpath)
+{
+    PyObject *item;
 
-        fullpath = PyUnicode_FromFormat("%U%s", path, zso->suffix);
-        if (fullpath == NULL)
-            goto exit;
+    if (self->snapshot == NULL)
+        return NULL;
+    item = PyDict_GetItem(self->snapshot, fullname);
+    if (item == NULL || !PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2 ||
+        !PyCode_Check(PyTuple_GET_ITEM(item, 1)))
+        return NULL;
+    *p_modpath = PyTuple_GET_ITEM(item, 0);
+    return PyTuple_GET_ITEM(item, 1);
+}
 
-        if (Py_VerboseFlag > 1)
-            PySys_FormatStderr("# trying %U%c%U\n",
-                               self->archive, (int)SEP, fullpath);
-        toc_entry = PyDict_GetItem(self->files, fullpath);
-        if (toc_entry != NULL) {
-            time_t mtime = 0;
-            int ispackage = zso->type & IS_PACKAGE;
-            int isbytecode = zso->type & IS_BYTECODE;
-            mtime = (time_t)-1;
-
-            Py_CLEAR(fullpath);
-            if (p_ispackage != NULL)
-                *p_ispackage = ispackage;
-            code = get_code_from_data(self, ispackage,
-                                      isbytecode, mtime,
-                                      toc_entry);
-            if (code == Py_None) {
-                /* bad magic number or non-matching mtime
-                   in byte code, try next */
-                Py_DECREF(code);
-                continue;
-            }
-            if (code != NULL && p_modpath != NULL) {
-                *p_modpath = PyTuple_GetItem(toc_entry, 0);
-                Py_INCREF(*p_modpath);
-            }
-            goto exit;
+
+/* Module functions */
+
+/* Return the default user cache directory for import7z. */
+static PyObject *
+get_default_cache_dir(void)
+{
+#ifdef MS_WINDOWS
+    const char *base = getenv("LOCALAPPDATA");
+    if (base != NULL && *base)
+        return PyUnicode_FromFormat("%s%cimport7z", base, SEP);
+#else
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (base != NULL && *base)
+        return PyUnicode_FromFormat("%s%cimport7z", base, SEP);
+    base = getenv("HOME");
+    if (base != NULL && *base)
+        return PyUnicode_FromFormat("%s%c.cache%cimport7z", base, SEP, SEP);
+#endif
+    PyErr_SetString(Import7zError, "can't find the user cache directory");
+    return NULL;
+}
+
+static PyObject *
+import7z_enable_cache(PyObject *module, PyObject *args)
+{
+    PyObject *directory = Py_None;
+
+    if (!PyArg_ParseTuple(args, "|O:enable_cache", &directory))
+        return NULL;
+    if (directory == Py_None)
+        directory = get_default_cache_dir();
+    else if (!PyUnicode_FSDecoder(directory, &directory))
+        return NULL;
+    if (directory == NULL)
+        return NULL;
+    Py_XSETREF(cache_dir, directory);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+import7z_disable_cache(PyObject *module, PyObject *unused)
+{
+    Py_CLEAR(cache_dir);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+import7z_snapshot(PyObject *module, PyObject *args)
+{
+    PyObject *archive, *modules, *out = NULL;
+    PyObject *importer, *codes = NULL, *iter = NULL, *name, *data = NULL;
+    snapshot_header h;
+    char *buf;
+    Py_ssize_t size;
+    int rv;
+
+    if (!PyArg_ParseTuple(args, "O&O:snapshot", PyUnicode_FSDecoder,
+                          &archive, &modules))
+        return NULL;
+    importer = PyObject_CallFunctionObjArgs((PyObject *)&Importer7z_Type,
+                                            archive, NULL);
+    Py_DECREF(archive);
+    if (importer == NULL)
+        goto error;
+    archive = ((Importer7z *)importer)->archive;
+    out = get_snapshot_path(archive);
+    if (out == NULL)
+        goto error;
+
+    codes = PyDict_New();
+    if (codes == NULL)
+        goto error;
+    iter = PyObject_GetIter(modules);
+    if (iter == NULL)
+        goto error;
+    while ((name = PyIter_Next(iter)) != NULL) {
+        PyObject *code, *modpath, *item;
+
+        if (!PyUnicode_Check(name)) {
+            PyErr_Format(PyExc_TypeError,
+                         "module names must be str, not %.200s",
+                         Py_TYPE(name)->tp_name);
+            Py_DECREF(name);
+            goto error;
         }
-        else
-            Py_CLEAR(fullpath);
+        code = get_module_code((Importer7z *)importer, name, NULL, &modpath);
+        if (code == NULL) {
+            Py_DECREF(name);
+            goto error;
+        }
+        item = PyTuple_Pack(2, modpath, code);
+        Py_DECREF(code);
+        Py_DECREF(modpath);
+        rv = item == NULL ? -1 : PyDict_SetItem(codes, name, item);
+        Py_XDECREF(item);
+        Py_DECREF(name);
+        if (rv != 0)
+            goto error;
     }
-    PyErr_Format(Import7zError, "can't find module %R", fullname);
-exit:
-    Py_DECREF(path);
-    Py_XDECREF(fullpath);
-    return code;
+    if (PyErr_Occurred())
+        goto error;
+
+    if (make_snapshot_header(archive, &h) < 0) {
+        PyErr_Format(Import7zError, "can't read 7z file: %R", archive);
+        goto error;
+    }
+    data = PyMarshal_WriteObjectToString(codes, Py_MARSHAL_VERSION);
+    if (data == NULL)
+        goto error;
+    size = sizeof(h) + PyBytes_GET_SIZE(data);
+    buf = PyMem_Malloc(size);
+    if (buf == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data));
+    rv = write_cache_file(out, buf, size);
+    PyMem_Free(buf);
+    if (rv < 0)
+        goto error;
+    /* let the next importer of the archive pick it up */
+    if (PyDict_DelItem(snapshot_cache, archive) != 0)
+        PyErr_Clear();
+
+    Py_DECREF(importer);
+    Py_DECREF(codes);
+    Py_DECREF(iter);
+    Py_DECREF(data);
+    Py_DECREF(out);
+    Py_RETURN_NONE;
+
+error:
+    Py_XDECREF(importer);
+    Py_XDECREF(codes);
+    Py_XDECREF(iter);
+    Py_XDECREF(data);
+    Py_XDECREF(out);
+    return NULL;
 }
 
+PyDoc_STRVAR(doc_enable_cache,
+"enable_cache(directory=None) -> None.\n\
+\n\
+Keep index sidecars of the archives read from now on, and the code\n\
+compiled from their sources, in 'directory', or in the user cache\n\
+directory if it's None, so that later processes don't need to parse\n\
+the archive headers or compile the sources again. Caching is enabled at\n\
+import time if the " CACHE_DIR_ENV " environment variable is set.");
+
+PyDoc_STRVAR(doc_disable_cache,
+"disable_cache() -> None.\n\
+\n\
+Stop using the on-disk caches.");
+
+PyDoc_STRVAR(doc_snapshot,
+"snapshot(archive, modules) -> None.\n\
+\n\
+Compile the modules named in 'modules' from the 7z archive and write\n\
+their code to a single snapshot file, the archive path followed by\n\
+" SNAPSHOT_SUFFIX ". Importers of the archive load the snapshot found\n\
+there once and serve the code of its modules from it, as long as the\n\
+archive is unchanged since the snapshot was made and the interpreter\n\
+is the same.");
+
+static PyMethodDef import7z_functions[] = {
+    {"enable_cache", import7z_enable_cache, METH_VARARGS,
+     doc_enable_cache},
+    {"disable_cache", import7z_disable_cache, METH_NOARGS,
+     doc_disable_cache},
+    {"snapshot", import7z_snapshot, METH_VARARGS,
+     doc_snapshot},
+    {NULL,              NULL}   /* sentinel */
+};
+
 
 /* Module init */
 
+/* Fill in the __pycache__ entries of searchorder_7z and correct the
+   directory separator. */
+static int
+init_searchorder(void)
+{
+    PyObject *impl, *tag;
+    const char *tag_str;
+    char opt[16] = "";
+
+    searchorder_7z[1].suffix[0] = SEP;
+    searchorder_7z[2].suffix[0] = SEP;
+
+    impl = PySys_GetObject("implementation");
+    if (impl == NULL)
+        return 0;
+    tag = PyObject_GetAttrString(impl, "cache_tag");
+    if (tag == NULL)
+        return -1;
+    if (tag == Py_None) {
+        /* the implementation doesn't cache bytecode */
+        Py_DECREF(tag);
+        return 0;
+    }
+    tag_str = PyUnicode_AsUTF8(tag);
+    if (tag_str == NULL) {
+        Py_DECREF(tag);
+        return -1;
+    }
+    if (Py_OptimizeFlag)
+        PyOS_snprintf(opt, sizeof(opt), ".opt-%d", Py_OptimizeFlag);
+    PyOS_snprintf(searchorder_7z[0].suffix, sizeof(searchorder_7z[0].suffix),
+                  "%c%s%c__init__.%s%s.pyc", SEP, PYCACHE, SEP, tag_str, opt);
+    PyOS_snprintf(searchorder_7z[3].suffix, sizeof(searchorder_7z[3].suffix),
+                  ".%s%s.pyc", tag_str, opt);
+    Py_DECREF(tag);
+    return 0;
+}
+
 PyDoc_STRVAR(import7z_doc,
 "import7z provides support for importing Python modules from 7z archives.\n\
 \n\
-This module exports three objects:\n\
+This module exports these objects:\n\
 - importer7z: a class; its constructor takes a path to a 7z archive.\n\
+- finder7z: a class of sys.meta_path finders over several archives.\n\
 - Import7zError: exception raised by importer7z objects. It's a\n\
   subclass of ImportError, so it can be caught as ImportError, too.\n\
 - _directory_cache: a dict, mapping archive paths to zip directory\n\
   info dicts, as used in importer7z._files.\n\
+- enable_cache(), disable_cache(): functions to control the on-disk\n\
+  caches that speed up the start of later processes.\n\
+- snapshot(): a function writing the code of a set of modules to one\n\
+  file, to be served from there by importers of the archive.\n\
 \n\
 It is usually not needed to use the import7z module explicitly; it is\n\
 used by the builtin import mechanism for sys.path items that are paths\n\
@@ -1266,7 +6197,7 @@ static struct PyModuleDef import7zmodule = {
     "import7z",
     import7z_doc,
     -1,
-    NULL,
+    import7z_functions,
     NULL,
     NULL,
     NULL,
@@ -1280,10 +6211,15 @@ PyInit_import7z(void)
 
     if (PyType_Ready(&Importer7z_Type) < 0)
         return NULL;
+    if (PyType_Ready(&ResourceReader7z_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&Finder7z_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&ResourceFile7z_Type) < 0)
+        return NULL;
 
-    /* Correct directory separator */
-    searchorder_7z[0].suffix[0] = SEP;
-    searchorder_7z[1].suffix[0] = SEP;
+    if (init_searchorder() < 0)
+        return NULL;
 
     CrcGenerateTable();
 
@@ -1306,6 +6242,11 @@ PyInit_import7z(void)
                            (PyObject *)&Importer7z_Type) < 0)
         return NULL;
 
+    Py_INCREF(&Finder7z_Type);
+    if (PyModule_AddObject(mod, "finder7z",
+                           (PyObject *)&Finder7z_Type) < 0)
+        return NULL;
+
     directory_cache = PyDict_New();
     if (directory_cache == NULL)
         return NULL;
@@ -1313,5 +6254,30 @@ PyInit_import7z(void)
     if (PyModule_AddObject(mod, "_directory_cache",
                            directory_cache) < 0)
         return NULL;
+
+    module_cache = PyDict_New();
+    if (module_cache == NULL)
+        return NULL;
+    archive_cache = PyDict_New();
+    if (archive_cache == NULL)
+        return NULL;
+    children_cache = PyDict_New();
+    if (children_cache == NULL)
+        return NULL;
+    snapshot_cache = PyDict_New();
+    if (snapshot_cache == NULL)
+        return NULL;
+    virtual_archives = PyDict_New();
+    if (virtual_archives == NULL)
+        return NULL;
+
+    {
+        const char *env = getenv(CACHE_DIR_ENV);
+        if (env != NULL && *env) {
+            cache_dir = PyUnicode_DecodeFSDefault(env);
+            if (cache_dir == NULL)
+                return NULL;
+        }
+    }
     return mod;
 }
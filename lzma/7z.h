@@ -100,6 +100,14 @@ SRes SzAr_DecodeFolder(const CSzAr *p, UInt32 folderIndex,
     Byte *outBuffer, size_t outSize,
     ISzAllocPtr allocMain);
 
+/* where the data of a property is in the decoded header; Size is 0 if
+   the archive has no such property */
+typedef struct
+{
+  UInt64 Offset;
+  UInt64 Size;
+} CSzPropRef;
+
 typedef struct
 {
   CSzAr db;
@@ -124,6 +132,13 @@ typedef struct
 
   size_t *FileNameOffsets; /* in 2-byte steps */
   Byte *FileNames;  /* UTF-16-LE */
+
+  /* set by SzArEx_OpenLazy(): Attribs, MTime and CTime are left empty,
+     and the places of their data are kept for SzArEx_LoadProps() */
+  Byte LazyProps;
+  CSzPropRef AttribsRef;
+  CSzPropRef MTimeRef;
+  CSzPropRef CTimeRef;
 } CSzArEx;
 
 #define SzArEx_IsDir(p, i) (SzBitArray_Check((p)->IsDirs, i))
@@ -197,6 +212,22 @@ SZ_ERROR_FAIL
 SRes SzArEx_Open(CSzArEx *p, ILookInStream *inStream,
     ISzAllocPtr allocMain, ISzAllocPtr allocTemp);
 
+/*
+SzArEx_OpenLazy() is SzArEx_Open() that, if lazyProps is set, skips
+the Attribs, MTime and CTime properties of the files. They are read
+later, if needed, by SzArEx_LoadProps().
+
+SzArEx_LoadProps() reads the header of archive p again and decodes its
+skipped properties into the Attribs, MTime and CTime of props, which
+must have been initialized by SzArEx_Init(). p itself isn't changed.
+*/
+
+SRes SzArEx_OpenLazy(CSzArEx *p, ILookInStream *inStream, int lazyProps,
+    ISzAllocPtr allocMain, ISzAllocPtr allocTemp);
+
+SRes SzArEx_LoadProps(const CSzArEx *p, ILookInStream *inStream,
+    CSzArEx *props, ISzAllocPtr allocMain, ISzAllocPtr allocTemp);
+
 EXTERN_C_END
 
 #endif
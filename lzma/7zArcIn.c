@@ -145,6 +145,11 @@ void SzArEx_Init(CSzArEx *p)
   // SzBitUi32s_Init(&p->Parents);
   SzBitUi64s_Init(&p->MTime);
   SzBitUi64s_Init(&p->CTime);
+
+  p->LazyProps = 0;
+  p->AttribsRef.Offset = p->AttribsRef.Size = 0;
+  p->MTimeRef.Offset = p->MTimeRef.Size = 0;
+  p->CTimeRef.Offset = p->CTimeRef.Size = 0;
 }
 
 void SzArEx_Free(CSzArEx *p, ISzAllocPtr alloc)
@@ -1088,12 +1093,50 @@ static MY_NO_INLINE SRes ReadTime(CSzBitUi64s *p, UInt32 num,
 }
 
 
+static SRes ReadAttribs(CSzBitUi32s *p, UInt32 numFiles, CSzData *sd,
+    const CBuf *tempBufs, UInt32 numTempBufs,
+    ISzAllocPtr alloc)
+{
+  Byte external;
+  CSzData sdSwitch;
+  CSzData *sdPtr;
+  SzBitUi32s_Free(p, alloc);
+  RINOK(ReadBitVector(sd, numFiles, &p->Defs, alloc));
+
+  SZ_READ_BYTE(external);
+  if (external == 0)
+    sdPtr = sd;
+  else
+  {
+    UInt32 index;
+    RINOK(SzReadNumber32(sd, &index));
+    if (index >= numTempBufs)
+      return SZ_ERROR_ARCHIVE;
+    sdSwitch.Data = tempBufs[index].data;
+    sdSwitch.Size = tempBufs[index].size;
+    sdPtr = &sdSwitch;
+  }
+  return ReadUi32s(sdPtr, numFiles, p, alloc);
+}
+
+/* returns 1 if the data of the Attribs or time property in sd is in
+   sd itself, not in an additional stream */
+static int IsInlineProp(const CSzData *sd, UInt32 numFiles)
+{
+  CSzData sd2 = *sd;
+  const Byte *v;
+  return RememberBitVector(&sd2, numFiles, &v) == SZ_OK &&
+      sd2.Size != 0 && sd2.Data[0] == 0;
+}
+
+
 #define NUM_ADDITIONAL_STREAMS_MAX 8
 
 
 static SRes SzReadHeader2(
     CSzArEx *p,   /* allocMain */
     CSzData *sd,
+    const Byte *base, /* start of the decoded header */
     ILookInStream *inStream,
     CBuf *tempBufs, UInt32 *numTempBufs,
     ISzAllocPtr allocMain,
@@ -1180,7 +1223,17 @@ static SRes SzReadHeader2(
     if (size > sd->Size)
       return SZ_ERROR_ARCHIVE;
     
-    if (type >= ((UInt32)1 << 8))
+    if (p->LazyProps &&
+        (type == k7zIdWinAttrib || type == k7zIdMTime || type == k7zIdCTime) &&
+        IsInlineProp(sd, numFiles))
+    {
+      CSzPropRef *ref = (type == k7zIdWinAttrib ? &p->AttribsRef :
+          type == k7zIdMTime ? &p->MTimeRef : &p->CTimeRef);
+      ref->Offset = (UInt64)(sd->Data - base);
+      ref->Size = size;
+      SKIP_DATA(sd, size);
+    }
+    else if (type >= ((UInt32)1 << 8))
     {
       SKIP_DATA(sd, size);
     }
@@ -1233,26 +1286,7 @@ static SRes SzReadHeader2(
       }
       case k7zIdWinAttrib:
       {
-        Byte external;
-        CSzData sdSwitch;
-        CSzData *sdPtr;
-        SzBitUi32s_Free(&p->Attribs, allocMain);
-        RINOK(ReadBitVector(sd, numFiles, &p->Attribs.Defs, allocMain));
-
-        SZ_READ_BYTE(external);
-        if (external == 0)
-          sdPtr = sd;
-        else
-        {
-          UInt32 index;
-          RINOK(SzReadNumber32(sd, &index));
-          if (index >= *numTempBufs)
-            return SZ_ERROR_ARCHIVE;
-          sdSwitch.Data = (tempBufs)[index].data;
-          sdSwitch.Size = (tempBufs)[index].size;
-          sdPtr = &sdSwitch;
-        }
-        RINOK(ReadUi32s(sdPtr, numFiles, &p->Attribs, allocMain));
+        RINOK(ReadAttribs(&p->Attribs, numFiles, sd, tempBufs, *numTempBufs, allocMain));
         break;
       }
       /*
@@ -1471,6 +1505,7 @@ static SRes SzReadHeader2(
 static SRes SzReadHeader(
     CSzArEx *p,
     CSzData *sd,
+    const Byte *base,
     ILookInStream *inStream,
     ISzAllocPtr allocMain,
     ISzAllocPtr allocTemp)
@@ -1483,7 +1518,7 @@ static SRes SzReadHeader(
   for (i = 0; i < NUM_ADDITIONAL_STREAMS_MAX; i++)
     Buf_Init(tempBufs + i);
   
-  res = SzReadHeader2(p, sd, inStream,
+  res = SzReadHeader2(p, sd, base, inStream,
       tempBufs, &numTempBufs,
       allocMain, allocTemp);
   
@@ -1498,10 +1533,13 @@ static SRes SzReadHeader(
   return res;
 }
 
-static SRes SzArEx_Open2(
-    CSzArEx *p,
+/* reads the header of the archive at the current position of inStream
+   into buf, decoding it if it's packed, and sets *startPosAfterHeader.
+   buf is left empty for archives without a header. */
+static SRes SzReadHeaderBuf(
+    UInt64 *startPosAfterHeader,
     ILookInStream *inStream,
-    ISzAllocPtr allocMain,
+    CBuf *buf,
     ISzAllocPtr allocTemp)
 {
   Byte header[k7zStartHeaderSize];
@@ -1509,9 +1547,9 @@ static SRes SzArEx_Open2(
   UInt64 nextHeaderOffset, nextHeaderSize;
   size_t nextHeaderSizeT;
   UInt32 nextHeaderCRC;
-  CBuf buf;
   SRes res;
 
+  Buf_Init(buf);
   startArcPos = 0;
   RINOK(ILookInStream_Seek(inStream, &startArcPos, SZ_SEEK_CUR));
 
@@ -1526,7 +1564,7 @@ static SRes SzArEx_Open2(
   nextHeaderSize = GetUi64(header + 20);
   nextHeaderCRC = GetUi32(header + 28);
 
-  p->startPosAfterHeader = startArcPos + k7zStartHeaderSize;
+  *startPosAfterHeader = startArcPos + k7zStartHeaderSize;
   
   if (CrcCalc(header + 12, 20) != GetUi32(header + 8))
     return SZ_ERROR_CRC;
@@ -1551,20 +1589,20 @@ static SRes SzArEx_Open2(
 
   RINOK(LookInStream_SeekTo(inStream, startArcPos + k7zStartHeaderSize + nextHeaderOffset));
 
-  if (!Buf_Create(&buf, nextHeaderSizeT, allocTemp))
+  if (!Buf_Create(buf, nextHeaderSizeT, allocTemp))
     return SZ_ERROR_MEM;
 
-  res = LookInStream_Read(inStream, buf.data, nextHeaderSizeT);
+  res = LookInStream_Read(inStream, buf->data, nextHeaderSizeT);
   
   if (res == SZ_OK)
   {
     res = SZ_ERROR_ARCHIVE;
-    if (CrcCalc(buf.data, nextHeaderSizeT) == nextHeaderCRC)
+    if (CrcCalc(buf->data, nextHeaderSizeT) == nextHeaderCRC)
     {
       CSzData sd;
       UInt64 type;
-      sd.Data = buf.data;
-      sd.Size = buf.size;
+      sd.Data = buf->data;
+      sd.Size = buf->size;
       
       res = ReadID(&sd, &type);
       
@@ -1575,7 +1613,7 @@ static SRes SzArEx_Open2(
         Buf_Init(&tempBuf);
         
         SzAr_Init(&tempAr);
-        res = SzReadAndDecodePackedStreams(inStream, &sd, &tempBuf, 1, p->startPosAfterHeader, &tempAr, allocTemp);
+        res = SzReadAndDecodePackedStreams(inStream, &sd, &tempBuf, 1, *startPosAfterHeader, &tempAr, allocTemp);
         SzAr_Free(&tempAr, allocTemp);
        
         if (res != SZ_OK)
@@ -1584,38 +1622,46 @@ static SRes SzArEx_Open2(
         }
         else
         {
-          Buf_Free(&buf, allocTemp);
-          buf.data = tempBuf.data;
-          buf.size = tempBuf.size;
-          sd.Data = buf.data;
-          sd.Size = buf.size;
-          res = ReadID(&sd, &type);
-        }
-      }
-  
-      if (res == SZ_OK)
-      {
-        if (type == k7zIdHeader)
-        {
-          /*
-          CSzData sd2;
-          unsigned ttt;
-          for (ttt = 0; ttt < 40000; ttt++)
-          {
-            SzArEx_Free(p, allocMain);
-            sd2 = sd;
-            res = SzReadHeader(p, &sd2, inStream, allocMain, allocTemp);
-            if (res != SZ_OK)
-              break;
-          }
-          */
-          res = SzReadHeader(p, &sd, inStream, allocMain, allocTemp);
+          Buf_Free(buf, allocTemp);
+          buf->data = tempBuf.data;
+          buf->size = tempBuf.size;
         }
-        else
-          res = SZ_ERROR_UNSUPPORTED;
       }
     }
   }
+
+  if (res != SZ_OK)
+    Buf_Free(buf, allocTemp);
+  return res;
+}
+
+static SRes SzArEx_Open2(
+    CSzArEx *p,
+    ILookInStream *inStream,
+    ISzAllocPtr allocMain,
+    ISzAllocPtr allocTemp)
+{
+  CBuf buf;
+  SRes res;
+
+  RINOK(SzReadHeaderBuf(&p->startPosAfterHeader, inStream, &buf, allocTemp));
+  if (buf.size == 0)
+    return SZ_OK;
+
+  {
+    CSzData sd;
+    UInt64 type;
+    sd.Data = buf.data;
+    sd.Size = buf.size;
+    res = ReadID(&sd, &type);
+    if (res == SZ_OK)
+    {
+      if (type == k7zIdHeader)
+        res = SzReadHeader(p, &sd, buf.data, inStream, allocMain, allocTemp);
+      else
+        res = SZ_ERROR_UNSUPPORTED;
+    }
+  }
  
   Buf_Free(&buf, allocTemp);
   return res;
@@ -1625,13 +1671,71 @@ static SRes SzArEx_Open2(
 SRes SzArEx_Open(CSzArEx *p, ILookInStream *inStream,
     ISzAllocPtr allocMain, ISzAllocPtr allocTemp)
 {
-  SRes res = SzArEx_Open2(p, inStream, allocMain, allocTemp);
+  return SzArEx_OpenLazy(p, inStream, 0, allocMain, allocTemp);
+}
+
+
+SRes SzArEx_OpenLazy(CSzArEx *p, ILookInStream *inStream, int lazyProps,
+    ISzAllocPtr allocMain, ISzAllocPtr allocTemp)
+{
+  SRes res;
+  p->LazyProps = (Byte)(lazyProps != 0);
+  res = SzArEx_Open2(p, inStream, allocMain, allocTemp);
   if (res != SZ_OK)
     SzArEx_Free(p, allocMain);
   return res;
 }
 
 
+static SRes SzLoadProp(const CBuf *buf, const CSzPropRef *ref, CSzData *sd)
+{
+  if (ref->Offset > buf->size || ref->Size > buf->size - ref->Offset)
+    return SZ_ERROR_ARCHIVE;
+  sd->Data = buf->data + (size_t)ref->Offset;
+  sd->Size = (size_t)ref->Size;
+  return SZ_OK;
+}
+
+SRes SzArEx_LoadProps(const CSzArEx *p, ILookInStream *inStream,
+    CSzArEx *props, ISzAllocPtr allocMain, ISzAllocPtr allocTemp)
+{
+  UInt64 startPosAfterHeader;
+  CBuf buf;
+  CSzData sd;
+  SRes res;
+
+  if (!p->LazyProps)
+    return SZ_OK;
+  RINOK(LookInStream_SeekTo(inStream, p->startPosAfterHeader - k7zStartHeaderSize));
+  RINOK(SzReadHeaderBuf(&startPosAfterHeader, inStream, &buf, allocTemp));
+
+  res = SZ_OK;
+  if (p->AttribsRef.Size != 0)
+  {
+    res = SzLoadProp(&buf, &p->AttribsRef, &sd);
+    if (res == SZ_OK)
+      res = ReadAttribs(&props->Attribs, p->NumFiles, &sd, NULL, 0, allocMain);
+  }
+  if (res == SZ_OK && p->MTimeRef.Size != 0)
+  {
+    res = SzLoadProp(&buf, &p->MTimeRef, &sd);
+    if (res == SZ_OK)
+      res = ReadTime(&props->MTime, p->NumFiles, &sd, NULL, 0, allocMain);
+  }
+  if (res == SZ_OK && p->CTimeRef.Size != 0)
+  {
+    res = SzLoadProp(&buf, &p->CTimeRef, &sd);
+    if (res == SZ_OK)
+      res = ReadTime(&props->CTime, p->NumFiles, &sd, NULL, 0, allocMain);
+  }
+
+  Buf_Free(&buf, allocTemp);
+  if (res != SZ_OK)
+    SzArEx_Free(props, allocMain);
+  return res;
+}
+
+
 SRes SzArEx_Extract(
     const CSzArEx *p,
     ILookInStream *inStream,
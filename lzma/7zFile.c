@@ -5,7 +5,22 @@
 
 #include "7zFile.h"
 
-#ifndef USE_WINDOWS_FILE
+#ifdef USE_POSIX_FILE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* pread() and pwrite() may transfer less than asked; do it in chunks
+   small enough for any ssize_t */
+#define kChunkSizeMax (1 << 30)
+
+#elif !defined(USE_WINDOWS_FILE)
 
 #ifndef UNDER_CE
 #include <errno.h>
@@ -31,6 +46,10 @@ void File_Construct(CSzFile *p)
 {
   #ifdef USE_WINDOWS_FILE
   p->handle = INVALID_HANDLE_VALUE;
+  #elif defined(USE_POSIX_FILE)
+  p->fd = -1;
+  p->owner = 0;
+  p->pos = 0;
   #else
   p->file = NULL;
   #endif
@@ -46,6 +65,12 @@ static WRes File_Open(CSzFile *p, const char *name, int writeMode)
       writeMode ? CREATE_ALWAYS : OPEN_EXISTING,
       FILE_ATTRIBUTE_NORMAL, NULL);
   return (p->handle != INVALID_HANDLE_VALUE) ? 0 : GetLastError();
+  #elif defined(USE_POSIX_FILE)
+  p->fd = open(name, writeMode ? (O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC) :
+      (O_RDONLY | O_CLOEXEC), 0666);
+  p->owner = 1;
+  p->pos = 0;
+  return (p->fd >= 0) ? 0 : errno;
   #else
   p->file = fopen(name, writeMode ? "wb+" : "rb");
   return (p->file != 0) ? 0 :
@@ -84,6 +109,13 @@ WRes File_Close(CSzFile *p)
       return GetLastError();
     p->handle = INVALID_HANDLE_VALUE;
   }
+  #elif defined(USE_POSIX_FILE)
+  if (p->fd >= 0)
+  {
+    if (p->owner && close(p->fd) != 0)
+      return errno;
+    p->fd = -1;
+  }
   #else
   if (p->file != NULL)
   {
@@ -121,6 +153,29 @@ WRes File_Read(CSzFile *p, void *data, size_t *size)
   while (originalSize > 0);
   return 0;
 
+  #elif defined(USE_POSIX_FILE)
+
+  *size = 0;
+  do
+  {
+    size_t curSize = (originalSize > kChunkSizeMax) ? kChunkSizeMax : originalSize;
+    ssize_t processed = pread(p->fd, data, curSize, (off_t)p->pos);
+    if (processed < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (processed == 0)
+      break;
+    data = (void *)((Byte *)data + processed);
+    originalSize -= (size_t)processed;
+    *size += (size_t)processed;
+    p->pos += (size_t)processed;
+  }
+  while (originalSize > 0);
+  return 0;
+
   #else
   
   *size = fread(data, 1, originalSize, p->file);
@@ -156,6 +211,29 @@ WRes File_Write(CSzFile *p, const void *data, size_t *size)
   while (originalSize > 0);
   return 0;
 
+  #elif defined(USE_POSIX_FILE)
+
+  *size = 0;
+  do
+  {
+    size_t curSize = (originalSize > kChunkSizeMax) ? kChunkSizeMax : originalSize;
+    ssize_t processed = pwrite(p->fd, data, curSize, (off_t)p->pos);
+    if (processed < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (processed == 0)
+      break;
+    data = (const void *)((const Byte *)data + processed);
+    originalSize -= (size_t)processed;
+    *size += (size_t)processed;
+    p->pos += (size_t)processed;
+  }
+  while (originalSize > 0);
+  return 0;
+
   #else
 
   *size = fwrite(data, 1, originalSize, p->file);
@@ -191,6 +269,30 @@ WRes File_Seek(CSzFile *p, Int64 *pos, ESzSeek origin)
   *pos = ((Int64)value.HighPart << 32) | value.LowPart;
   return 0;
 
+  #elif defined(USE_POSIX_FILE)
+
+  Int64 base;
+  switch (origin)
+  {
+    case SZ_SEEK_SET: base = 0; break;
+    case SZ_SEEK_CUR: base = (Int64)p->pos; break;
+    case SZ_SEEK_END:
+    {
+      UInt64 length;
+      WRes res = File_GetLength(p, &length);
+      if (res != 0)
+        return res;
+      base = (Int64)length;
+      break;
+    }
+    default: return EINVAL;
+  }
+  if (base + *pos < 0)
+    return EINVAL;
+  p->pos = (UInt64)(base + *pos);
+  *pos = (Int64)p->pos;
+  return 0;
+
   #else
   
   int moveMethod;
@@ -224,6 +326,14 @@ WRes File_GetLength(CSzFile *p, UInt64 *length)
   *length = (((UInt64)sizeHigh) << 32) + sizeLow;
   return 0;
   
+  #elif defined(USE_POSIX_FILE)
+
+  struct stat st;
+  if (fstat(p->fd, &st) != 0)
+    return errno;
+  *length = (UInt64)st.st_size;
+  return 0;
+
   #else
   
   long pos = ftell(p->file);
@@ -235,6 +345,37 @@ WRes File_GetLength(CSzFile *p, UInt64 *length)
   #endif
 }
 
+void File_WillNeed(CSzFile *p, UInt64 pos, UInt64 size)
+{
+  #if defined(USE_POSIX_FILE) && defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(p->fd, (off_t)pos, (off_t)size, POSIX_FADV_WILLNEED);
+  #else
+  UNUSED_VAR(p);
+  UNUSED_VAR(pos);
+  UNUSED_VAR(size);
+  #endif
+}
+
+void File_Sequential(CSzFile *p, UInt64 pos, UInt64 size)
+{
+  #if defined(USE_POSIX_FILE) && defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(p->fd, (off_t)pos, (off_t)size, POSIX_FADV_SEQUENTIAL);
+  #else
+  UNUSED_VAR(p);
+  UNUSED_VAR(pos);
+  UNUSED_VAR(size);
+  #endif
+}
+
+#ifdef USE_POSIX_FILE
+void File_Share(CSzFile *p, const CSzFile *src)
+{
+  p->fd = src->fd;
+  p->owner = 0;
+  p->pos = 0;
+}
+#endif
+
 
 /* ---------- FileSeqInStream ---------- */
 
@@ -6,11 +6,13 @@
 
 #ifdef _WIN32
 #define USE_WINDOWS_FILE
+#elif defined(__unix__) || defined(__APPLE__)
+#define USE_POSIX_FILE
 #endif
 
 #ifdef USE_WINDOWS_FILE
 #include <windows.h>
-#else
+#elif !defined(USE_POSIX_FILE)
 #include <stdio.h>
 #endif
 
@@ -24,6 +26,10 @@ typedef struct
 {
   #ifdef USE_WINDOWS_FILE
   HANDLE handle;
+  #elif defined(USE_POSIX_FILE)
+  int fd;
+  int owner;   /* fd is closed by File_Close() */
+  UInt64 pos;  /* offset of this reader; fd has no shared offset in use */
   #else
   FILE *file;
   #endif
@@ -49,6 +55,19 @@ WRes File_Write(CSzFile *p, const void *data, size_t *size);
 WRes File_Seek(CSzFile *p, Int64 *pos, ESzSeek origin);
 WRes File_GetLength(CSzFile *p, UInt64 *length);
 
+/* hints that [pos, pos + size) is going to be read; may do nothing */
+void File_WillNeed(CSzFile *p, UInt64 pos, UInt64 size);
+
+/* hints that [pos, pos + size) is going to be read in order; may do
+   nothing */
+void File_Sequential(CSzFile *p, UInt64 pos, UInt64 size);
+
+#ifdef USE_POSIX_FILE
+/* makes p another reader of the file open in src, with its own offset.
+   p doesn't own the descriptor, src must stay open while p is used. */
+void File_Share(CSzFile *p, const CSzFile *src);
+#endif
+
 
 /* ---------- FileInStream ---------- */
 
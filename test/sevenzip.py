@@ -0,0 +1,199 @@
+"""Minimal 7z archive writer used to build test fixtures."""
+import lzma
+import struct
+import zlib
+
+SIGNATURE = b'7z\xbc\xaf\x27\x1c\x00\x04'
+
+ID_END = 0x00
+ID_HEADER = 0x01
+ID_MAIN_STREAMS_INFO = 0x04
+ID_FILES_INFO = 0x05
+ID_PACK_INFO = 0x06
+ID_UNPACK_INFO = 0x07
+ID_SUBSTREAMS_INFO = 0x08
+ID_SIZE = 0x09
+ID_CRC = 0x0A
+ID_FOLDER = 0x0B
+ID_CODERS_UNPACK_SIZE = 0x0C
+ID_NUM_UNPACK_STREAM = 0x0D
+ID_EMPTY_STREAM = 0x0E
+ID_EMPTY_FILE = 0x0F
+ID_NAME = 0x11
+ID_MTIME = 0x14
+ID_WIN_ATTRIB = 0x15
+
+METHOD_COPY = b'\x00'
+METHOD_LZMA2 = b'\x21'
+METHOD_LZMA = b'\x03\x01\x01'
+METHOD_BCJ2 = b'\x03\x03\x01\x1b'
+LZMA2_DICT_SIZE = 1 << 20
+LZMA2_DICT_PROP = 16  # (2 | (16 & 1)) << (16 // 2 + 11) == 1 MiB
+FILETIME_EPOCH = 116444736000000000  # 1970-01-01 in 100ns ticks since 1601
+
+
+def _number(value):
+    """Encode a 7z variable-length UINT64."""
+    for n in range(8):
+        if value < (1 << (7 * (n + 1))):
+            first = (0xFF00 >> n) & 0xFF
+            high = value >> (8 * n)
+            return bytes([first | high]) + value.to_bytes(8, 'little')[:n]
+    return b'\xff' + value.to_bytes(8, 'little')
+
+
+def _bits(flags):
+    out = bytearray((len(flags) + 7) // 8)
+    for i, flag in enumerate(flags):
+        if flag:
+            out[i >> 3] |= 0x80 >> (i & 7)
+    return bytes(out)
+
+
+def _property(prop_id, data):
+    return bytes([prop_id]) + _number(len(data)) + data
+
+
+def _pack(data, method):
+    if method == 'copy':
+        return data, METHOD_COPY, b''
+    if method == 'lzma':
+        filters = [{'id': lzma.FILTER_LZMA1, 'dict_size': LZMA2_DICT_SIZE,
+                    'lc': 3, 'lp': 0, 'pb': 2}]
+        packed = lzma.compress(data, format=lzma.FORMAT_RAW, filters=filters)
+        props = bytes([(2 * 5 + 0) * 9 + 3]) + struct.pack('<I',
+                                                           LZMA2_DICT_SIZE)
+        return packed, METHOD_LZMA, props
+    filters = [{'id': lzma.FILTER_LZMA2, 'dict_size': LZMA2_DICT_SIZE}]
+    packed = lzma.compress(data, format=lzma.FORMAT_RAW, filters=filters)
+    return packed, METHOD_LZMA2, bytes([LZMA2_DICT_PROP])
+
+
+def _coder(method_id, props):
+    flags = len(method_id) | (0x20 if props else 0)
+    coder = bytes([flags]) + method_id
+    if props:
+        coder += _number(len(props)) + props
+    return coder
+
+
+def _folder(data, method):
+    """Return the coders info, pack streams and unpack sizes of a folder
+    holding 'data'."""
+    if method != 'bcj2':
+        packed, method_id, props = _pack(data, method)
+        return _number(1) + _coder(method_id, props), [packed], [len(data)]
+    # The layout of 7-Zip's BCJ2 folders: jump, call and main streams
+    # going into BCJ2 with its range coder stream, in four pack streams.
+    # There is no x86 encoder here, so data must have no branches for
+    # BCJ2 to convert; the call and jump streams are then empty and
+    # the range coder stream is its 5 byte initial state.
+    assert not any(b in data for b in (b'\xe8', b'\xe9', b'\x0f'))
+    packed, method_id, props = _pack(data, 'lzma2')
+    coders = (_number(4) + _coder(METHOD_COPY, b'') +
+              _coder(METHOD_COPY, b'') + _coder(method_id, props) +
+              bytes([0x10 | len(METHOD_BCJ2)]) + METHOD_BCJ2 +
+              _number(4) + _number(1))
+    for in_index, out_index in ((5, 0), (4, 1), (3, 2)):
+        coders += _number(in_index) + _number(out_index)
+    for in_index in (2, 6, 1, 0):
+        coders += _number(in_index)
+    return coders, [packed, b'\0' * 5, b'', b''], [0, 0, len(data), len(data)]
+
+
+def write_7z(path, entries, method='lzma2', solid=True, prefix=b'',
+             mtime=None, attrib=None):
+    """Write a 7z archive to 'path'.
+
+    'entries' is a list of (name, data) pairs using '/' as separator;
+    data of None makes a directory entry. Files are packed into one
+    folder if 'solid' is true, one folder per file otherwise. 'method'
+    is 'lzma2', 'lzma', 'copy' or 'bcj2', the last one for data with no
+    0xE8, 0xE9 or 0x0F bytes. 'prefix' is prepended to the archive,
+    as for self-extracting executables. 'mtime' (a POSIX timestamp) and
+    'attrib' are recorded for every entry when given."""
+    streams = [(name, data) for name, data in entries if data]
+    if solid and streams:
+        groups = [streams]
+    else:
+        groups = [[item] for item in streams]
+
+    packed_streams = []
+    folders = []
+    for group in groups:
+        coders, packed, sizes = _folder(b''.join(d for _, d in group), method)
+        packed_streams += packed
+        folders.append((coders, sizes, group))
+
+    pack_info = (bytes([ID_PACK_INFO]) + _number(0) +
+                 _number(len(packed_streams)) + bytes([ID_SIZE]) +
+                 b''.join(_number(len(p)) for p in packed_streams) +
+                 bytes([ID_END]))
+
+    unpack_info = bytearray([ID_UNPACK_INFO, ID_FOLDER])
+    unpack_info += _number(len(folders)) + b'\x00'
+    for coders, _, _ in folders:
+        unpack_info += coders
+    unpack_info += bytes([ID_CODERS_UNPACK_SIZE])
+    for _, sizes, _ in folders:
+        for size in sizes:
+            unpack_info += _number(size)
+    unpack_info += bytes([ID_END])
+
+    substreams = bytearray([ID_SUBSTREAMS_INFO, ID_NUM_UNPACK_STREAM])
+    for _, _, group in folders:
+        substreams += _number(len(group))
+    substreams += bytes([ID_SIZE])
+    for _, _, group in folders:
+        for _, data in group[:-1]:
+            substreams += _number(len(data))
+    substreams += bytes([ID_CRC, 1])
+    for _, _, group in folders:
+        for _, data in group:
+            substreams += struct.pack('<I', zlib.crc32(data))
+    substreams += bytes([ID_END])
+
+    if folders:
+        streams_info = (bytes([ID_MAIN_STREAMS_INFO]) + pack_info +
+                        bytes(unpack_info) + bytes(substreams) +
+                        bytes([ID_END]))
+    else:
+        streams_info = b''
+
+    # Files with data come first, in folder order, as the reader expects
+    # substreams to match the order of non-empty files.
+    ordered = [item for _, _, group in folders for item in group]
+    ordered += [(name, data) for name, data in entries if not data]
+    empty_stream = [not data for _, data in ordered]
+    empty_file = [data is not None for _, data in ordered if not data]
+    names = b''.join(name.encode('utf-16-le') + b'\x00\x00'
+                     for name, _ in ordered)
+
+    files_info = bytes([ID_FILES_INFO]) + _number(len(ordered))
+    if any(empty_stream):
+        files_info += _property(ID_EMPTY_STREAM, _bits(empty_stream))
+        if any(empty_file):
+            files_info += _property(ID_EMPTY_FILE, _bits(empty_file))
+    files_info += _property(ID_NAME, b'\x00' + names)
+    if mtime is not None:
+        filetime = int(mtime * 10000000) + FILETIME_EPOCH
+        files_info += _property(ID_MTIME, b'\x01\x00' +
+                                struct.pack('<Q', filetime) * len(ordered))
+    if attrib is not None:
+        files_info += _property(ID_WIN_ATTRIB, b'\x01\x00' +
+                                struct.pack('<I', attrib) * len(ordered))
+    files_info += bytes([ID_END])
+
+    header = (bytes([ID_HEADER]) + streams_info + files_info +
+              bytes([ID_END]))
+
+    packed_data = b''.join(packed_streams)
+    start_header = struct.pack('<QQI', len(packed_data), len(header),
+                               zlib.crc32(header))
+    with open(path, 'wb') as f:
+        f.write(prefix)
+        f.write(SIGNATURE)
+        f.write(struct.pack('<I', zlib.crc32(start_header)))
+        f.write(start_header)
+        f.write(packed_data)
+        f.write(header)
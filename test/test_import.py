@@ -1,7 +1,11 @@
+import importlib.util
+import marshal
 import os
 import sys
+import tempfile
 import unittest
 import import7z
+from .sevenzip import write_7z
 
 
 class Unittest(unittest.TestCase):
@@ -13,6 +17,27 @@ class Unittest(unittest.TestCase):
         sys.path_hooks.insert(0, import7z.importer7z)
         sys.path_importer_cache.clear()
 
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.TemporaryDirectory()
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.tmpdir.cleanup()
+
+    def make_archive(self, name, entries, **kwargs):
+        path7z = os.path.join(self.tmpdir.name, name)
+        write_7z(path7z, entries, **kwargs)
+        return path7z
+
+    def make_importer(self, name, entries, **kwargs):
+        return import7z.importer7z(self.make_archive(name, entries, **kwargs))
+
+    def exec_code(self, importer, fullname):
+        namespace = {}
+        exec(importer.get_code(fullname), namespace)
+        return namespace
+
     def test_import_module(self):
         import module1
         self.assertTrue(module1.imported)
@@ -21,6 +46,772 @@ class Unittest(unittest.TestCase):
         import pak.module2
         self.assertTrue(pak.module2.imported)
 
+    def test_find_spec(self):
+        path7z = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                              'test.7z')
+        importer = import7z.importer7z(path7z)
+        spec = importer.find_spec('pak')
+        self.assertIs(spec.loader, importer)
+        self.assertEqual(spec.origin,
+                         os.path.join(path7z, 'pak', '__init__.py'))
+        self.assertEqual(spec.submodule_search_locations,
+                         [os.path.join(path7z, 'pak')])
+        # the entry found is handed on to exec_module()
+        self.assertEqual(spec.loader_state[1][0], spec.origin)
+        self.assertIsNone(importer.find_spec('not_in_archive'))
+
+        module = importlib.util.module_from_spec(
+            importer.find_spec('module1'))
+        importer.exec_module(module)
+        self.assertTrue(module.imported)
+        self.assertEqual(module.__file__,
+                         os.path.join(path7z, 'module1.py'))
+
+    def test_namespace_portion(self):
+        path7z = self.make_archive('ns.7z', [
+            ('nspak/portion.py', b'imported = True\n'),
+        ])
+        importer = import7z.importer7z(path7z)
+        loader, portions = importer.find_loader('nspak')
+        self.assertIsNone(loader)
+        self.assertEqual(portions, [os.path.join(path7z, 'nspak')])
+        self.assertIsNone(importer.find_module('nspak'))
+        spec = importer.find_spec('nspak')
+        self.assertIsNone(spec.loader)
+        self.assertEqual(spec.submodule_search_locations, portions)
+        sub = import7z.importer7z(portions[0])
+        self.assertIs(sub.find_module('nspak.portion'), sub)
+
+    def test_negative_lookup_filter(self):
+        importer = self.make_importer('filter.7z', [
+            ('present.py', b'imported = True\n'),
+        ])
+        self.assertIsNone(importer.find_module('not_in_archive'))
+        self.assertIsNone(importer.find_module('xml.dom.not_in_archive'))
+        self.assertIs(importer.find_module('present'), importer)
+        self.assertEqual(importer._filter_rejects, 2)
+        self.assertEqual(importer._lookup_misses, 2)
+        self.assertEqual(importer._lookup_hits, 1)
+
+    def test_bad_magic_falls_back_to_source(self):
+        path7z = self.make_archive('magic.7z', [
+            ('fallback.pyc', b'\0' * 32),
+            ('fallback.py', b'imported = True\n'),
+        ])
+        importer = import7z.importer7z(path7z)
+        self.assertFalse(importer.is_package('fallback'))
+        self.assertEqual(importer.get_code('fallback').co_filename,
+                         os.path.join(path7z, 'fallback.py'))
+        self.assertEqual(importer.get_source('fallback'), 'imported = True\n')
+        # __file__ and the code agree on the source
+        spec = importer.find_spec('fallback')
+        self.assertEqual(spec.origin, os.path.join(path7z, 'fallback.py'))
+        module = importlib.util.module_from_spec(spec)
+        spec.loader.exec_module(module)
+        self.assertEqual(module.__file__,
+                         importer.get_code('fallback').co_filename)
+        self.assertEqual(importer.get_filename('fallback'), module.__file__)
+
+    def test_pycache(self):
+        source = b'value = "source"\n'
+        # timestamp-based pycs record the size of their source
+        fresh = b'\0' * 4 + len(source).to_bytes(4, 'little')
+
+        def pyc(source, flags=0, key=fresh):
+            code = compile(source, 'built.py', 'exec')
+            return (importlib.util.MAGIC_NUMBER + flags.to_bytes(4, 'little')
+                    + key + marshal.dumps(code))
+
+        def cached(path):
+            return importlib.util.cache_from_source(path).replace(os.sep, '/')
+
+        stale = importlib.util.source_hash(b'value = "old"\n')
+        path7z = self.make_archive('pycache.7z', [
+            ('cpkg/__init__.py', source),
+            (cached('cpkg/__init__.py'), pyc('value = "pycache"\n')),
+            ('fresh.py', source),
+            (cached('fresh.py'), pyc('value = "pycache"\n')),
+            ('stale_hash.py', source),
+            (cached('stale_hash.py'), pyc('value = "stale"\n', 3, stale)),
+            ('stale_size.py', source),
+            (cached('stale_size.py'), pyc('value = "stale"\n', 0, b'\0' * 8)),
+            ('bad_flags.py', source),
+            (cached('bad_flags.py'), pyc('value = "invalid"\n', 2,
+                                         importlib.util.source_hash(source))),
+            (cached('orphan.py'), pyc('value = "orphan"\n')),
+        ])
+        importer = import7z.importer7z(path7z)
+        for name, value in [('cpkg', 'pycache'), ('fresh', 'pycache'),
+                            ('stale_hash', 'source'), ('stale_size', 'source'),
+                            ('bad_flags', 'source')]:
+            self.assertEqual(self.exec_code(importer, name)['value'], value)
+        self.assertTrue(importer.is_package('cpkg'))
+        self.assertEqual(importer.get_filename('fresh'),
+                         os.path.join(path7z, 'fresh.py'))
+        # bytecode in __pycache__ is only used along with its source
+        self.assertIsNone(importer.find_spec('orphan'))
+
+    def test_compile_line_endings(self):
+        importer = self.make_importer('crlf.7z', [
+            ('crlf.py', b'a = 1\r\nb = 2\rc = 3'),
+            ('lf.py', b'd = 4\ne = 5'),
+        ])
+        for name, expected in [('crlf', {'a': 1, 'b': 2, 'c': 3}),
+                               ('lf', {'d': 4, 'e': 5})]:
+            namespace = self.exec_code(importer, name)
+            del namespace['__builtins__']
+            self.assertEqual(namespace, expected)
+        # compiling in place leaves the data untouched
+        self.assertEqual(importer.get_data('lf.py'), b'd = 4\ne = 5')
+
+    def test_non_solid(self):
+        importer = self.make_importer('nonsolid.7z', [
+            ('nonsolid.py', b'value = "nonsolid"\n'),
+            ('data.bin', b'\0' * 1000),
+        ], solid=False)
+        self.assertEqual(importer.get_data('data.bin'), b'\0' * 1000)
+        self.assertEqual(self.exec_code(importer, 'nonsolid')['value'],
+                         'nonsolid')
+
+        path7z = self.make_archive('nonsolid_bad.7z', [
+            ('corrupt.py', b'value = "corrupt"\n'),
+        ], solid=False, method='copy')
+        with open(path7z, 'r+b') as f:
+            f.seek(32)
+            f.write(b'#')
+        importer = import7z.importer7z(path7z)
+        self.assertRaises(import7z.Import7zError,
+                          importer.get_data, 'corrupt.py')
+
+    def test_read_stats(self):
+        data = bytes(range(256)) * 64
+        importer = self.make_importer('read_stats.7z', [
+            ('a.bin', data), ('b.bin', b'b' * 100)], solid=False)
+        stats = importer._read_stats
+        self.assertEqual(importer.get_data('a.bin'), data)
+        after = importer._read_stats
+        # one folder, read with a single call, and only its packed bytes
+        self.assertEqual(after['folders'], stats['folders'] + 1)
+        self.assertEqual(after['reads'], stats['reads'] + 1)
+        self.assertGreater(after['bytes'], stats['bytes'])
+        self.assertLess(after['bytes'] - stats['bytes'], len(data))
+
+    def test_multi_stream_folder(self):
+        # BCJ2 folders have four pack streams, which are staged with one
+        # read when the folder is too large for the read window
+        big = os.urandom(3 << 19).translate(
+            bytes.maketrans(b'\xe8\xe9\x0f', b'\x00\x01\x02'))
+        importer = self.make_importer('bcj2.7z', [
+            ('big.bin', big), ('small.txt', b'small')],
+            method='bcj2', solid=False)
+        stats = importer._read_stats
+        self.assertEqual(importer.get_data('big.bin'), big)
+        after = importer._read_stats
+        self.assertEqual(after['folders'], stats['folders'] + 1)
+        self.assertEqual(after['reads'], stats['reads'] + 1)
+        self.assertLess(after['bytes'] - stats['bytes'], len(big) + 1024)
+        self.assertEqual(importer.get_data('small.txt'), b'small')
+
+    def test_read_window(self):
+        entries = [('small%d.py' % i, b'value = %d\n' % i) for i in range(10)]
+        importer = self.make_importer('window.7z', entries, solid=False)
+        self.assertEqual(importer.get_data('small0.py'), b'value = 0\n')
+        stats = importer._read_stats
+        for name, data in entries[1:]:
+            self.assertEqual(importer.get_data(name), data)
+        after = importer._read_stats
+        self.assertEqual(after['cached'], stats['cached'] + 9)
+        self.assertEqual(after['reads'], stats['reads'])
+
+    def test_read_ahead(self):
+        big = os.urandom(1 << 20) + b'tail' * 100000
+        importer = self.make_importer('ahead.7z', [
+            ('big.bin', big), ('after.bin', b'after')], solid=False)
+        stats = importer._read_stats
+        self.assertEqual(importer.get_data('big.bin'), big)
+        # read in buffers sized from the folder, not in 256 KiB steps
+        self.assertEqual(importer._read_stats['reads'] - stats['reads'], 2)
+        self.assertEqual(importer.get_data('after.bin'), b'after')
+
+        importer = self.make_importer('ahead_solid.7z', [
+            ('one.bin', big), ('two.bin', big[::-1])])
+        self.assertEqual(importer.get_data('two.bin'), big[::-1])
+        self.assertEqual(importer.get_data('one.bin'), big)
+
+    def test_from_fileobj(self):
+        import io
+
+        class CountingFile(io.BytesIO):
+            calls = 0
+
+            def readinto(self, b):
+                CountingFile.calls += 1
+                return io.BytesIO.readinto(self, b)
+
+        data = bytes(range(256)) * 1024
+        path7z = self.make_archive('fileobj.7z', [
+            ('objpkg/__init__.py', b'value = "fileobj"\n'),
+            ('objpkg/data.bin', data),
+        ], solid=False)
+        with open(path7z, 'rb') as f:
+            fileobj = CountingFile(f.read())
+        importer = import7z.importer7z.from_fileobj(fileobj, 'virtual.7z')
+        self.assertEqual(importer.archive, 'virtual.7z')
+        self.assertEqual(importer.get_data('objpkg/data.bin'), data)
+        # the archive fits one block of the cache, read by a single call
+        self.assertEqual(CountingFile.calls, 1)
+
+        sys.path.insert(0, 'virtual.7z')
+        try:
+            import objpkg
+            self.assertEqual(objpkg.value, 'fileobj')
+            self.assertEqual(objpkg.__file__,
+                             os.path.join('virtual.7z', 'objpkg',
+                                          '__init__.py'))
+        finally:
+            sys.path.remove('virtual.7z')
+            sys.modules.pop('objpkg', None)
+
+    def test_from_buffer(self):
+        data = b'x' * 5000
+        for solid in (True, False):
+            path7z = self.make_archive('buffer.7z', [
+                ('bufpkg/__init__.py', b'value = "buffer"\n'),
+                ('bufpkg/data.bin', data),
+            ], solid=solid)
+            with open(path7z, 'rb') as f:
+                buffer = bytearray(f.read())
+            os.remove(path7z)
+            importer = import7z.importer7z.from_buffer(buffer, 'memory.7z')
+            stats = importer._read_stats
+            self.assertEqual(importer.get_data('bufpkg/data.bin'), data)
+            self.assertEqual(self.exec_code(importer, 'bufpkg')['value'],
+                             'buffer')
+            # decoded in place, with no reads
+            self.assertEqual(importer._read_stats['reads'], stats['reads'])
+            sub = import7z.importer7z(os.path.join('memory.7z', 'bufpkg'))
+            self.assertEqual(sub.get_data('bufpkg/data.bin'), data)
+            # the archive holds on to the buffer
+            self.assertRaises(BufferError, buffer.clear)
+
+    def test_prefixed_archive(self):
+        # a false signature, then a real one across two scan reads
+        stub = b'MZ' + b'\0' * 1000 + b'7z\xbc\xaf\x27\x1c' + b'\0' * 26
+        stub += b'\0' * (32 + (1 << 18) - 10 - len(stub))
+        for method in ('lzma2', 'copy'):
+            path7z = self.make_archive('sfx.bin', [
+                ('sfxmod.py', b'value = "sfx"\n'),
+                ('data.bin', b'sfx data'),
+            ], method=method, prefix=stub)
+            importer = import7z.importer7z(path7z)
+            self.assertEqual(importer.get_data('data.bin'), b'sfx data')
+            self.assertEqual(self.exec_code(importer, 'sfxmod')['value'],
+                             'sfx')
+            with open(path7z, 'rb') as f:
+                importer = import7z.importer7z.from_buffer(f.read(), 'sfx')
+            self.assertEqual(importer.get_data('data.bin'), b'sfx data')
+
+        path = os.path.join(self.tmpdir.name, 'not7z.bin')
+        with open(path, 'wb') as f:
+            f.write(stub)
+        self.assertRaises(import7z.Import7zError, import7z.importer7z, path)
+
+        # a stub larger than the head scan, found back from the end
+        stub = b'MZ' + bytes(range(256)) * (5 << 12)
+        path7z = self.make_archive('large_sfx.bin', [
+            ('data.bin', b'large sfx data'),
+        ], prefix=stub)
+        importer = import7z.importer7z(path7z)
+        self.assertEqual(importer.get_data('data.bin'), b'large sfx data')
+        with open(path7z, 'rb') as f:
+            importer = import7z.importer7z.from_buffer(f.read(), 'large_sfx')
+        self.assertEqual(importer.get_data('data.bin'), b'large sfx data')
+        with open(path7z, 'ab') as f:
+            f.write(b'trailing')
+        import7z._directory_cache.clear()
+        self.assertRaises(import7z.Import7zError, import7z.importer7z, path7z)
+
+    def test_file_info(self):
+        mtime = 1600000000.5
+        importer = self.make_importer('info.7z', [
+            ('pkg/__init__.py', b''),
+            ('pkg/info.txt', b'file info'),
+        ], mtime=mtime, attrib=0x20)
+        self.assertEqual(importer.get_data('pkg/info.txt'), b'file info')
+        size, mtime2, ctime, attrib = importer.get_file_info('pkg/info.txt')
+        self.assertEqual(size, 9)
+        self.assertAlmostEqual(mtime2, mtime, places=3)
+        self.assertIsNone(ctime)
+        self.assertEqual(attrib, 0x20)
+        self.assertRaises(IOError, importer.get_file_info, 'pkg/none.txt')
+
+        # archives without times report None
+        importer = self.make_importer('noinfo.7z', [
+            ('plain.txt', b'plain'),
+        ])
+        self.assertEqual(importer.get_file_info('plain.txt'),
+                         (5, None, None, None))
+
+    def test_file_names(self):
+        long_name = 'deep/' + 'x' * 300 + '.txt'
+        names = [long_name, 'caf\xe9.txt', '\u65e5\u672c.txt',
+                 'emoji\U0001f600.txt', 'ascii_name_of_some_length.txt',
+                 '\ufeffbom.txt']
+        importer = self.make_importer('names.7z', [
+            (name, name.encode('utf-8')) for name in names
+        ])
+        for name in names:
+            self.assertEqual(importer.get_data(name), name.encode('utf-8'))
+        self.assertEqual(importer.get_data(long_name.replace('/', os.sep)),
+                         long_name.encode('utf-8'))
+
+    def test_subpackage_importer(self):
+        path7z = self.make_archive('subpkg.7z', [
+            ('outer/__init__.py', b''),
+            ('outer/inner/__init__.py', b''),
+            ('outer/inner/leaf.py', b'value = "leaf"\n'),
+        ])
+        top = import7z.importer7z(path7z)
+        # Once the archive is open, subpackage importers are built from
+        # the cached directory while the file is unchanged.
+        importer = import7z.importer7z(os.path.join(path7z, 'outer', 'inner'))
+        self.assertEqual(importer.archive, path7z)
+        self.assertEqual(importer.prefix, os.path.join('outer', 'inner', ''))
+        self.assertIs(importer._files, top._files)
+        self.assertEqual(self.exec_code(importer, 'outer.inner.leaf')['value'],
+                         'leaf')
+
+        # a replaced archive is read again
+        self.make_archive('subpkg.7z', [
+            ('outer/__init__.py', b''),
+            ('outer/inner/__init__.py', b''),
+            ('outer/inner/other.py', b'value = "other"\n'),
+        ])
+        importer = import7z.importer7z(os.path.join(path7z, 'outer', 'inner'))
+        self.assertIsNot(importer._files, top._files)
+        self.assertIsNone(importer.find_spec('outer.inner.leaf'))
+        self.assertEqual(importer.get_data(os.path.join(
+            'outer', 'inner', 'other.py')), b'value = "other"\n')
+
+    def test_meta_path_finder(self):
+        first = self.make_archive('first.7z', [
+            ('finder_shadowed.py', b'origin = "first"\n'),
+            ('finder_pkg/__init__.py', b''),
+            ('finder_pkg/sub.py', b'origin = "first"\n'),
+        ])
+        second = self.make_archive('second.7z', [
+            ('finder_shadowed.py', b'origin = "second"\n'),
+            ('finder_second.py', b'origin = "second"\n'),
+            ('finder_pkg/__init__.py', b''),
+            ('finder_pkg/sub.py', b'origin = "second"\n'),
+            ('finder_pkg/extra.py', b'origin = "second"\n'),
+        ])
+        finder = import7z.finder7z([first, second])
+        self.assertEqual(finder.paths, [first, second])
+        self.assertIsNone(finder.find_spec('finder_missing'))
+
+        spec = finder.find_spec('finder_pkg')
+        self.assertEqual(spec.submodule_search_locations,
+                         [os.path.join(first, 'finder_pkg')])
+        spec = finder.find_spec('finder_pkg.sub',
+                                spec.submodule_search_locations)
+        self.assertEqual(spec.origin,
+                         os.path.join(first, 'finder_pkg', 'sub.py'))
+        # a submodule is only found where its package is
+        self.assertIsNone(finder.find_spec(
+            'finder_pkg.extra', [os.path.join(first, 'finder_pkg')]))
+
+        sys.meta_path.insert(0, finder)
+        try:
+            import finder_shadowed, finder_second
+            self.assertEqual(finder_shadowed.origin, 'first')
+            self.assertEqual(finder_second.origin, 'second')
+            self.assertIs(finder_shadowed.__spec__.loader.__class__,
+                          import7z.importer7z)
+        finally:
+            sys.meta_path.remove(finder)
+            for name in ('finder_shadowed', 'finder_second'):
+                sys.modules.pop(name, None)
+
+        # a directory before the archive on sys.path keeps its modules
+        plain = os.path.join(self.tmpdir.name, 'plain_dir')
+        os.mkdir(plain)
+        with open(os.path.join(plain, 'finder_shadowed.py'), 'w') as f:
+            f.write('origin = "directory"\n')
+        sys.path[:0] = [first, plain, second]
+        sys.meta_path.insert(0, finder)
+        try:
+            import finder_shadowed, finder_second
+            self.assertEqual(finder_shadowed.origin, 'first')
+            self.assertEqual(finder_second.origin, 'second')
+            sys.modules.pop('finder_shadowed')
+            sys.path.remove(plain)
+            sys.path.insert(0, plain)
+            self.assertIsNone(finder.find_spec('finder_shadowed'))
+            self.assertIsNotNone(finder.find_spec('finder_second'))
+            import finder_shadowed
+            self.assertEqual(finder_shadowed.origin, 'directory')
+        finally:
+            sys.meta_path.remove(finder)
+            for path in (first, plain, second):
+                if path in sys.path:
+                    sys.path.remove(path)
+                sys.path_importer_cache.pop(path, None)
+            for name in ('finder_shadowed', 'finder_second'):
+                sys.modules.pop(name, None)
+
+    def test_stored_entries(self):
+        entries = [
+            ('stored/__init__.py', b'value = "stored"\n'),
+            ('stored/a.bin', bytes(range(256)) * 4),
+            ('stored/b.bin', b'b' * 10),
+        ]
+        importer = self.make_importer('stored.7z', entries, method='copy')
+        for name, data in entries:
+            self.assertEqual(importer.get_data(name), data)
+        self.assertEqual(self.exec_code(importer, 'stored')['value'],
+                         'stored')
+
+    def test_concurrent_reads(self):
+        import threading
+        entries = [('file%d.bin' % i, bytes([i]) * (1000 + i))
+                   for i in range(8)]
+        importer = self.make_importer('threads.7z', entries, solid=False)
+        errors = []
+
+        def read_all():
+            try:
+                for _ in range(20):
+                    for name, data in entries:
+                        if importer.get_data(name) != data:
+                            errors.append(name)
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=read_all) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+
+    def test_resource_reader(self):
+        path7z = self.make_archive('res.7z', [
+            ('respak/__init__.py', b''),
+            ('respak/data.txt', b'resource data'),
+            ('respak/sub/more.txt', b'more'),
+        ])
+        importer = import7z.importer7z(path7z)
+        self.assertIsNone(importer.get_resource_reader('not_in_archive'))
+        reader = importer.get_resource_reader('respak')
+        self.assertEqual(sorted(reader.contents()),
+                         ['__init__.py', 'data.txt', 'sub'])
+        self.assertTrue(reader.is_resource('data.txt'))
+        self.assertFalse(reader.is_resource('sub'))
+        self.assertFalse(reader.is_resource('missing.txt'))
+        with reader.open_resource('data.txt') as f:
+            self.assertEqual(f.read(), b'resource data')
+        self.assertRaises(FileNotFoundError, reader.resource_path, 'data.txt')
+        self.assertEqual(importer.get_filename('respak'),
+                         os.path.join(path7z, 'respak', '__init__.py'))
+
+    def test_iter_modules(self):
+        path7z = self.make_archive('plugins.7z', [
+            ('plugins/__init__.py', b''),
+            ('plugins/zeta.py', b''),
+            ('plugins/alpha/__init__.py', b''),
+            ('plugins/alpha/impl.py', b''),
+            ('plugins/beta.pyc', b''),
+            ('plugins/data/notes.txt', b'notes'),
+            ('plugins/readme.txt', b'readme'),
+        ])
+        importer = import7z.importer7z(os.path.join(path7z, 'plugins'))
+        self.assertEqual(importer.iter_modules('plugins.'), [
+            ('plugins.alpha', True),
+            ('plugins.beta', False),
+            ('plugins.zeta', False),
+        ])
+        import pkgutil
+        self.assertEqual(
+            [(m.name, m.ispkg) for m in pkgutil.iter_modules(
+                [os.path.join(path7z, 'plugins', 'alpha')])],
+            [('impl', False)])
+
+        reader = import7z.importer7z(path7z).get_resource_reader('plugins')
+        self.assertEqual(reader.contents(), [
+            '__init__.py', 'alpha', 'beta.pyc', 'data', 'readme.txt',
+            'zeta.py'])
+
+    def test_streamed_resource(self):
+        # large enough to be decoded as it's read
+        data = bytes(range(256)) * 4096 + os.urandom(1 << 19)
+        for method in ('lzma2', 'copy'):
+            importer = self.make_importer('stream_%s.7z' % method, [
+                ('streamed/__init__.py', b''),
+                ('streamed/first.bin', data[:1000]),
+                ('streamed/large.bin', data),
+            ], method=method)
+            self.assertEqual(importer._files[os.path.join(
+                'streamed', 'large.bin')][2], len(data))
+            reader = importer.get_resource_reader('streamed')
+            with reader.open_resource('large.bin') as f:
+                self.assertTrue(f.seekable())
+                self.assertEqual(f.read(10), data[:10])
+                f.seek(1 << 20)
+                self.assertEqual(f.read(100), data[1 << 20:(1 << 20) + 100])
+                f.seek(-4, os.SEEK_END)
+                buf = bytearray(8)
+                self.assertEqual(f.readinto(buf), 4)
+                self.assertEqual(bytes(buf[:4]), data[-4:])
+                f.seek(5)
+                self.assertEqual(f.read(), data[5:])
+            with reader.open_resource('first.bin') as f:
+                self.assertEqual(f.read(), data[:1000])
+
+            # concurrent reads of the raw stream share one position
+            import threading
+            with reader.open_resource('large.bin') as f:
+                sizes, errors = [], []
+
+                def read_chunks():
+                    try:
+                        while True:
+                            chunk = f.raw.read(65521)
+                            if not chunk:
+                                break
+                            sizes.append(len(chunk))
+                    except Exception as e:
+                        errors.append(e)
+
+                threads = [threading.Thread(target=read_chunks)
+                           for _ in range(4)]
+                for t in threads:
+                    t.start()
+                for t in threads:
+                    t.join()
+                self.assertEqual(errors, [])
+                self.assertEqual(sum(sizes), len(data))
+                f.raw.seek(0)
+                chunk = f.raw.read(100)
+                # read() hands out the only reference to its result
+                self.assertEqual(sys.getrefcount(chunk), 2)
+
+    def test_streamed_resource_tail(self):
+        # small reads up to the end of the folder, where the decoder may
+        # still have output once all its input is consumed
+        data = bytes(range(256)) * 4096 + b'tail' * 1000
+        for method in ('lzma', 'lzma2'):
+            reader = self.make_importer('tail_%s.7z' % method, [
+                ('tailpkg/__init__.py', b''),
+                ('tailpkg/large.bin', data),
+            ], method=method).get_resource_reader('tailpkg')
+            for chunk in (1, 7):
+                with reader.open_resource('large.bin') as f:
+                    f.raw.seek(len(data) - 50000)
+                    parts = []
+                    while True:
+                        part = f.raw.read(chunk)
+                        if not part:
+                            break
+                        parts.append(part)
+                    self.assertEqual(b''.join(parts), data[-50000:])
+
+    def test_get_source_is_memoized(self):
+        importer = self.make_importer('source.7z', [
+            ('memoized.py', b'imported = True\n'),
+        ])
+        source = importer.get_source('memoized')
+        self.assertEqual(source, 'imported = True\n')
+        self.assertIs(importer.get_source('memoized'), source)
+
+    def test_get_source_honours_coding_cookie(self):
+        importer = self.make_importer('coding.7z', [
+            ('latin1.py',
+             b'# -*- coding: latin-1 -*-\r\nname = "caf\xe9"\r\n'),
+            ('bom.py', b'\xef\xbb\xbfname = "caf\xc3\xa9"\n'),
+        ])
+        self.assertEqual(importer.get_source('latin1'),
+                         '# -*- coding: latin-1 -*-\nname = "caf\xe9"\n')
+        self.assertEqual(importer.get_source_line('latin1', 2),
+                         'name = "caf\xe9"\n')
+        self.assertEqual(self.exec_code(importer, 'latin1')['name'],
+                         'caf\xe9')
+        self.assertEqual(importer.get_source('bom'), 'name = "caf\xe9"\n')
+
+    def test_source_cache_lru(self):
+        importer = self.make_importer('lru.7z', [
+            ('lru_old.py', b'a = 1\nb = 2\n'),
+            ('lru_new.py', b'c = 3\n'),
+        ])
+        importer.source_cache_limit = 16
+        old = importer.get_source('lru_old')
+        self.assertEqual(importer.get_source_line('lru_old', 2), 'b = 2\n')
+        self.assertEqual(importer.get_source_line('lru_old', 3), '')
+        self.assertLessEqual(importer._source_cache_size, 16)
+        new = importer.get_source('lru_new')
+        self.assertIs(importer.get_source('lru_new'), new)
+        # the older source was evicted to make room
+        self.assertIsNot(importer.get_source('lru_old'), old)
+        self.assertLessEqual(importer._source_cache_size, 16)
+
+    def test_source_cache_limit(self):
+        sources = [('lru_%d' % i, b'x = %d\n' % i * (i + 1))
+                   for i in range(6)]
+        importer = self.make_importer(
+            'lru_limit.7z', [(name + '.py', data) for name, data in sources])
+        for limit in (64, 40, 20):
+            importer.source_cache_limit = limit
+            for name, _ in sources * 2:
+                importer.get_source(name)
+                self.assertLessEqual(importer._source_cache_size, limit)
+                importer.get_source_line(name, 1)
+                self.assertLessEqual(importer._source_cache_size, limit)
+
+    def test_index_sidecar(self):
+        cache_dir = os.path.join(self.tmpdir.name, 'cache')
+        path7z = self.make_archive('sidecar.7z', [
+            ('indexed.py', b'imported = True\n'),
+        ])
+        import7z.enable_cache(cache_dir)
+        try:
+            import7z.importer7z(path7z)
+            sidecars = os.listdir(cache_dir)
+            self.assertEqual(len(sidecars), 1)
+            sidecar = os.path.join(cache_dir, sidecars[0])
+            with open(sidecar, 'rb') as f:
+                index = f.read()
+
+            # Break the end header while keeping the fingerprint, so the
+            # archive can only be opened through the sidecar.
+            stat = os.stat(path7z)
+            with open(path7z, 'r+b') as f:
+                f.seek(-2, os.SEEK_END)
+                f.write(b'\xff\xff')
+            os.utime(path7z, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+            import7z._directory_cache.clear()
+            importer = import7z.importer7z(path7z)
+            self.assertEqual(importer.get_data('indexed.py'),
+                             b'imported = True\n')
+
+            # A sidecar doesn't outlive changes to the archive: it's
+            # replaced by one for the new contents.
+            self.make_archive('sidecar.7z', [
+                ('indexed.py', b'imported = False\n'),
+            ])
+            import7z._directory_cache.clear()
+            importer = import7z.importer7z(path7z)
+            self.assertEqual(importer.get_data('indexed.py'),
+                             b'imported = False\n')
+            self.assertEqual(os.listdir(cache_dir), sidecars)
+            with open(sidecar, 'rb') as f:
+                self.assertNotEqual(f.read(), index)
+
+            # nor a rewrite within the same second
+            stat = os.stat(path7z)
+            with open(path7z, 'r+b') as f:
+                f.seek(-2, os.SEEK_END)
+                f.write(b'\xff\xff')
+            os.utime(path7z, ns=(stat.st_atime_ns, stat.st_mtime_ns // 10**9
+                                 * 10**9 + (stat.st_mtime_ns + 1) % 10**9))
+            import7z._directory_cache.clear()
+            self.assertRaises(import7z.Import7zError,
+                              import7z.importer7z, path7z)
+
+            # nor a same-sized rewrite behind an unchanged stub
+            stub = b'MZ' + b'\0' * 1000
+            path7z = self.make_archive('sidecar_sfx.bin', [
+                ('stale.txt', b'old'),
+            ], method='copy', prefix=stub)
+            stat = os.stat(path7z)
+            import7z.importer7z(path7z)
+            self.make_archive('sidecar_sfx.bin', [
+                ('stale.txt', b'new'),
+            ], method='copy', prefix=stub)
+            os.utime(path7z, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+            import7z._directory_cache.clear()
+            importer = import7z.importer7z(path7z)
+            self.assertEqual(importer.get_data('stale.txt'), b'new')
+        finally:
+            import7z.disable_cache()
+            import7z._directory_cache.clear()
+
+    def test_code_cache(self):
+        cache_dir = os.path.join(self.tmpdir.name, 'codecache')
+        path7z = self.make_archive('codecache.7z', [
+            ('cached_code.py', b'value = "compiled"\n'),
+        ])
+        import7z.enable_cache(cache_dir)
+        try:
+            importer = import7z.importer7z(path7z)
+            importer.get_code('cached_code')
+            pycs = [n for n in os.listdir(cache_dir) if n.endswith('.pyc')]
+            self.assertEqual(len(pycs), 1)
+
+            # Swap in other code to show that the cache is used.
+            code = compile('value = "cached"\n',
+                           os.path.join(path7z, 'cached_code.py'), 'exec')
+            with open(os.path.join(cache_dir, pycs[0]), 'wb') as f:
+                f.write(importlib.util.MAGIC_NUMBER + marshal.dumps(code))
+            self.assertEqual(self.exec_code(importer, 'cached_code')['value'],
+                             'cached')
+        finally:
+            import7z.disable_cache()
+            import7z._directory_cache.clear()
+
+    def test_concurrent_cache_writes(self):
+        import threading
+        os.mkdir(os.path.join(self.tmpdir.name, 'concurrent'))
+        path7z = self.make_archive(os.path.join('concurrent', 'c.7z'), [
+            ('snapshotted.py', b'value = 1\n' * 2000),
+        ])
+        errors = []
+
+        def write():
+            try:
+                for _ in range(10):
+                    import7z.snapshot(path7z, ['snapshotted'])
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=write) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(sorted(os.listdir(os.path.dirname(path7z))),
+                         ['c.7z', 'c.7z.7zsnap'])
+
+    def test_snapshot(self):
+        path7z = self.make_archive('snapshot.7z', [
+            ('snappkg/__init__.py', b'value = "package"\n'),
+            ('snapmod.py', b'value = "module"\n'),
+        ], method='copy')
+        import7z.snapshot(path7z, ['snappkg', 'snapmod'])
+
+        # Break the stored data while keeping the fingerprint, so the
+        # code can only come from the snapshot.
+        stat = os.stat(path7z)
+        with open(path7z, 'r+b') as f:
+            f.seek(32)
+            f.write(b'#')
+        os.utime(path7z, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+        import7z._directory_cache.clear()
+        importer = import7z.importer7z(path7z)
+        self.assertRaises(import7z.Import7zError,
+                          importer.get_data, 'snappkg/__init__.py')
+        self.assertTrue(importer.is_package('snappkg'))
+        for name, value in [('snappkg', 'package'), ('snapmod', 'module')]:
+            self.assertEqual(self.exec_code(importer, name)['value'], value)
+
+        # A snapshot doesn't outlive changes to the archive.
+        self.make_archive('snapshot.7z', [
+            ('snapmod.py', b'value = "changed"\n'),
+        ])
+        import7z._directory_cache.clear()
+        importer = import7z.importer7z(path7z)
+        self.assertEqual(self.exec_code(importer, 'snapmod')['value'],
+                         'changed')
 
 if __name__ == "__main__":
     unittest.main()